@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SERVER_PORT 8080
+#define BUFFER_SIZE 4096
+#define MAX_EVENTS 256
+#define MAX_THREADS 64
+
+// Latency histogram: 64 power-of-two ranges split into 32 linear sub-buckets,
+// which keeps every recorded value within about 3% of its true value
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+// One bot connection playing the text protocol
+typedef struct {
+    int fd;
+    int seat;            // 0 for X, 1 for O, -1 until the welcome line arrives
+    uint16_t occupied;   // Cells taken on the current board
+    uint64_t move_sent;  // When our outstanding move was sent, 0 if none
+    unsigned int rng;
+    int length;
+    char buffer[BUFFER_SIZE];
+} Bot;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int bot_count;
+    Bot* bots;
+    uint64_t games;
+    uint64_t moves;
+    uint64_t errors;
+    Histogram latency;
+} Worker;
+
+// Settings
+const char* server_ip = "127.0.0.1";
+int server_port = SERVER_PORT;
+int connection_count = 1000;
+int thread_count = 1;
+double duration_seconds = 10.0;
+uint64_t game_target = 0;     // Fixed game count mode when non-zero
+bool scripted_moves = false;  // Always take the lowest free cell instead of a random one
+bool json_output = false;
+const char* stats_path = NULL;  // Server stats socket, to count its system calls
+
+Worker workers[MAX_THREADS];
+pthread_barrier_t start_barrier;
+atomic_bool stop = false;
+atomic_uint_fast64_t games_played = 0;
+uint64_t start_time;          // Set by worker 0 once all connections are up
+
+// Function prototypes
+uint64_t now_ns();
+void histogram_record(Histogram* hist, uint64_t value);
+uint64_t histogram_percentile(Histogram* hist, double percentile);
+void histogram_merge(Histogram* into, Histogram* from);
+int connect_bot(Bot* bot);
+void* run_worker(void* arg);
+void handle_bot_input(Worker* worker, Bot* bot);
+void handle_bot_line(Worker* worker, Bot* bot, char* line);
+void make_bot_move(Worker* worker, Bot* bot);
+int64_t read_server_counter(const char* name);
+void print_report(double elapsed, int64_t syscalls);
+void print_usage(const char* program);
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void histogram_record(Histogram* hist, uint64_t value) {
+    int index;
+    if (value < HIST_SUB_BUCKETS) {
+        index = (int)value;
+    } else {
+        int exponent = 63 - __builtin_clzll(value);
+        int sub = (int)((value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+        index = (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+    }
+    hist->counts[index]++;
+    hist->total++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+uint64_t histogram_percentile(Histogram* hist, double percentile) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->total);
+    if (rank >= hist->total) {
+        rank = hist->total - 1;
+    }
+    
+    uint64_t seen = 0;
+    for (int index = 0; index < HIST_BUCKETS; index++) {
+        seen += hist->counts[index];
+        if (seen > rank) {
+            // Report the upper edge of the bucket
+            if (index < HIST_SUB_BUCKETS) {
+                return index;
+            }
+            int exponent = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+            uint64_t sub = index % HIST_SUB_BUCKETS;
+            uint64_t low = (1ULL << exponent) | (sub << (exponent - HIST_SUB_BITS));
+            uint64_t upper = low + (1ULL << (exponent - HIST_SUB_BITS)) - 1;
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void histogram_merge(Histogram* into, Histogram* from) {
+    for (int index = 0; index < HIST_BUCKETS; index++) {
+        into->counts[index] += from->counts[index];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+int connect_bot(Bot* bot) {
+    bot->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (bot->fd < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid server address %s\n", server_ip);
+        close(bot->fd);
+        return -1;
+    }
+    
+    if (connect(bot->fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connection failed");
+        close(bot->fd);
+        return -1;
+    }
+    
+    // Moves are tiny and latency-sensitive
+    int opt = 1;
+    setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    fcntl(bot->fd, F_SETFL, fcntl(bot->fd, F_GETFL, 0) | O_NONBLOCK);
+    
+    bot->seat = -1;
+    bot->occupied = 0;
+    bot->move_sent = 0;
+    bot->length = 0;
+    return 0;
+}
+
+void* run_worker(void* arg) {
+    Worker* worker = arg;
+    
+    int epoll_fd = epoll_create1(0);
+    worker->epoll_fd = epoll_fd;
+    if (epoll_fd < 0) {
+        perror("Epoll creation failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < worker->bot_count; i++) {
+        Bot* bot = &worker->bots[i];
+        bot->rng = (unsigned int)(worker->id * 7919 + i * 104729 + 1);
+        if (connect_bot(bot) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = bot;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->fd, &ev) < 0) {
+            perror("Epoll registration failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Start measuring only once every thread has its connections up
+    pthread_barrier_wait(&start_barrier);
+    if (worker->id == 0) {
+        start_time = now_ns();
+    }
+    
+    struct epoll_event events[MAX_EVENTS];
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Epoll wait error");
+            break;
+        }
+        
+        for (int i = 0; i < ready; i++) {
+            handle_bot_input(worker, events[i].data.ptr);
+        }
+        
+        if (worker->id == 0) {
+            double elapsed = (now_ns() - start_time) / 1e9;
+            if ((game_target == 0 && elapsed >= duration_seconds) ||
+                (game_target != 0 && atomic_load(&games_played) >= game_target)) {
+                atomic_store(&stop, true);
+            }
+        } else if (game_target != 0 && atomic_load(&games_played) >= game_target) {
+            break;
+        }
+    }
+    
+    for (int i = 0; i < worker->bot_count; i++) {
+        close(worker->bots[i].fd);
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+void handle_bot_input(Worker* worker, Bot* bot) {
+    // Drain the socket since epoll only reports the edge
+    while (1) {
+        int space = BUFFER_SIZE - 1 - bot->length;
+        if (space == 0) {
+            bot->length = 0;  // A line this long is not from our server
+            space = BUFFER_SIZE - 1;
+        }
+        
+        ssize_t bytes_read = recv(bot->fd, bot->buffer + bot->length, space, 0);
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes_read <= 0) {
+            if (!atomic_load(&stop)) {
+                fprintf(stderr, "Server closed a bot connection\n");
+                worker->errors++;
+            }
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, bot->fd, NULL);
+            return;
+        }
+        bot->length += bytes_read;
+        
+        // Handle every complete line, keep a partial one for the next read
+        char* start = bot->buffer;
+        char* end = bot->buffer + bot->length;
+        char* newline;
+        while ((newline = memchr(start, '\n', end - start)) != NULL) {
+            *newline = '\0';
+            handle_bot_line(worker, bot, start);
+            start = newline + 1;
+        }
+        bot->length = end - start;
+        memmove(bot->buffer, start, bot->length);
+    }
+}
+
+void handle_bot_line(Worker* worker, Bot* bot, char* line) {
+    int player, row, col;
+    char mark;
+    
+    if (sscanf(line, "Player %d (%c) placed at position (%d,%d)", &player, &mark, &row, &col) == 4) {
+        bot->occupied |= 1 << (row * 3 + col);
+        if (player - 1 == bot->seat && bot->move_sent != 0) {
+            histogram_record(&worker->latency, now_ns() - bot->move_sent);
+            bot->move_sent = 0;
+            worker->moves++;
+        }
+    } else if (sscanf(line, "It's Player %d's (%c) turn", &player, &mark) == 2) {
+        if (player - 1 == bot->seat) {
+            make_bot_move(worker, bot);
+        }
+    } else if (strstr(line, "wins!") != NULL || strncmp(line, "Game ended in a draw", 20) == 0) {
+        // Both players see the result, count it once
+        if (bot->seat == 0) {
+            worker->games++;
+            atomic_fetch_add_explicit(&games_played, 1, memory_order_relaxed);
+        }
+    } else if (strncmp(line, "Starting a new game", 19) == 0 ||
+               strncmp(line, "A player has disconnected", 25) == 0) {
+        bot->occupied = 0;
+        bot->move_sent = 0;
+    } else if (sscanf(line, "Welcome! You are Player %d", &player) == 1) {
+        bot->seat = player - 1;
+    } else if (strncmp(line, "Invalid move", 12) == 0) {
+        // Our view of the board was stale; try another cell
+        worker->errors++;
+        bot->move_sent = 0;
+        make_bot_move(worker, bot);
+    } else if (strncmp(line, "Server is full", 14) == 0) {
+        fprintf(stderr, "Server is full\n");
+        worker->errors++;
+    }
+}
+
+void make_bot_move(Worker* worker, Bot* bot) {
+    (void)worker;
+    uint16_t free_cells = ~bot->occupied & 0x1FF;
+    if (free_cells == 0 || bot->move_sent != 0 || atomic_load_explicit(&stop, memory_order_relaxed)) {
+        return;
+    }
+    
+    int cell;
+    if (scripted_moves) {
+        cell = __builtin_ctz(free_cells);
+    } else {
+        // Pick the n-th free cell
+        bot->rng ^= bot->rng << 13;
+        bot->rng ^= bot->rng >> 17;
+        bot->rng ^= bot->rng << 5;
+        int n = bot->rng % __builtin_popcount(free_cells);
+        while (n-- > 0) {
+            free_cells &= free_cells - 1;
+        }
+        cell = __builtin_ctz(free_cells);
+    }
+    
+    char command[32];
+    int length = snprintf(command, sizeof(command), "move %d %d\n", cell / 3, cell % 3);
+    bot->move_sent = now_ns();
+    if (send(bot->fd, command, length, 0) != length) {
+        worker->errors++;
+        bot->move_sent = 0;
+    }
+}
+
+// Reads one counter off the server's stats socket, or returns -1
+int64_t read_server_counter(const char* name) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, stats_path, sizeof(addr.sun_path) - 1);
+    if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Failed to read server stats");
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    
+    // The whole report comes at once, then the server closes the socket
+    static char report[1 << 20];
+    size_t length = 0;
+    ssize_t got;
+    while (length < sizeof(report) - 1 &&
+           (got = read(sock, report + length, sizeof(report) - 1 - length)) > 0) {
+        length += got;
+    }
+    report[length] = '\0';
+    close(sock);
+    
+    size_t name_length = strlen(name);
+    for (char* line = report; line != NULL && *line != '\0'; line = strchr(line, '\n')) {
+        if (*line == '\n') {
+            line++;
+        }
+        if (strncmp(line, name, name_length) == 0 && line[name_length] == ' ') {
+            return strtoll(line + name_length + 1, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+void print_report(double elapsed, int64_t syscalls) {
+    uint64_t games = 0;
+    uint64_t moves = 0;
+    uint64_t errors = 0;
+    static Histogram latency;
+    for (int i = 0; i < thread_count; i++) {
+        games += workers[i].games;
+        moves += workers[i].moves;
+        errors += workers[i].errors;
+        histogram_merge(&latency, &workers[i].latency);
+    }
+    
+    double p50 = histogram_percentile(&latency, 50.0) / 1000.0;
+    double p99 = histogram_percentile(&latency, 99.0) / 1000.0;
+    double p999 = histogram_percentile(&latency, 99.9) / 1000.0;
+    double max = latency.max / 1000.0;
+    double syscalls_per_move = syscalls >= 0 && moves > 0 ? (double)syscalls / moves : -1.0;
+    
+    if (json_output) {
+        printf("{\"connections\":%d,\"threads\":%d,\"mode\":\"%s\",\"duration_s\":%.3f,"
+               "\"games\":%llu,\"games_per_sec\":%.1f,\"moves\":%llu,\"moves_per_sec\":%.1f,"
+               "\"errors\":%llu,\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+               connection_count, thread_count, scripted_moves ? "scripted" : "random", elapsed,
+               (unsigned long long)games, games / elapsed, (unsigned long long)moves, moves / elapsed,
+               (unsigned long long)errors, p50, p99, p999, max);
+        if (syscalls_per_move >= 0) {
+            printf(",\"server_syscalls_per_move\":%.2f", syscalls_per_move);
+        }
+        printf("}\n");
+        return;
+    }
+    
+    printf("Connections: %d on %d threads, %s moves, %.2f s\n",
+           connection_count, thread_count, scripted_moves ? "scripted" : "random", elapsed);
+    printf("Games:  %llu (%.1f/s)\n", (unsigned long long)games, games / elapsed);
+    printf("Moves:  %llu (%.1f/s)\n", (unsigned long long)moves, moves / elapsed);
+    printf("Errors: %llu\n", (unsigned long long)errors);
+    printf("Move-to-board latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           p50, p99, p999, max);
+    if (syscalls_per_move >= 0) {
+        printf("Server system calls: %lld (%.2f per move)\n", (long long)syscalls, syscalls_per_move);
+    }
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-h server_ip] [-p port] [-c connections] [-t threads]\n"
+                    "          [-d seconds | -g games] [-s] [-j] [-S stats_socket]\n"
+                    "  -c  Bot connections to open, paired by the server (default 1000)\n"
+                    "  -t  Worker threads (default: number of cores)\n"
+                    "  -d  Run for a fixed duration (default 10 s)\n"
+                    "  -g  Run until this many games have finished\n"
+                    "  -s  Scripted moves (lowest free cell) instead of random ones\n"
+                    "  -j  Print the results as one JSON object\n"
+                    "  -S  Server stats socket; reports the server's system calls per move\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = cores > 0 ? (int)cores : 1;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:g:sjS:")) != -1) {
+        switch (opt) {
+            case 'h':
+                server_ip = optarg;
+                break;
+            case 'p':
+                server_port = atoi(optarg);
+                break;
+            case 'c':
+                connection_count = atoi(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'd':
+                duration_seconds = atof(optarg);
+                break;
+            case 'g':
+                game_target = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                scripted_moves = true;
+                break;
+            case 'j':
+                json_output = true;
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    
+    if (thread_count < 1 || thread_count > MAX_THREADS || connection_count < 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (thread_count > connection_count) {
+        thread_count = connection_count;
+    }
+    
+    // Thousands of bots need thousands of descriptors
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    
+    pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+    
+    for (int i = 0; i < thread_count; i++) {
+        Worker* worker = &workers[i];
+        worker->id = i;
+        worker->bot_count = connection_count / thread_count +
+                            (i < connection_count % thread_count ? 1 : 0);
+        worker->bots = calloc(worker->bot_count, sizeof(Bot));
+        if (worker->bots == NULL) {
+            perror("Failed to allocate bots");
+            return EXIT_FAILURE;
+        }
+        if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+            perror("Failed to start worker thread");
+            return EXIT_FAILURE;
+        }
+    }
+    
+    pthread_barrier_wait(&start_barrier);
+    int64_t syscalls_before = stats_path != NULL ? read_server_counter("ttt_syscalls_total") : -1;
+    
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    // Counted from when every bot is connected to when the last one stops
+    int64_t syscalls = -1;
+    if (syscalls_before >= 0) {
+        int64_t syscalls_after = read_server_counter("ttt_syscalls_total");
+        syscalls = syscalls_after >= syscalls_before ? syscalls_after - syscalls_before : -1;
+    }
+    print_report((now_ns() - start_time) / 1e9, syscalls);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <netinet/in.h>
+
+#include "capture.h"
+
+#define BLOCK_SIZE (1 << 16)     // Bytes per ring block, a multiple of the page size
+#define BLOCK_COUNT 32
+#define FRAME_SIZE 2048          // Only sets the ring's nominal frame count under TPACKET_V3
+#define BLOCK_TIMEOUT_MS 50      // A partly filled block is handed over after this long
+#define CAPTURE_SNAPLEN 128      // Enough for the largest IPv4 and TCP headers
+
+static int capture_fd = -1;
+static unsigned char* ring = NULL;
+static int next_block = 0;
+static CaptureStats totals;
+
+static void read_kernel_stats();
+
+int capture_open(int port) {
+    // Bound to no protocol for now, so nothing arrives before the filter is on
+    capture_fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (capture_fd < 0) {
+        perror("Packet socket creation failed");
+        return -1;
+    }
+    
+    // Cooked (SOCK_DGRAM) packets start at the IPv4 header whatever the link
+    // type, so the offsets below hold on loopback and Ethernet alike
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 8, 0),  // Our own sends
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),                       // Protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, 6),
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),                       // Fragment offset
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1FFF, 4, 0),
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                      // X = IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),                       // TCP destination port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)port, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, CAPTURE_SNAPLEN),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog filter = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    if (setsockopt(capture_fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
+        perror("Failed to attach capture filter");
+        capture_close();
+        return -1;
+    }
+    
+    int version = TPACKET_V3;
+    if (setsockopt(capture_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        perror("Failed to select TPACKET_V3");
+        capture_close();
+        return -1;
+    }
+    
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = BLOCK_SIZE;
+    req.tp_block_nr = BLOCK_COUNT;
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr = BLOCK_SIZE / FRAME_SIZE * BLOCK_COUNT;
+    req.tp_retire_blk_tov = BLOCK_TIMEOUT_MS;
+    if (setsockopt(capture_fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        perror("Failed to set up capture ring");
+        capture_close();
+        return -1;
+    }
+    
+    ring = mmap(NULL, (size_t)BLOCK_SIZE * BLOCK_COUNT, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_LOCKED, capture_fd, 0);
+    if (ring == MAP_FAILED) {
+        // Locking may exceed RLIMIT_MEMLOCK; the ring works unlocked too
+        ring = mmap(NULL, (size_t)BLOCK_SIZE * BLOCK_COUNT, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, capture_fd, 0);
+    }
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        perror("Failed to map capture ring");
+        capture_close();
+        return -1;
+    }
+    
+    // Start receiving IPv4 from every interface
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex = 0;
+    if (bind(capture_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Packet socket bind failed");
+        capture_close();
+        return -1;
+    }
+    
+    next_block = 0;
+    memset(&totals, 0, sizeof(totals));
+    return capture_fd;
+}
+
+void capture_drain(void (*packet)(const unsigned char* ip, uint32_t length)) {
+    // Blocks are handed over in ring order, so stop at the first one still owned by the kernel
+    while (1) {
+        struct tpacket_block_desc* block = (void*)(ring + (size_t)next_block * BLOCK_SIZE);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            break;
+        }
+        
+        uint32_t count = block->hdr.bh1.num_pkts;
+        unsigned char* at = (unsigned char*)block + block->hdr.bh1.offset_to_first_pkt;
+        for (uint32_t i = 0; i < count; i++) {
+            struct tpacket3_hdr* hdr = (struct tpacket3_hdr*)at;
+            packet(at + hdr->tp_net, hdr->tp_snaplen);
+            at += hdr->tp_next_offset;
+        }
+        totals.delivered += count;
+        totals.blocks++;
+        
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        next_block = (next_block + 1) % BLOCK_COUNT;
+    }
+}
+
+void capture_stats(CaptureStats* stats) {
+    read_kernel_stats();
+    *stats = totals;
+}
+
+void capture_close() {
+    if (ring != NULL) {
+        munmap(ring, (size_t)BLOCK_SIZE * BLOCK_COUNT);
+        ring = NULL;
+    }
+    if (capture_fd >= 0) {
+        close(capture_fd);
+        capture_fd = -1;
+    }
+}
+
+// The kernel resets its counters on every read, so keep running totals
+static void read_kernel_stats() {
+    struct tpacket_stats_v3 kernel;
+    socklen_t length = sizeof(kernel);
+    if (capture_fd >= 0 &&
+        getsockopt(capture_fd, SOL_PACKET, PACKET_STATISTICS, &kernel, &length) == 0) {
+        totals.matched += kernel.tp_packets;
+        totals.dropped += kernel.tp_drops;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+// Raw capture of the TCP segments sent to one local port.
+//
+// An AF_PACKET socket carries a classic BPF program that keeps only
+// incoming IPv4 TCP segments for the port, so the kernel drops every other
+// packet on the host before it is copied anywhere. Matching packets land in
+// a TPACKET_V3 ring mapped into the process. The kernel fills whole blocks
+// of packets and hands each block over by flipping its status word, so one
+// wakeup reads a batch of packets without a system call per packet.
+
+typedef struct {
+    uint64_t matched;    // Accepted by the filter, as counted by the kernel
+    uint64_t dropped;    // Matched but lost because the ring was full
+    uint64_t delivered;  // Read out of the ring
+    uint64_t blocks;     // Ring blocks read, one batch of packets each
+} CaptureStats;
+
+// Opens the capture socket and maps its ring. Returns the socket, which
+// becomes readable when a block is ready, or -1 after printing the error.
+int capture_open(int port);
+
+// Reads every block the kernel has handed over, calling packet() with the
+// IPv4 header and length of each captured segment, then returns the blocks.
+void capture_drain(void (*packet)(const unsigned char* ip, uint32_t length));
+
+// Counters since capture_open()
+void capture_stats(CaptureStats* stats);
+
+void capture_close();
+
+#endif
@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
@@ -13,26 +16,91 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "shm.h"
 
 #define SERVER_PORT 8080
 #define BUFFER_SIZE 1024
+#define RECONNECT_ATTEMPTS 10  // Tries, a second apart, to get back in after losing the server
+#define DEFAULT_LOCAL_PATH "/tmp/ttt_local.sock"
+#define SHM_SPIN_NS 50000      // A benchmark spins on the ring this long before sleeping, given a spare core
 
 // Global variables
 int client_socket;
 struct termios orig_termios;
 int connected = 0;
+char session_token[17] = "";  // Resume token from the welcome message, for reconnecting
+
+// Binary protocol state
+int binary_mode = 0;     // Asked for the binary protocol with -b
+int binary_active = 0;   // Server acknowledged the switch
+int my_seat = -1;
+uint32_t my_room = 0;
+uint16_t move_seq = 0;
+uint16_t board_marks[2];  // Last board seen in a state frame, X then O
+int board_rows = 3;       // Size of the board, changed by board frames
+int board_cols = 3;
+char big_board[19][19];   // Cells of a board other than 3x3
+int spectating = 0;       // Watching a room instead of playing
+int board_changed = 0;    // Cells arrived for a watched big board, not printed yet
+int board_code = 0;       // State code of the last of those cells
+char pending[BUFFER_SIZE * 2];  // Received bytes not yet forming a line or frame
+int pending_length = 0;
+
+// Delta protocol state
+int delta_mode = 0;      // Asked for state and delta lines with -d or 'delta'
+int have_board = 0;      // big_board holds the board as of delta_seq
+unsigned int delta_seq = 0;
+int resyncing = 0;       // Missed a delta and asked for the whole board
+
+// Local transport: the server's Unix socket (-l), moved to shared memory
+// with -m once the server answers 'shm'
+const char* local_path = NULL;
+int use_shm = 0;
+ShmChannel* shm = NULL;
+int shm_wake_fd = -1;     // Written to wake the server
+int shm_notify_fd = -1;   // Written by the server to wake us
+uint64_t spin_ns = 0;     // SHM_SPIN_NS, or 0 on one core where spinning only delays the server
 
 // Function prototypes
 void cleanup();
 void reset_terminal();
 void set_terminal_raw_mode();
 void handle_server_message(char* message);
+void handle_server_data(char* data, int length);
+void handle_server_frame(ServerFrame* frame);
+void print_board_masks(uint16_t x_mask, uint16_t o_mask);
+void print_analysis(ServerFrame* frame);
+void print_big_board();
+void print_turn(int code);
+int handle_delta_line(const char* line);
+int outcome_code(const char* outcome);
+void print_local_board();
+void send_command(const char* command);
 void print_help();
 int connect_to_server(const char* server_ip);
+int receive(char* buffer, int size);
+void start_shm(int* fds, int count);
+void stop_shm();
+int read_shm(char* buffer, int size);
+void send_bytes(const void* data, size_t length);
 void send_message(const char* message);
+void remember_token(const char* data);
+void send_resume(const char* token);
+int reconnect(const char* server_ip);
+uint64_t now_ns();
+int wait_for_data(char* buffer, int size);
+int read_line(char* line, int size);
+int compare_samples(const void* a, const void* b);
+int run_benchmark(int moves);
 
 void cleanup() {
     if (connected) {
+        stop_shm();
         close(client_socket);
         connected = 0;
     }
@@ -61,6 +129,26 @@ void set_terminal_raw_mode() {
 }
 
 int connect_to_server(const char* server_ip) {
+    // A server on this host is reached through its Unix socket
+    if (local_path != NULL) {
+        struct sockaddr_un local_addr;
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sun_family = AF_UNIX;
+        snprintf(local_addr.sun_path, sizeof(local_addr.sun_path), "%s", local_path);
+        client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (client_socket < 0) {
+            perror("Socket creation failed");
+            return -1;
+        }
+        if (connect(client_socket, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
+            perror("Connection failed");
+            close(client_socket);
+            return -1;
+        }
+        connected = 1;
+        return 0;
+    }
+    
     // Create standard socket for client
     client_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (client_socket < 0) {
@@ -100,19 +188,740 @@ int connect_to_server(const char* server_ip) {
     return 0;
 }
 
+// Reads what the socket has. Descriptors that come along are the server's
+// answer to 'shm': the rings and eventfds that carry everything from then on.
+int receive(char* buffer, int size) {
+    union {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = buffer, .iov_len = size };
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    int length = recvmsg(client_socket, &header, MSG_CMSG_CLOEXEC);
+    
+    struct cmsghdr* cmsg = length > 0 ? CMSG_FIRSTHDR(&header) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int fds[3];
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        count = count > 3 ? 3 : count;
+        memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        start_shm(fds, count);
+    }
+    return length;
+}
+
+void start_shm(int* fds, int count) {
+    ShmChannel* channel = count == 3 && shm == NULL ? shm_map(fds[0]) : NULL;
+    if (count > 0) {
+        close(fds[0]);
+    }
+    if (channel == NULL) {
+        for (int i = 1; i < count; i++) {
+            close(fds[i]);
+        }
+        return;
+    }
+    shm = channel;
+    shm_wake_fd = fds[1];
+    shm_notify_fd = fds[2];
+}
+
+void stop_shm() {
+    if (shm != NULL) {
+        shm_unmap(shm);
+        close(shm_wake_fd);
+        close(shm_notify_fd);
+        shm = NULL;
+    }
+}
+
+// Takes what the server has put in the ring, telling it if it was waiting
+// for room
+int read_shm(char* buffer, int size) {
+    int total = 0;
+    uint32_t length;
+    const char* data = shm_peek(&shm->to_client, &length);
+    while (total < size && length > 0) {
+        if (length > (uint32_t)(size - total)) {
+            length = size - total;
+        }
+        memcpy(buffer + total, data, length);
+        total += length;
+        if (shm_consume(&shm->to_client, length)) {
+            eventfd_write(shm_wake_fd, 1);
+        }
+        data = shm_peek(&shm->to_client, &length);
+    }
+    return total;
+}
+
+// Sends through the ring once the server has switched us over, and through
+// the socket until then
+void send_bytes(const void* data, size_t length) {
+    if (shm == NULL) {
+        send(client_socket, data, length, 0);
+        return;
+    }
+    const char* bytes = data;
+    while (1) {
+        uint32_t written = shm_write(&shm->to_server, bytes, length);
+        bytes += written;
+        length -= written;
+        if (shm_wake_needed(&shm->server_sleeping)) {
+            eventfd_write(shm_wake_fd, 1);
+        }
+        if (length == 0) {
+            return;
+        }
+        
+        // Full: the server says when it has read some
+        if (!shm_wait_for_room(&shm->to_server)) {
+            struct pollfd waiting = { .fd = shm_notify_fd, .events = POLLIN };
+            poll(&waiting, 1, 100);
+            eventfd_t count;
+            eventfd_read(shm_notify_fd, &count);
+        }
+    }
+}
+
 void handle_server_message(char* message) {
     // Simply print the message, as server sends formatted board and game info
     printf("%s", message);
 }
 
+void handle_server_data(char* data, int length) {
+    remember_token(data);
+    if (!binary_mode && !delta_mode) {
+        handle_server_message(data);
+        return;
+    }
+    
+    if (pending_length + length > (int)sizeof(pending)) {
+        pending_length = 0;  // Cannot happen with a well-behaved server
+    }
+    memcpy(pending + pending_length, data, length);
+    pending_length += length;
+    
+    // Until the server acknowledges the switch, the stream is still text lines
+    int offset = 0;
+    while (!binary_active) {
+        char* newline = memchr(pending + offset, '\n', pending_length - offset);
+        if (newline == NULL) {
+            break;
+        }
+        int line_length = newline - (pending + offset);
+        *newline = '\0';
+        if (line_length == 9 && strncmp(pending + offset, "OK binary", 9) == 0) {
+            binary_active = 1;
+        } else if (!delta_mode || !handle_delta_line(pending + offset)) {
+            printf("%s\n", pending + offset);
+        }
+        offset += line_length + 1;
+    }
+    
+    // After that every SERVER_FRAME_SIZE bytes are one frame
+    while (binary_active && pending_length - offset >= SERVER_FRAME_SIZE) {
+        ServerFrame frame;
+        decode_server_frame((unsigned char*)pending + offset, &frame);
+        handle_server_frame(&frame);
+        offset += SERVER_FRAME_SIZE;
+    }
+    
+    // A watched big board comes as the whole board every time; show it once
+    if (board_changed) {
+        print_big_board();
+        print_turn(board_code);
+        board_changed = 0;
+    }
+    
+    memmove(pending, pending + offset, pending_length - offset);
+    pending_length -= offset;
+}
+
+void print_board_masks(uint16_t x_mask, uint16_t o_mask) {
+    printf("\n  0 1 2\n");
+    for (int i = 0; i < 3; i++) {
+        printf("%d ", i);
+        for (int j = 0; j < 3; j++) {
+            int cell = 1 << (i * 3 + j);
+            printf("%c", (x_mask & cell) ? 'X' : (o_mask & cell) ? 'O' : ' ');
+            if (j < 2) printf("|");
+        }
+        printf("\n");
+        if (i < 2) printf("  -+-+-\n");
+    }
+    printf("\n");
+}
+
+void print_big_board() {
+    printf("\n   ");
+    for (int col = 0; col < board_cols; col++) {
+        printf("%3d", col);
+    }
+    for (int row = 0; row < board_rows; row++) {
+        printf("\n%3d", row);
+        for (int col = 0; col < board_cols; col++) {
+            printf("  %c", big_board[row][col]);
+        }
+    }
+    printf("\n\n");
+}
+
+void print_turn(int code) {
+    int result = code >> STATE_RESULT_SHIFT;
+    int turn = (code & STATE_TURN_O) ? 1 : 0;
+    if (result == RESULT_X_WINS || result == RESULT_O_WINS) {
+        int winner = (result == RESULT_X_WINS) ? 0 : 1;
+        printf("Player %d (%c) wins!%s\n", winner + 1, winner == 0 ? 'X' : 'O',
+               winner == my_seat ? " That's you." : "");
+    } else if (result == RESULT_DRAW) {
+        printf("Game ended in a draw!\n");
+    } else {
+        printf("It's Player %d's (%c) turn%s\n", turn + 1, turn == 0 ? 'X' : 'O',
+               turn == my_seat ? " (your move)" : "");
+    }
+}
+
+// Applies a state or delta line to the local board and shows the board.
+// Returns 0 for any other line.
+int handle_delta_line(const char* line) {
+    unsigned int seq;
+    int rows, cols, cell, cells;
+    char mark;
+    char outcome[32];
+    if (sscanf(line, "state %u %d %d %n", &seq, &rows, &cols, &cells) == 3) {
+        // A line cut short would have the outcome read from past its end
+        if (rows < 3 || rows > 19 || cols < 3 || cols > 19 ||
+            (int)strlen(line + cells) < rows * cols ||
+            sscanf(line + cells + rows * cols, ", %31[^\n]", outcome) != 1) {
+            return 0;
+        }
+        board_rows = rows;
+        board_cols = cols;
+        for (cell = 0; cell < rows * cols; cell++) {
+            big_board[cell / cols][cell % cols] = line[cells + cell];
+        }
+        delta_seq = seq;
+        have_board = 1;
+        resyncing = 0;
+        print_local_board();
+        print_turn(outcome_code(outcome));
+        return 1;
+    }
+    
+    if (sscanf(line, "delta %u cell %d = %c, %31[^\n]", &seq, &cell, &mark, outcome) != 4) {
+        return 0;
+    }
+    
+    // A missed update leaves the local board behind; ask for the whole
+    // board and ignore deltas until it comes
+    if (!have_board || seq != ((delta_seq + 1) & 0xFFFF) || cell < 0 || cell >= board_rows * board_cols) {
+        have_board = 0;
+        if (!resyncing) {
+            send_message("resync");
+            resyncing = 1;
+        }
+        return 1;
+    }
+    delta_seq = seq;
+    big_board[cell / board_cols][cell % board_cols] = mark;
+    printf("Player %d (%c) placed at position (%d,%d)\n",
+           mark == 'X' ? 1 : 2, mark, cell / board_cols, cell % board_cols);
+    print_local_board();
+    print_turn(outcome_code(outcome));
+    return 1;
+}
+
+// The end of a state or delta line as a state code for print_turn
+int outcome_code(const char* outcome) {
+    if (strcmp(outcome, "X wins") == 0) {
+        return RESULT_X_WINS << STATE_RESULT_SHIFT;
+    }
+    if (strcmp(outcome, "O wins") == 0) {
+        return RESULT_O_WINS << STATE_RESULT_SHIFT;
+    }
+    if (strcmp(outcome, "draw") == 0) {
+        return RESULT_DRAW << STATE_RESULT_SHIFT;
+    }
+    return strcmp(outcome, "turn O") == 0 ? STATE_TURN_O : 0;
+}
+
+void print_local_board() {
+    if (board_rows != 3 || board_cols != 3) {
+        print_big_board();
+        return;
+    }
+    uint16_t masks[2] = { 0, 0 };
+    for (int cell = 0; cell < 9; cell++) {
+        char mark = big_board[cell / 3][cell % 3];
+        if (mark == 'X' || mark == 'O') {
+            masks[mark == 'O'] |= 1 << cell;
+        }
+    }
+    print_board_masks(masks[0], masks[1]);
+}
+
+void print_analysis(ServerFrame* frame) {
+    // Same layout as the text protocol's analyze answer
+    static const char value_marks[4] = { ' ', 'L', 'D', 'W' };
+    static const char* value_names[4] = { "", "loss", "draw", "win" };
+    uint32_t values = frame->a | (uint32_t)frame->b << 16;
+    
+    printf("Analysis (W = win, D = draw, L = loss)\n\n  0 1 2\n");
+    for (int i = 0; i < 3; i++) {
+        printf("%d ", i);
+        for (int j = 0; j < 3; j++) {
+            int cell = i * 3 + j;
+            char mark = (board_marks[0] >> cell) & 1 ? 'X' : (board_marks[1] >> cell) & 1 ? 'O' :
+                        value_marks[(values >> (cell * 2)) & 3];
+            printf("%c", mark);
+            if (j < 2) printf("|");
+        }
+        printf("\n");
+        if (i < 2) printf("  -+-+-\n");
+    }
+    printf("\nBest move: move %d %d (%s)\n", frame->code / 3, frame->code % 3,
+           value_names[(values >> (frame->code * 2)) & 3]);
+}
+
+void handle_server_frame(ServerFrame* frame) {
+    if (frame->type == FRAME_STATE) {
+        board_marks[0] = frame->a;
+        board_marks[1] = frame->b;
+        print_board_masks(frame->a, frame->b);
+        print_turn(frame->code);
+        return;
+    }
+    
+    if (frame->type == FRAME_BOARD) {
+        board_rows = frame->a;
+        board_cols = frame->b;
+        memset(big_board, '.', sizeof(big_board));
+        if (!spectating) {
+            printf("Board is %dx%d, %d in a row wins.\n", board_rows, board_cols, frame->code);
+        }
+        return;
+    }
+    
+    if (frame->type == FRAME_CELL) {
+        int row = frame->a >> 8;
+        int col = frame->a & 0xFF;
+        if (row < 19 && col < 19) {
+            big_board[row][col] = frame->b == 0 ? 'X' : 'O';
+        }
+        if (spectating) {
+            board_changed = 1;
+            board_code = frame->code;
+            return;
+        }
+        printf("Player %d (%c) placed at position (%d,%d)\n",
+               frame->b + 1, frame->b == 0 ? 'X' : 'O', row, col);
+        print_big_board();
+        print_turn(frame->code);
+        return;
+    }
+    
+    if (frame->type == FRAME_ANALYSIS) {
+        print_analysis(frame);
+        return;
+    }
+    
+    if (frame->type == FRAME_RESUMED) {
+        // Seat and board in one frame; the room is the low half of the token
+        my_seat = (frame->code & RESUMED_SEAT_O) ? 1 : 0;
+        my_room = (uint32_t)strtoull(session_token, NULL, 16);
+        printf("Back in your game as Player %d (%c) in room %u\n",
+               my_seat + 1, my_seat == 0 ? 'X' : 'O', my_room);
+        if (!(frame->code & RESUMED_BIG_BOARD)) {
+            board_rows = 3;
+            board_cols = 3;
+            board_marks[0] = frame->a;
+            board_marks[1] = frame->b;
+            print_board_masks(frame->a, frame->b);
+            print_turn(frame->code & (STATE_TURN_O | 3 << STATE_RESULT_SHIFT));
+        }
+        return;
+    }
+    
+    if (frame->type != FRAME_EVENT) {
+        printf("Unexpected frame type %d from server\n", frame->type);
+        return;
+    }
+    
+    switch (frame->code) {
+        case EVENT_JOINED:
+            spectating = 0;
+            my_seat = frame->seq;
+            my_room = ((uint32_t)frame->a << 16) | frame->b;
+            printf("Binary protocol active: Player %d (%c) in room %u\n",
+                   my_seat + 1, my_seat == 0 ? 'X' : 'O', my_room);
+            break;
+        case EVENT_WAITING:
+            printf("Waiting for another player to join...\n");
+            break;
+        case EVENT_STARTED:
+            printf("Game is starting!\n");
+            break;
+        case EVENT_NOT_STARTED:
+            printf("The game has not started yet. Please wait.\n");
+            break;
+        case EVENT_NOT_YOUR_TURN:
+            printf("Not your turn! Please wait.\n");
+            break;
+        case EVENT_INVALID_MOVE:
+            printf("Invalid move! Try again.\n");
+            break;
+        case EVENT_OPPONENT_QUIT:
+            printf("A player has quit the game.\n");
+            break;
+        case EVENT_OPPONENT_LEFT:
+            printf("A player has disconnected.\n");
+            break;
+        case EVENT_OPPONENT_AWAY:
+            printf("Your opponent lost their connection. Their seat is held for a while.\n");
+            break;
+        case EVENT_TIMEOUT:
+            printf("Game timed out due to inactivity.\n");
+            break;
+        case EVENT_SHUTDOWN:
+            printf("Server is shutting down. Goodbye!\n");
+            break;
+        case EVENT_UNSUPPORTED:
+            printf("Not available on this board size.\n");
+            break;
+        case EVENT_RESUMED:
+            printf("Back in your game.\n");
+            break;
+        case EVENT_RESUME_FAILED:
+            printf("No game to resume for that token. Joined as a new player.\n");
+            break;
+        case EVENT_INVALID_BOARD:
+            printf("Board rejected. Sides must be 3-19, k at least 3, and only while waiting.\n");
+            break;
+        case EVENT_BOT_UNAVAILABLE:
+            printf("You can only play the bot while waiting for an opponent.\n");
+            break;
+        case EVENT_WATCHING:
+            spectating = 1;
+            my_seat = -1;
+            my_room = ((uint32_t)frame->a << 16) | frame->b;
+            printf("Watching room %u. Type 'watch <room>' to watch another, 'quit' to leave.\n", my_room);
+            break;
+        case EVENT_WATCH_FAILED:
+            printf("No game to watch in that room, or you are playing one.\n");
+            break;
+        case EVENT_WATCH_ENDED:
+            printf("The game you were watching is over.\n");
+            break;
+        default:
+            printf("Unknown event %d from server\n", frame->code);
+            break;
+    }
+}
+
+void send_command(const char* command) {
+    if (strncmp(command, "resume ", 7) == 0) {
+        send_resume(command + 7);
+        return;
+    }
+    if (!binary_active) {
+        // The lines that come back are parsed rather than printed as they are
+        if (strcmp(command, "delta") == 0 || strcmp(command, "delta on") == 0) {
+            delta_mode = 1;
+        } else if (strcmp(command, "delta off") == 0) {
+            delta_mode = 0;
+        }
+        send_message(command);
+        return;
+    }
+    
+    // In binary mode, translate the typed command into a frame
+    int row, col, k;
+    unsigned int room;
+    ClientFrame frame = { 0, 0, ++move_seq, my_room, 0 };
+    if (sscanf(command, "move %d %d", &row, &col) == 2) {
+        if (row < 0 || row >= board_rows || col < 0 || col >= board_cols) {
+            printf("Invalid move! Rows are 0-%d and cols 0-%d.\n", board_rows - 1, board_cols - 1);
+            return;
+        }
+        frame.type = FRAME_MOVE;
+        frame.cell = row * board_cols + col;
+    } else if (sscanf(command, "board %d %d %d", &row, &col, &k) == 3) {
+        if (row < 0 || row > 31 || col < 0 || col > 31 || k < 0 || k > 31) {
+            printf("Board rejected. Sides must be 3-19, k at least 3, and only while waiting.\n");
+            return;
+        }
+        frame.type = FRAME_SET_BOARD;
+        frame.cell = row << 10 | col << 5 | k;
+    } else if (sscanf(command, "watch %u", &room) == 1) {
+        frame.type = FRAME_WATCH;
+        frame.room = room;
+    } else if (strncmp(command, "quit", 4) == 0) {
+        frame.type = FRAME_QUIT;
+    } else if (strcmp(command, "hint") == 0 || strcmp(command, "analyze") == 0) {
+        frame.type = FRAME_ANALYZE;
+    } else if (strncmp(command, "play bot", 8) == 0) {
+        const char* level = command + 8;
+        while (*level == ' ') {
+            level++;
+        }
+        frame.type = FRAME_PLAY_BOT;
+        if (*level == '\0' || strcmp(level, "hard") == 0) {
+            frame.cell = 3;
+        } else if (strcmp(level, "medium") == 0) {
+            frame.cell = 2;
+        } else if (strcmp(level, "easy") == 0) {
+            frame.cell = 1;
+        } else {
+            printf("Unknown difficulty. Use easy, medium or hard.\n");
+            return;
+        }
+    } else if (strncmp(command, "help", 4) == 0) {
+        print_help();
+        return;
+    } else {
+        printf("Unknown command. Type 'help' for available commands.\n");
+        return;
+    }
+    
+    unsigned char bytes[CLIENT_FRAME_SIZE];
+    encode_client_frame(&frame, bytes);
+    send_bytes(bytes, CLIENT_FRAME_SIZE);
+}
+
 void send_message(const char* message) {
-    send(client_socket, message, strlen(message), 0);
+    // Commands are newline-terminated so the server can split pipelined input
+    char line[BUFFER_SIZE + 1];
+    int length = snprintf(line, sizeof(line), "%s\n", message);
+    send_bytes(line, length);
+}
+
+void remember_token(const char* data) {
+    const char* found = strstr(data, "resume token is ");
+    if (found != NULL) {
+        sscanf(found + 16, "%16[0-9a-f]", session_token);
+    }
+}
+
+void send_resume(const char* token) {
+    // Kept for reconnecting, should the connection drop again
+    snprintf(session_token, sizeof(session_token), "%s", token);
+    if (!binary_mode) {
+        char resume[BUFFER_SIZE];
+        snprintf(resume, sizeof(resume), "resume %s", token);
+        send_message(resume);
+        return;
+    }
+    
+    // The token is split over the frame's fields; the seat and board come
+    // back in one frame
+    uint64_t value = strtoull(token, NULL, 16);
+    ClientFrame frame = { FRAME_RESUME, 0, (uint16_t)(value >> 48), (uint32_t)value,
+                          (uint16_t)(value >> 32) };
+    unsigned char bytes[CLIENT_FRAME_SIZE];
+    encode_client_frame(&frame, bytes);
+    send_bytes(bytes, CLIENT_FRAME_SIZE);
+}
+
+int reconnect(const char* server_ip) {
+    // The server holds our seat for a while, so come back with the token
+    stop_shm();
+    close(client_socket);
+    connected = 0;
+    for (int attempt = 1; attempt <= RECONNECT_ATTEMPTS; attempt++) {
+        printf("Reconnecting (attempt %d of %d)...\n", attempt, RECONNECT_ATTEMPTS);
+        if (connect_to_server(server_ip) == 0) {
+            binary_active = 0;
+            pending_length = 0;
+            have_board = 0;
+            resyncing = 0;
+            if (use_shm) {
+                send_message("shm");
+            }
+            if (binary_mode) {
+                send_message("binary");
+            } else if (delta_mode) {
+                send_message("delta");
+            }
+            send_resume(session_token);
+            return 0;
+        }
+        sleep(1);
+    }
+    return -1;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Blocks until the server sends something. On shared memory, spins on the
+// ring for a while before sleeping on the eventfd; the socket then only
+// wakes us when the server is gone. Returns 0 once it is.
+int wait_for_data(char* buffer, int size) {
+    if (shm == NULL) {
+        return receive(buffer, size);
+    }
+    uint64_t start = now_ns();
+    while (1) {
+        int length = read_shm(buffer, size);
+        if (length > 0) {
+            return length;
+        }
+        if (now_ns() - start < spin_ns || !shm_sleep(&shm->to_client, &shm->client_sleeping)) {
+            continue;
+        }
+        struct pollfd fds[2] = { { .fd = shm_notify_fd, .events = POLLIN },
+                                 { .fd = client_socket, .events = POLLIN } };
+        poll(fds, 2, -1);
+        atomic_store(&shm->client_sleeping, 0);
+        if (fds[0].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(shm_notify_fd, &count);
+        }
+        if ((fds[1].revents & (POLLIN | POLLHUP)) && shm_readable(&shm->to_client) == 0) {
+            return receive(buffer, size);
+        }
+        start = now_ns();
+    }
+}
+
+// Reads the next line from the server into line, without the newline.
+// Returns -1 once the server is gone.
+int read_line(char* line, int size) {
+    while (1) {
+        char* newline = memchr(pending, '\n', pending_length);
+        if (newline != NULL) {
+            int length = newline - pending;
+            int kept = length < size - 1 ? length : size - 1;
+            memcpy(line, pending, kept);
+            line[kept] = '\0';
+            pending_length -= length + 1;
+            memmove(pending, newline + 1, pending_length);
+            return kept;
+        }
+        if (pending_length == (int)sizeof(pending)) {
+            pending_length = 0;  // A line longer than any the server sends
+        }
+        int length = wait_for_data(pending + pending_length, sizeof(pending) - pending_length);
+        if (length <= 0) {
+            return -1;
+        }
+        pending_length += length;
+    }
+}
+
+int compare_samples(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Plays the easy bot over delta lines and times every move, from sending it
+// to the line with the bot's answer (or with the next game's board, when the
+// move ended the game)
+int run_benchmark(int moves) {
+    uint64_t* samples = malloc(moves * sizeof(uint64_t));
+    if (samples == NULL) {
+        perror("Failed to allocate samples");
+        return -1;
+    }
+    if (use_shm) {
+        send_message("shm");
+        spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_NS : 0;
+    }
+    send_message("delta");
+    send_message("play bot easy");
+    
+    char line[BUFFER_SIZE];
+    char cells[9];
+    int have_game = 0;
+    int waiting = 0;
+    int timed = 0;
+    uint64_t sent_at = 0;
+    uint64_t started = now_ns();
+    srand(started);
+    while (timed < moves) {
+        if (have_game && !waiting) {
+            // Any free cell; the bot answers every move, so one is always left
+            int free_cells[9];
+            int count = 0;
+            for (int cell = 0; cell < 9; cell++) {
+                if (cells[cell] == '.') {
+                    free_cells[count++] = cell;
+                }
+            }
+            int cell = free_cells[rand() % count];
+            char move[32];
+            snprintf(move, sizeof(move), "move %d %d", cell / 3, cell % 3);
+            sent_at = now_ns();
+            send_message(move);
+            waiting = 1;
+        }
+        
+        if (read_line(line, sizeof(line)) < 0) {
+            fprintf(stderr, "Server closed the connection after %d moves.\n", timed);
+            free(samples);
+            return -1;
+        }
+        unsigned int seq;
+        int rows, cols, cell, offset;
+        char mark;
+        char outcome[32];
+        int answered;
+        if (sscanf(line, "state %u %d %d %n", &seq, &rows, &cols, &offset) == 3 &&
+            rows == 3 && cols == 3 && (int)strlen(line) >= offset + 9) {
+            memcpy(cells, line + offset, 9);
+            have_game = 1;
+            answered = 1;
+        } else if (sscanf(line, "delta %u cell %d = %c, %31[^\n]", &seq, &cell, &mark, outcome) == 4 &&
+                   cell >= 0 && cell < 9) {
+            cells[cell] = mark;
+            answered = strcmp(outcome, "turn X") == 0;
+        } else {
+            continue;
+        }
+        if (answered && waiting) {
+            samples[timed++] = now_ns() - sent_at;
+            waiting = 0;
+        }
+    }
+    double elapsed = (now_ns() - started) / 1e9;
+    
+    qsort(samples, moves, sizeof(uint64_t), compare_samples);
+    uint64_t sum = 0;
+    for (int i = 0; i < moves; i++) {
+        sum += samples[i];
+    }
+    printf("Transport: %s\n", shm != NULL ? "shared memory" : local_path != NULL ? "Unix socket" : "TCP");
+    printf("Moves:     %d round trips in %.3f s\n", moves, elapsed);
+    printf("Latency:   min %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us, mean %.1f us\n",
+           samples[0] / 1e3, samples[moves / 2] / 1e3, samples[(int)(moves * 0.99)] / 1e3,
+           samples[moves - 1] / 1e3, (double)sum / moves / 1e3);
+    free(samples);
+    return 0;
 }
 
 void print_help() {
     printf("\n--- Tic-Tac-Toe Client Help ---\n");
     printf("Commands:\n");
-    printf("  move <row> <col>  - Make a move (rows and cols are 0-2)\n");
+    printf("  move <row> <col>  - Make a move (rows and cols count from 0)\n");
+    printf("  board <r> <c> <k> - Play an r x c board with k in a row (while waiting)\n");
+    printf("  play bot [level]  - Play the server (easy, medium or hard)\n");
+    printf("  hint              - Suggest the best move\n");
+    printf("  analyze           - Show the outcome of every free cell\n");
+    printf("  resume <token>    - Get back into a game after a disconnect or restart\n");
+    printf("  watch <room>      - Watch another room's game (while waiting)\n");
+    printf("  delta [off]       - Get one-line updates instead of whole boards (text protocol)\n");
+    printf("  resync            - Ask for the whole board again\n");
+    printf("  shm               - Move the connection to shared memory (with -l)\n");
     printf("  help              - Show this help message\n");
     printf("  quit              - Exit the game\n");
     printf("\nExample: move 0 1 (places your mark in the top-middle position)\n\n");
@@ -120,10 +929,57 @@ void print_help() {
 
 int main(int argc, char *argv[]) {
     // Check command line arguments
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
+    int opt;
+    const char* resume_token = NULL;
+    int bench_moves = 0;
+    while ((opt = getopt(argc, argv, "bdr:l:mB:")) != -1) {
+        switch (opt) {
+            case 'b':
+                binary_mode = 1;
+                break;
+            case 'd':
+                delta_mode = 1;
+                break;
+            case 'r':
+                resume_token = optarg;
+                break;
+            case 'l':
+                local_path = optarg;
+                break;
+            case 'm':
+                use_shm = 1;
+                break;
+            case 'B':
+                bench_moves = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-b | -d] [-l socket_path] [-m] [-B moves] "
+                        "[-r resume_token] <server_ip>\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    
+    // Shared memory needs the Unix socket, which makes the address optional
+    if (use_shm && local_path == NULL) {
+        local_path = DEFAULT_LOCAL_PATH;
+    }
+    if (optind != argc - (local_path == NULL) || bench_moves < 0) {
+        fprintf(stderr, "Usage: %s [-b | -d] [-l socket_path] [-m] [-B moves] "
+                "[-r resume_token] <server_ip>\n", argv[0]);
         return EXIT_FAILURE;
     }
+    const char* server_ip = local_path != NULL ? local_path : argv[optind];
+    
+    // A benchmark plays the bot by itself and reports the latency of its moves
+    if (bench_moves > 0) {
+        if (connect_to_server(server_ip) < 0) {
+            fprintf(stderr, "Failed to connect to server.\n");
+            return EXIT_FAILURE;
+        }
+        int result = run_benchmark(bench_moves);
+        cleanup();
+        return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
     
     // Set up signal handling for clean exit
     signal(SIGINT, (void (*)(int))cleanup);
@@ -132,8 +988,12 @@ int main(int argc, char *argv[]) {
     set_terminal_raw_mode();
     
     // Connect to server
-    printf("Connecting to %s:%d...\n", argv[1], SERVER_PORT);
-    if (connect_to_server(argv[1]) < 0) {
+    if (local_path != NULL) {
+        printf("Connecting to %s...\n", local_path);
+    } else {
+        printf("Connecting to %s:%d...\n", server_ip, SERVER_PORT);
+    }
+    if (connect_to_server(server_ip) < 0) {
         fprintf(stderr, "Failed to connect to server.\n");
         return EXIT_FAILURE;
     }
@@ -141,8 +1001,25 @@ int main(int argc, char *argv[]) {
     printf("Connected to server!\n");
     print_help();
     
+    // Move to shared memory first, so that everything after goes through it
+    if (use_shm) {
+        send_message("shm");
+    }
+    
+    // Ask for the compact binary protocol, or for delta lines
+    if (binary_mode) {
+        send_message("binary");
+    } else if (delta_mode) {
+        send_message("delta");
+    }
+    
+    // Take back our seat before anything else
+    if (resume_token != NULL) {
+        send_resume(resume_token);
+    }
+    
     // Set up poll for multiple input sources
-    struct pollfd fds[2];
+    struct pollfd fds[3];
     
     // Monitor stdin for user input
     fds[0].fd = STDIN_FILENO;
@@ -152,13 +1029,24 @@ int main(int argc, char *argv[]) {
     fds[1].fd = client_socket;
     fds[1].events = POLLIN;
     
+    // And the eventfd the server writes to once on shared memory
+    fds[2].fd = -1;
+    fds[2].events = POLLIN;
+    
     char buffer[BUFFER_SIZE];
     char command[BUFFER_SIZE];
     int command_pos = 0;
     
     // Main client loop
     while (1) {
-        int poll_result = poll(fds, 2, -1);
+        // The server only writes to the eventfd once we say we are asleep,
+        // and whatever came before that is read without waiting
+        int timeout = -1;
+        fds[2].fd = shm != NULL ? shm_notify_fd : -1;
+        if (shm != NULL && !shm_sleep(&shm->to_client, &shm->client_sleeping)) {
+            timeout = 0;
+        }
+        int poll_result = poll(fds, 3, timeout);
         
         if (poll_result < 0) {
             if (errno == EINTR) {
@@ -168,10 +1056,25 @@ int main(int argc, char *argv[]) {
             break;
         }
         
+        // Messages from the rings come first, as the goodbye of a server
+        // that closed the connection is there
+        if (shm != NULL) {
+            atomic_store(&shm->client_sleeping, 0);
+            if (fds[2].revents & POLLIN) {
+                eventfd_t count;
+                eventfd_read(shm_notify_fd, &count);
+            }
+            int bytes_read;
+            while ((bytes_read = read_shm(buffer, BUFFER_SIZE - 1)) > 0) {
+                buffer[bytes_read] = '\0';
+                handle_server_data(buffer, bytes_read);
+            }
+        }
+        
         // Check for server messages
-        if (fds[1].revents & POLLIN) {
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
             memset(buffer, 0, BUFFER_SIZE);
-            int bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
+            int bytes_read = receive(buffer, BUFFER_SIZE - 1);
             
             if (bytes_read <= 0) {
                 if (bytes_read == 0) {
@@ -179,11 +1082,15 @@ int main(int argc, char *argv[]) {
                 } else {
                     perror("recv failed");
                 }
-                break;
+                if (session_token[0] == '\0' || reconnect(server_ip) < 0) {
+                    break;
+                }
+                fds[1].fd = client_socket;
+                continue;
             }
             
             // Process server message
-            handle_server_message(buffer);
+            handle_server_data(buffer, bytes_read);
         }
         
         // Check for user input
@@ -201,7 +1108,7 @@ int main(int argc, char *argv[]) {
                     printf("\nCommand: %s\n", command);
                     
                     // Send command to server
-                    send_message(command);
+                    send_command(command);
                     
                     // Check for quit command
                     if (strncmp(command, "quit", 4) == 0) {
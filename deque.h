@@ -0,0 +1,100 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Bounded work-stealing deque of 64-bit values (Chase and Lev's design,
+// with the memory orders of Le, Pop, Cohen and Zappa Nardelli for weak
+// memory models). Only the owning thread pushes and pops, at the bottom;
+// any other thread may steal from the top. The owner and thieves only
+// contend, through one compare-and-swap on top, for the last value left.
+typedef struct {
+    _Atomic uint64_t* slots;
+    size_t mask;
+    _Alignas(64) _Atomic int64_t top;     // Next value to steal
+    _Alignas(64) _Atomic int64_t bottom;  // Next slot the owner pushes to
+} Deque;
+
+// Capacity is rounded up to a power of two
+static inline int deque_init(Deque* d, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    
+    d->slots = malloc(size * sizeof(*d->slots));
+    if (d->slots == NULL) {
+        return -1;
+    }
+    d->mask = size - 1;
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    return 0;
+}
+
+static inline void deque_destroy(Deque* d) {
+    free((void*)d->slots);
+    d->slots = NULL;
+}
+
+// Owner only. Returns false if the deque is full.
+static inline bool deque_push(Deque* d, uint64_t value) {
+    int64_t bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (bottom - top > (int64_t)d->mask) {
+        return false;
+    }
+    atomic_store_explicit(&d->slots[bottom & d->mask], value, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+// Owner only: takes the value pushed last. Returns false if the deque is
+// empty or a thief got the last value first.
+static inline bool deque_pop(Deque* d, uint64_t* value) {
+    int64_t bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+    
+    *value = atomic_load_explicit(&d->slots[bottom & d->mask], memory_order_relaxed);
+    if (top < bottom) {
+        return true;
+    }
+    
+    // The last value: whoever moves top on first has it
+    bool won = atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                       memory_order_seq_cst,
+                                                       memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+    return won;
+}
+
+// Any thread: takes the value pushed first. Returns 1 if it got one, 0 if
+// the deque is empty and -1 if it lost a race and may try again.
+static inline int deque_steal(Deque* d, uint64_t* value) {
+    int64_t top = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return 0;
+    }
+    
+    *value = atomic_load_explicit(&d->slots[top & d->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return -1;
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "game.h"
+#include "geometry.h"
+#include "bot_table.h"
+
+uint64_t win_table[512 / 64];
+uint8_t symmetry_cell_map[8][9];
+uint16_t symmetry_transform[8][512];
+
+__thread uint64_t random_state;
+
+// Chance in percent that the bot passes over its best moves, by level
+static const int bot_mistake_percent[4] = { 0, 50, 20, 0 };
+
+void game_init() {
+    // Precompute the answer for every possible set of one player's cells
+    memset(win_table, 0, sizeof(win_table));
+    for (int mask = 0; mask < 512; mask++) {
+        if (holds_line(mask)) {
+            win_table[mask >> 6] |= 1ULL << (mask & 63);
+        }
+    }
+    build_symmetries(symmetry_cell_map, symmetry_transform);
+}
+
+bool make_move(Board* board, int row, int col, int player) {
+    // Check if move is valid
+    if (row < 0 || row > 2 || col < 0 || col > 2) {
+        return false;
+    }
+    
+    // Check if the cell is empty
+    uint16_t cell = 1 << (row * 3 + col);
+    if ((board->marks[0] | board->marks[1]) & cell) {
+        return false;
+    }
+    
+    // Make the move
+    board->marks[player] |= cell;
+    return true;
+}
+
+bool check_win(Board* board) {
+    // One table lookup on the current player's cells covers all eight lines
+    return has_line(board->marks[board->current_player]);
+}
+
+bool check_draw(Board* board) {
+    // Check if all cells are filled
+    return __builtin_popcount(board->marks[0] | board->marks[1]) == 9;
+}
+
+char cell_mark(Board* board, int cell) {
+    // Render one cell of the board as a character
+    if (board->marks[0] & (1 << cell)) {
+        return 'X';
+    }
+    if (board->marks[1] & (1 << cell)) {
+        return 'O';
+    }
+    return ' ';
+}
+
+int choose_bot_move(Board* board, int level) {
+    // Find the position's canonical key and the symmetry that produces it
+    uint32_t key = UINT32_MAX;
+    int symmetry = 0;
+    for (int s = 0; s < 8; s++) {
+        uint32_t candidate = symmetry_transform[s][board->marks[0]] |
+                             (uint32_t)symmetry_transform[s][board->marks[1]] << 9;
+        if (candidate < key) {
+            key = candidate;
+            symmetry = s;
+        }
+    }
+    
+    uint32_t slot = bot_table_hash(key);
+    while (bot_table[slot] != BOT_EMPTY_ENTRY && (uint32_t)(bot_table[slot] >> 32) != key) {
+        slot = (slot + 1) & (BOT_TABLE_SIZE - 1);
+    }
+    uint32_t values = (uint32_t)bot_table[slot];
+    
+    // Split the free cells into the best ones and the rest. Among winning
+    // moves, the ones that win on the spot come first.
+    uint16_t own = board->marks[board->current_player];
+    int best[9], rest[9];
+    int best_count = 0, rest_count = 0, best_value = 0;
+    for (int cell = 0; cell < 9; cell++) {
+        if (((board->marks[0] | board->marks[1]) >> cell) & 1) {
+            continue;
+        }
+        int value = (values >> (symmetry_cell_map[symmetry][cell] * 2)) & 3;
+        if (value == BOT_VALUE_WIN && has_line(own | (1 << cell))) {
+            value = BOT_VALUE_WIN + 1;
+        }
+        
+        if (value > best_value) {
+            for (int i = 0; i < best_count; i++) {
+                rest[rest_count++] = best[i];
+            }
+            best_count = 0;
+            best_value = value;
+        }
+        if (value == best_value) {
+            best[best_count++] = cell;
+        } else {
+            rest[rest_count++] = cell;
+        }
+    }
+    
+    if (rest_count > 0 && (int)random_below(100) < bot_mistake_percent[level]) {
+        return rest[random_below(rest_count)];
+    }
+    return best[random_below(best_count)];
+}
+
+uint32_t random_below(uint32_t limit) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return (uint32_t)((random_state >> 32) * limit >> 32);
+}
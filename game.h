@@ -0,0 +1,65 @@
+#ifndef GAME_H
+#define GAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Rules of the 3x3 game and its bot, shared by the server and the
+// tournament engine.
+//
+// A board is a pair of 9-bit masks, bit (row * 3 + col) per cell. Whether a
+// player has a line is one lookup of their mask in win_table. The bot looks
+// its moves up in the solved-position table generated into bot_table.h. The
+// lines and symmetries themselves come from geometry.h.
+
+// Difficulty of the bot, by how often it gives away a move
+#define BOT_NONE 0
+#define BOT_EASY 1
+#define BOT_MEDIUM 2
+#define BOT_HARD 3
+
+typedef struct {
+    uint16_t marks[2];       // Cells taken by X (marks[0]) and O (marks[1])
+    uint8_t current_player;  // 0 for first player (X), 1 for second player (O)
+} Board;
+
+// Bit m is set if the set of cells m contains a winning line
+extern uint64_t win_table[512 / 64];
+
+// The board's symmetries, as built by build_symmetries() in geometry.h
+extern uint8_t symmetry_cell_map[8][9];
+extern uint16_t symmetry_transform[8][512];
+
+// xorshift state of the calling thread for bot moves; seed it (not with 0)
+// before the thread plays
+extern __thread uint64_t random_state;
+
+// Builds win_table and the symmetry tables; call once before any other
+// game function
+void game_init();
+
+// Whether the set of cells contains a winning line
+static inline bool has_line(uint16_t cells) {
+    return (win_table[cells >> 6] >> (cells & 63)) & 1;
+}
+
+// Puts the player's mark on the cell. Returns false if it is off the board
+// or taken.
+bool make_move(Board* board, int row, int col, int player);
+
+// Whether the player to move holds a line, i.e. the last move won if the
+// turn has not been passed on yet
+bool check_win(Board* board);
+bool check_draw(Board* board);
+
+// 'X', 'O' or ' '
+char cell_mark(Board* board, int cell);
+
+// Cell the bot of the given level plays for the player to move. The game
+// must not be over.
+int choose_bot_move(Board* board, int level);
+
+// Uniform in [0, limit), from random_state
+uint32_t random_below(uint32_t limit);
+
+#endif
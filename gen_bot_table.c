@@ -0,0 +1,188 @@
+// Build-time generator for bot_table.h, the solved-position table behind
+// the server's "play bot" opponent.
+//
+// Every position reachable from the empty board with the game still running
+// is solved by minimax. Positions that are rotations or reflections of each
+// other share one entry, keyed by the smallest encoding among the 8
+// symmetries. Each entry holds the value of every cell for the player to
+// move, 2 bits per cell, so the server picks a move with one lookup.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "geometry.h"
+
+#define TABLE_BITS 11
+#define TABLE_SIZE (1 << TABLE_BITS)
+#define EMPTY_ENTRY UINT64_MAX
+
+// Move values, from the point of view of the player to move
+#define VALUE_TAKEN 0
+#define VALUE_LOSS 1
+#define VALUE_DRAW 2
+#define VALUE_WIN 3
+
+uint8_t cell_map[8][9];      // cell_map[s][cell]: where symmetry s moves the cell
+uint16_t transform[8][512];  // Every set of cells under every symmetry
+signed char scores[1 << 18]; // Minimax memo indexed by mover | other << 9, 2 = unsolved
+uint64_t table[TABLE_SIZE];  // Canonical key << 32 | packed move values
+int entry_count = 0;
+int max_probe = 0;
+
+int solve(uint16_t own, uint16_t other);
+uint32_t canonical_key(uint16_t x, uint16_t o);
+uint32_t table_hash(uint32_t key);
+void add_position(uint16_t x, uint16_t o, int to_move);
+void visit(uint16_t x, uint16_t o, int to_move);
+void print_table();
+
+int main() {
+    build_symmetries(cell_map, transform);
+    memset(scores, 2, sizeof(scores));
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        table[i] = EMPTY_ENTRY;
+    }
+    
+    visit(0, 0, 0);
+    if (entry_count > TABLE_SIZE / 4 * 3) {
+        fprintf(stderr, "Bot table too full: %d positions for %d slots\n", entry_count, TABLE_SIZE);
+        return EXIT_FAILURE;
+    }
+    
+    print_table();
+    fprintf(stderr, "Bot table: %d positions, longest probe %d\n", entry_count, max_probe);
+    return 0;
+}
+
+// Score for the player to move: 1 win, 0 draw, -1 loss with perfect play
+int solve(uint16_t own, uint16_t other) {
+    signed char* memo = &scores[own | other << 9];
+    if (*memo != 2) {
+        return *memo;
+    }
+    
+    int best;
+    if (holds_line(other)) {
+        best = -1;
+    } else if ((own | other) == 0x1FF) {
+        best = 0;
+    } else {
+        best = -1;
+        for (int cell = 0; cell < 9; cell++) {
+            uint16_t bit = 1 << cell;
+            if ((own | other) & bit) {
+                continue;
+            }
+            int score = -solve(other, own | bit);
+            if (score > best) {
+                best = score;
+            }
+        }
+    }
+    *memo = (signed char)best;
+    return best;
+}
+
+uint32_t canonical_key(uint16_t x, uint16_t o) {
+    uint32_t key = UINT32_MAX;
+    for (int s = 0; s < 8; s++) {
+        uint32_t candidate = transform[s][x] | (uint32_t)transform[s][o] << 9;
+        if (candidate < key) {
+            key = candidate;
+        }
+    }
+    return key;
+}
+
+// Must match bot_table_hash() as printed into bot_table.h
+uint32_t table_hash(uint32_t key) {
+    return (key * 0x9E3779B1u) >> (32 - TABLE_BITS);
+}
+
+void add_position(uint16_t x, uint16_t o, int to_move) {
+    uint32_t key = canonical_key(x, o);
+    uint32_t slot = table_hash(key);
+    int probe = 0;
+    while (table[slot] != EMPTY_ENTRY) {
+        if ((uint32_t)(table[slot] >> 32) == key) {
+            return;
+        }
+        slot = (slot + 1) & (TABLE_SIZE - 1);
+        probe++;
+    }
+    if (probe > max_probe) {
+        max_probe = probe;
+    }
+    
+    // Find the symmetry that produced the key and solve the board in that orientation
+    uint16_t cx = 0, co = 0;
+    for (int s = 0; s < 8; s++) {
+        if ((transform[s][x] | (uint32_t)transform[s][o] << 9) == key) {
+            cx = transform[s][x];
+            co = transform[s][o];
+            break;
+        }
+    }
+    uint16_t own = to_move == 0 ? cx : co;
+    uint16_t other = to_move == 0 ? co : cx;
+    
+    uint32_t values = 0;
+    for (int cell = 0; cell < 9; cell++) {
+        uint16_t bit = 1 << cell;
+        if ((own | other) & bit) {
+            continue;
+        }
+        int score = -solve(other, own | bit);
+        uint32_t value = score > 0 ? VALUE_WIN : score == 0 ? VALUE_DRAW : VALUE_LOSS;
+        values |= value << (cell * 2);
+    }
+    
+    table[slot] = (uint64_t)key << 32 | values;
+    entry_count++;
+}
+
+void visit(uint16_t x, uint16_t o, int to_move) {
+    // Finished games need no entry
+    if (holds_line(x) || holds_line(o) || (x | o) == 0x1FF) {
+        return;
+    }
+    add_position(x, o, to_move);
+    
+    for (int cell = 0; cell < 9; cell++) {
+        uint16_t bit = 1 << cell;
+        if ((x | o) & bit) {
+            continue;
+        }
+        if (to_move == 0) {
+            visit(x | bit, o, 1);
+        } else {
+            visit(x, o | bit, 0);
+        }
+    }
+}
+
+void print_table() {
+    printf("// Generated by gen_bot_table.c, do not edit.\n");
+    printf("#ifndef BOT_TABLE_H\n#define BOT_TABLE_H\n\n#include <stdint.h>\n\n");
+    printf("// Solved positions keyed by the smallest of the 8 symmetric encodings of\n");
+    printf("// x | o << 9. Entries are key << 32 | values, 2 bits per cell for the\n");
+    printf("// player to move, placed by linear probing from bot_table_hash(key).\n");
+    printf("#define BOT_TABLE_BITS %d\n", TABLE_BITS);
+    printf("#define BOT_TABLE_SIZE %d\n", TABLE_SIZE);
+    printf("#define BOT_EMPTY_ENTRY UINT64_MAX\n");
+    printf("#define BOT_POSITIONS %d\n\n", entry_count);
+    printf("#define BOT_VALUE_TAKEN %d\n#define BOT_VALUE_LOSS %d\n", VALUE_TAKEN, VALUE_LOSS);
+    printf("#define BOT_VALUE_DRAW %d\n#define BOT_VALUE_WIN %d\n\n", VALUE_DRAW, VALUE_WIN);
+    
+    printf("static inline uint32_t bot_table_hash(uint32_t key) {\n");
+    printf("    return (key * 0x9E3779B1u) >> (32 - BOT_TABLE_BITS);\n}\n\n");
+    
+    printf("static const uint64_t bot_table[BOT_TABLE_SIZE] = {");
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        printf("%s%s0x%016llxULL", i ? "," : "", i % 4 ? " " : "\n    ",
+               (unsigned long long)table[i]);
+    }
+    printf("\n};\n\n#endif\n");
+}
@@ -0,0 +1,62 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Shape of the 3x3 board: its eight winning lines and its eight symmetries.
+//
+// Cells are bit (row * 3 + col) of a 9-bit mask. The game rules (game.c),
+// the bot table generator, which runs before game.c can be built, and the
+// journal checker all take the lines and symmetries from here.
+
+static const uint16_t win_lines[8] = {
+    0x007, 0x038, 0x1C0,  // Rows
+    0x049, 0x092, 0x124,  // Columns
+    0x111, 0x054          // Diagonals
+};
+
+// Whether the set of cells holds a whole line. game.c folds this into
+// win_table once; has_line() in game.h is the one lookup the rules use.
+static inline bool holds_line(uint16_t cells) {
+    for (int i = 0; i < 8; i++) {
+        if ((cells & win_lines[i]) == win_lines[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Fills cell_map[s][cell], the cell that symmetry s moves the cell to, and
+// transform[s][cells], every set of cells under every symmetry. The
+// symmetries are the four rotations, each with and without a mirror image.
+static inline void build_symmetries(uint8_t cell_map[8][9], uint16_t transform[8][512]) {
+    for (int s = 0; s < 8; s++) {
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 3; col++) {
+                int r = row, c = col;
+                for (int turn = 0; turn < (s & 3); turn++) {
+                    int t = r;
+                    r = c;
+                    c = 2 - t;
+                }
+                if (s & 4) {
+                    c = 2 - c;
+                }
+                cell_map[s][row * 3 + col] = r * 3 + c;
+            }
+        }
+        
+        for (int mask = 0; mask < 512; mask++) {
+            uint16_t moved = 0;
+            for (int cell = 0; cell < 9; cell++) {
+                if (mask & (1 << cell)) {
+                    moved |= 1 << cell_map[s][cell];
+                }
+            }
+            transform[s][mask] = moved;
+        }
+    }
+}
+
+#endif
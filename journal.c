@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define JOURNAL_RING_SIZE (1 << 20)  // Bytes per thread, a power of two
+#define JOURNAL_MAX_THREADS 128
+
+// Filled by one worker thread, emptied by the writer
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head;  // Next byte to fill
+    _Alignas(64) _Atomic uint64_t tail;  // Next byte to write out
+    uint8_t bytes[JOURNAL_RING_SIZE];
+} JournalRing;
+
+static _Atomic(JournalRing*) rings[JOURNAL_MAX_THREADS];  // NULL until the ring is ready
+static _Atomic int ring_count = 0;
+static __thread JournalRing* ring;  // Calling thread's ring, created on its first record
+static __thread bool ring_failed;
+
+static int journal_fd = -1;
+static _Atomic bool journal_on = false;
+static uint64_t session_start;      // CLOCK_MONOTONIC ms when the session began
+static struct timespec interval;
+static pthread_t writer_thread;
+static _Atomic bool stopping = false;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_requested = PTHREAD_COND_INITIALIZER;
+static _Atomic uint64_t dropped = 0;
+static _Atomic uint64_t synced_size = 0;
+static bool failing = false;        // The last commit could not be written
+
+static void* run_writer(void* arg);
+static int cut_torn_tail();
+static void commit_rings();
+static uint64_t count_records(JournalRing* r);
+static JournalRing* create_ring();
+static uint64_t clock_ms(clockid_t clock);
+
+int journal_open(const char* path, int fsync_ms) {
+    journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal_fd < 0) {
+        perror("Failed to open journal");
+        return -1;
+    }
+    if (cut_torn_tail() < 0) {
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    if (fsync_ms < 1) {
+        fsync_ms = 1;
+    }
+    interval.tv_sec = fsync_ms / 1000;
+    interval.tv_nsec = (fsync_ms % 1000) * 1000000L;
+    
+    // Every run starts a session so that appended journals can be told apart
+    uint8_t header[JOURNAL_MAX_RECORD];
+    JournalRecord session = { .type = JOURNAL_SESSION, .time_ms = clock_ms(CLOCK_REALTIME) };
+    size_t length = journal_encode(&session, header);
+    if (write(journal_fd, header, length) != (ssize_t)length) {
+        perror("Failed to write journal");
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    session_start = clock_ms(CLOCK_MONOTONIC);
+    atomic_store(&synced_size, (uint64_t)lseek(journal_fd, 0, SEEK_END));
+    
+    // SIGINT is for the shards; the writer is joined on shutdown
+    sigset_t interrupt, previous;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, &previous);
+    int started = pthread_create(&writer_thread, NULL, run_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (started != 0) {
+        perror("Failed to start journal thread");
+        close(journal_fd);
+        journal_fd = -1;
+        return -1;
+    }
+    atomic_store(&journal_on, true);
+    return 0;
+}
+
+void journal_close() {
+    if (journal_fd < 0) {
+        return;
+    }
+    atomic_store(&journal_on, false);
+    pthread_mutex_lock(&stop_lock);
+    atomic_store(&stopping, true);
+    pthread_cond_signal(&stop_requested);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(writer_thread, NULL);
+    close(journal_fd);
+    journal_fd = -1;
+}
+
+bool journal_append(JournalRecord* record) {
+    if (!atomic_load_explicit(&journal_on, memory_order_relaxed)) {
+        return true;
+    }
+    if (ring == NULL) {
+        if (!ring_failed) {
+            ring = create_ring();
+            ring_failed = ring == NULL;
+        }
+        if (ring == NULL) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+    
+    uint8_t encoded[JOURNAL_MAX_RECORD];
+    record->time_ms = clock_ms(CLOCK_MONOTONIC) - session_start;
+    size_t length = journal_encode(record, encoded);
+    
+    // Only this thread moves head; the writer only ever frees space
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (JOURNAL_RING_SIZE - (head - tail) < length) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    
+    size_t start = head & (JOURNAL_RING_SIZE - 1);
+    size_t first = JOURNAL_RING_SIZE - start < length ? JOURNAL_RING_SIZE - start : length;
+    memcpy(ring->bytes + start, encoded, first);
+    memcpy(ring->bytes, encoded + first, length - first);
+    atomic_store_explicit(&ring->head, head + length, memory_order_release);
+    return true;
+}
+
+uint64_t journal_dropped() {
+    return atomic_load(&dropped);
+}
+
+uint64_t journal_synced_size() {
+    return atomic_load(&synced_size);
+}
+
+static JournalRing* create_ring() {
+    int index = atomic_fetch_add(&ring_count, 1);
+    if (index >= JOURNAL_MAX_THREADS) {
+        atomic_fetch_sub(&ring_count, 1);
+        return NULL;
+    }
+    JournalRing* created = calloc(1, sizeof(JournalRing));
+    atomic_store_explicit(&rings[index], created, memory_order_release);
+    return created;
+}
+
+static void* run_writer(void* arg) {
+    (void)arg;
+    
+    // Commit every interval; journal_close cuts the wait short, so that
+    // closing never waits out a whole interval
+    pthread_mutex_lock(&stop_lock);
+    while (!atomic_load(&stopping)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += interval.tv_sec;
+        deadline.tv_nsec += interval.tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_clockwait(&stop_requested, &stop_lock, CLOCK_MONOTONIC, &deadline);
+        pthread_mutex_unlock(&stop_lock);
+        commit_rings();
+        pthread_mutex_lock(&stop_lock);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    commit_rings();
+    
+    // Whatever the last commit could not write goes with the rings
+    int count = atomic_load(&ring_count);
+    for (int i = 0; i < count && i < JOURNAL_MAX_THREADS; i++) {
+        JournalRing* r = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (r != NULL) {
+            atomic_fetch_add(&dropped, count_records(r));
+        }
+    }
+    return NULL;
+}
+
+// Readers stop at the first record they cannot decode, so half a record
+// left by a crash or a failed write would hide every session after it.
+// Cuts the file back to the end of its last whole record. Anything that
+// is not a journal of this version, or that goes bad well before its end,
+// is left alone and refused.
+static int cut_torn_tail() {
+    struct stat info;
+    if (fstat(journal_fd, &info) < 0) {
+        perror("Failed to read journal size");
+        return -1;
+    }
+    if (info.st_size == 0) {
+        return 0;
+    }
+    const uint8_t* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, journal_fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Failed to map journal");
+        return -1;
+    }
+    const uint8_t* at = data;
+    const uint8_t* end = data + info.st_size;
+    JournalRecord record;
+    size_t used = journal_decode(at, end, &record);
+    bool journal = used > 0 && record.type == JOURNAL_SESSION;
+    while (used > 0) {
+        at += used;
+        used = journal_decode(at, end, &record);
+    }
+    off_t whole = at - data;
+    munmap((void*)data, info.st_size);
+    
+    if (!journal) {
+        fprintf(stderr, "Not a version %d journal, refusing to append to it\n", JOURNAL_VERSION);
+        return -1;
+    }
+    if (info.st_size - whole >= JOURNAL_MAX_RECORD) {
+        fprintf(stderr, "Journal is damaged at byte %lld of %lld, refusing to append to it\n",
+                (long long)whole, (long long)info.st_size);
+        return -1;
+    }
+    if (whole < info.st_size) {
+        fprintf(stderr, "Journal ends in %lld bytes that are not a whole record, cutting them off\n",
+                (long long)(info.st_size - whole));
+        if (ftruncate(journal_fd, whole) < 0) {
+            perror("Failed to truncate journal");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// One group commit: everything the rings hold now, written and synced together
+static void commit_rings() {
+    struct iovec iov[2 * JOURNAL_MAX_THREADS];
+    JournalRing* drained[JOURNAL_MAX_THREADS];
+    uint64_t heads[JOURNAL_MAX_THREADS];
+    int iov_count = 0;
+    size_t total = 0;
+    
+    int count = atomic_load(&ring_count);
+    if (count > JOURNAL_MAX_THREADS) {
+        count = JOURNAL_MAX_THREADS;
+    }
+    for (int i = 0; i < count; i++) {
+        JournalRing* r = atomic_load_explicit(&rings[i], memory_order_acquire);
+        drained[i] = r;
+        if (r == NULL) {
+            continue;
+        }
+        
+        // Records are only published whole, so [tail, head) never ends mid-record
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        heads[i] = head;
+        if (head == tail) {
+            continue;
+        }
+        size_t start = tail & (JOURNAL_RING_SIZE - 1);
+        size_t length = head - tail;
+        size_t first = JOURNAL_RING_SIZE - start < length ? JOURNAL_RING_SIZE - start : length;
+        iov[iov_count].iov_base = r->bytes + start;
+        iov[iov_count++].iov_len = first;
+        if (first < length) {
+            iov[iov_count].iov_base = r->bytes;
+            iov[iov_count++].iov_len = length - first;
+        }
+        total += length;
+    }
+    if (total == 0) {
+        return;
+    }
+    
+    // Retry short writes from wherever they stopped
+    struct iovec* next = iov;
+    int left = iov_count;
+    bool failed = false;
+    while (left > 0) {
+        ssize_t written = writev(journal_fd, next, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!failing) {
+                perror("Journal write failed");
+            }
+            failed = true;
+            break;
+        }
+        while (left > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (uint8_t*)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    if (!failed && fdatasync(journal_fd) < 0) {
+        if (!failing) {
+            perror("Journal sync failed");
+        }
+        failed = true;
+    }
+    
+    // Take back whatever part of the batch reached the file, so that no half
+    // record is left in the middle of it. The records stay in the rings for
+    // the next commit; once a ring is full, new ones are counted as dropped.
+    if (failed) {
+        if (ftruncate(journal_fd, (off_t)atomic_load(&synced_size)) < 0 && !failing) {
+            perror("Journal truncate failed");
+        }
+        failing = true;
+        return;
+    }
+    if (failing) {
+        fprintf(stderr, "Journal writes are going through again\n");
+        failing = false;
+    }
+    
+    // Appends leave the file offset at the end of the file
+    atomic_store(&synced_size, (uint64_t)lseek(journal_fd, 0, SEEK_CUR));
+    
+    // Only now may the workers reuse the space
+    for (int i = 0; i < count; i++) {
+        if (drained[i] != NULL) {
+            atomic_store_explicit(&drained[i]->tail, heads[i], memory_order_release);
+        }
+    }
+}
+
+// Records still waiting in a ring, copied out one at a time since they
+// can wrap around its end
+static uint64_t count_records(JournalRing* r) {
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t count = 0;
+    while (tail < head) {
+        uint8_t encoded[JOURNAL_MAX_RECORD];
+        size_t length = head - tail < JOURNAL_MAX_RECORD ? head - tail : JOURNAL_MAX_RECORD;
+        for (size_t i = 0; i < length; i++) {
+            encoded[i] = r->bytes[(tail + i) & (JOURNAL_RING_SIZE - 1)];
+        }
+        JournalRecord record;
+        size_t used = journal_decode(encoded, encoded + length, &record);
+        if (used == 0) {
+            break;
+        }
+        tail += used;
+        count++;
+    }
+    return count;
+}
+
+static uint64_t clock_ms(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,208 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Append-only journal of every game the server hosts.
+//
+// Worker threads encode records into a ring of their own and never touch
+// the file. A writer thread drains the rings every fsync interval, writes
+// what it found with one writev, and syncs the file once for the whole
+// batch (group commit). If a ring fills up because the disk is stalled,
+// records are dropped and counted rather than making the event loop wait.
+//
+// A file is a plain sequence of records; a server appending to an existing
+// journal starts a new session, after cutting off any half record a crash
+// left at the end. A failed commit is taken back the same way and tried
+// again with the next one. Numbers are LEB128 varints, so a move costs
+// one byte for its cell on boards of up to 128 cells and two above that,
+// plus its room, ply and time. Times are milliseconds since the session
+// began. Rooms belong to one worker thread, so the records of a room are
+// always in order even though rooms interleave.
+//
+//   SESSION   tag, "TTTJRNL", version (1), start time (varint, Unix ms)
+//   START     tag, room, time, rows (1), cols (1), k (1), bot level (1),
+//             resume token of X and of O (8 each, little-endian, 0 for none)
+//   MOVE      tag, room, ply, time, cell (row * cols + col)
+//   RESULT    tag, room, ply, time, result (1), RESULT_* from protocol.h
+//   ABANDON   tag, room, ply, time, reason (1)
+
+#define JOURNAL_MAGIC "TTTJRNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_MAX_RECORD 48  // Longest encoded record
+
+#define JOURNAL_SESSION 0
+#define JOURNAL_START 1
+#define JOURNAL_MOVE 2
+#define JOURNAL_RESULT 3
+#define JOURNAL_ABANDON 4
+
+// Why a game ended without a result
+#define ABANDON_DISCONNECT 0  // A player quit or lost the connection
+#define ABANDON_TIMEOUT 1     // Nobody moved for TIMEOUT_SECONDS
+
+typedef struct {
+    int type;
+    uint32_t room;
+    uint32_t ply;      // Moves made before this one
+    uint64_t time_ms;  // Since the session began; Unix time for SESSION
+    uint32_t value;    // Cell, result or reason
+    uint8_t rows;      // START only
+    uint8_t cols;
+    uint8_t k;
+    uint8_t bot_level;
+    uint64_t tokens[2];
+} JournalRecord;
+
+static inline size_t journal_put_varint(uint8_t* out, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+    return length;
+}
+
+// Returns the bytes used, or 0 if the varint runs past end
+static inline size_t journal_get_varint(const uint8_t* in, const uint8_t* end, uint64_t* value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < 10 && in + i < end; i++) {
+        result |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static inline size_t journal_encode(const JournalRecord* record, uint8_t* out) {
+    size_t length = 0;
+    out[length++] = (uint8_t)record->type;
+    if (record->type == JOURNAL_SESSION) {
+        memcpy(out + length, JOURNAL_MAGIC, 7);
+        length += 7;
+        out[length++] = JOURNAL_VERSION;
+        return length + journal_put_varint(out + length, record->time_ms);
+    }
+    
+    length += journal_put_varint(out + length, record->room);
+    if (record->type != JOURNAL_START) {
+        length += journal_put_varint(out + length, record->ply);
+    }
+    length += journal_put_varint(out + length, record->time_ms);
+    if (record->type == JOURNAL_START) {
+        out[length++] = record->rows;
+        out[length++] = record->cols;
+        out[length++] = record->k;
+        out[length++] = record->bot_level;
+        for (int seat = 0; seat < 2; seat++) {
+            for (int i = 0; i < 8; i++) {
+                out[length++] = (uint8_t)(record->tokens[seat] >> (8 * i));
+            }
+        }
+    } else if (record->type == JOURNAL_MOVE) {
+        length += journal_put_varint(out + length, record->value);
+    } else {
+        out[length++] = (uint8_t)record->value;
+    }
+    return length;
+}
+
+// Returns the bytes used, or 0 if the record is cut off or not a record
+static inline size_t journal_decode(const uint8_t* in, const uint8_t* end, JournalRecord* record) {
+    const uint8_t* at = in;
+    uint64_t value;
+    size_t used;
+    if (at >= end) {
+        return 0;
+    }
+    record->type = *at++;
+    
+    if (record->type == JOURNAL_SESSION) {
+        if (end - at < 8 || memcmp(at, JOURNAL_MAGIC, 7) != 0 || at[7] != JOURNAL_VERSION) {
+            return 0;
+        }
+        at += 8;
+        if ((used = journal_get_varint(at, end, &record->time_ms)) == 0) {
+            return 0;
+        }
+        return at + used - in;
+    }
+    if (record->type > JOURNAL_ABANDON) {
+        return 0;
+    }
+    
+    if ((used = journal_get_varint(at, end, &value)) == 0) {
+        return 0;
+    }
+    record->room = (uint32_t)value;
+    at += used;
+    record->ply = 0;
+    if (record->type != JOURNAL_START) {
+        if ((used = journal_get_varint(at, end, &value)) == 0) {
+            return 0;
+        }
+        record->ply = (uint32_t)value;
+        at += used;
+    }
+    if ((used = journal_get_varint(at, end, &record->time_ms)) == 0) {
+        return 0;
+    }
+    at += used;
+    
+    if (record->type == JOURNAL_START) {
+        if (end - at < 20) {
+            return 0;
+        }
+        record->rows = at[0];
+        record->cols = at[1];
+        record->k = at[2];
+        record->bot_level = at[3];
+        at += 4;
+        for (int seat = 0; seat < 2; seat++) {
+            record->tokens[seat] = 0;
+            for (int i = 0; i < 8; i++) {
+                record->tokens[seat] |= (uint64_t)*at++ << (8 * i);
+            }
+        }
+    } else if (record->type == JOURNAL_MOVE) {
+        if ((used = journal_get_varint(at, end, &value)) == 0) {
+            return 0;
+        }
+        record->value = (uint32_t)value;
+        at += used;
+    } else {
+        if (at >= end) {
+            return 0;
+        }
+        record->value = *at++;
+    }
+    return at - in;
+}
+
+// Starts journaling to path, appending if it exists, with a group commit
+// every fsync_ms milliseconds. Returns -1 after printing the error, also
+// if the file is not a journal of this version or is damaged before its
+// last record.
+int journal_open(const char* path, int fsync_ms);
+
+// Commits everything still buffered and stops the writer
+void journal_close();
+
+// Appends a record from the calling thread, stamped with the session time.
+// Returns false if journaling is on and the record had to be dropped.
+bool journal_append(JournalRecord* record);
+
+// Records dropped so far because a ring was full
+uint64_t journal_dropped();
+
+// Size of the file up to the end of the last group commit. Everything before
+// it was appended before the call.
+uint64_t journal_synced_size();
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "queue.h"
+
+// Matchmaking queue shared by every worker thread.
+//
+// Players waiting for an opponent are listed in one of MATCH_BUCKETS
+// lock-free queues, chosen by the variant they want to play, and a player
+// looking for an opponent takes the one that has waited longest. The queue
+// holds waiting spots (rooms, in the server) by id. Each spot has a ticket
+// counter that is odd while it is listed: taking the spot, or withdrawing
+// it when its player stops waiting, moves the ticket on by one with a
+// compare-and-swap, so exactly one side wins however many threads race for
+// it.
+//
+// A spot has at most one current entry in the buckets, recorded in
+// queued[]. Withdrawing leaves the entry where it is, and listing the spot
+// again for the same variant makes it count once more instead of pushing
+// another, so listing and withdrawing over and over cannot fill a bucket.
+// Entries that are not the current one of their spot are skipped as stale,
+// so nothing ever has to be removed from the middle of a queue.
+//
+// An entry is ticket << 32 | variant << 16 | id, with the (odd) ticket of
+// the listing that pushed it, and queued[id] holds the entry without its id
+// (0 for none). Variants sharing a bucket are told
+// apart by the taker, which puts other variants back in line.
+
+#define MATCH_BUCKETS 8
+#define MATCH_SCAN 64   // Entries of other variants a take looks past before giving up
+
+typedef struct {
+    Queue buckets[MATCH_BUCKETS];
+    _Atomic uint64_t* queued;  // Current entry of every spot, without its id
+} Matchmaker;
+
+// Every bucket can hold capacity entries, rounded up to a power of two, and
+// ids go up to capacity - 1
+static inline int match_init(Matchmaker* m, size_t capacity) {
+    for (int i = 0; i < MATCH_BUCKETS; i++) {
+        if (queue_init(&m->buckets[i], capacity) < 0) {
+            return -1;
+        }
+    }
+    m->queued = calloc(capacity, sizeof(*m->queued));
+    return m->queued == NULL ? -1 : 0;
+}
+
+static inline Queue* match_bucket(Matchmaker* m, uint16_t variant) {
+    return &m->buckets[(variant * 0x9E3779B1u) >> 24 & (MATCH_BUCKETS - 1)];
+}
+
+// Gives a spot listed with the ticket an entry for the variant, unless it
+// still has one, which then stands for this listing too. Returns false if
+// the bucket is full.
+static inline bool match_enqueue(Matchmaker* m, uint16_t id, uint16_t variant, uint32_t ticket) {
+    uint64_t current = atomic_load(&m->queued[id]);
+    uint64_t entry = (uint64_t)ticket << 16 | variant;
+    do {
+        if (current != 0 && (uint16_t)current == variant) {
+            return true;
+        }
+    } while (!atomic_compare_exchange_weak(&m->queued[id], &current, entry));
+    if (queue_push(match_bucket(m, variant), entry << 16 | id)) {
+        return true;
+    }
+    atomic_compare_exchange_strong(&m->queued[id], &entry, 0);
+    return false;
+}
+
+// Called for a spot's current entry once it has left its bucket for good.
+// A listing that came in meanwhile and found the entry still there gets a
+// new one. Listings store the ticket and then read queued[], and this
+// clears queued[] and then reads the ticket, so one of the two sees the
+// other (both sequentially consistent).
+static inline void match_dequeue(Matchmaker* m, _Atomic uint32_t* tickets, uint16_t id,
+                                 uint64_t entry) {
+    if (atomic_compare_exchange_strong(&m->queued[id], &entry, 0)) {
+        uint32_t ticket = atomic_load(&tickets[id]);
+        if (ticket & 1) {
+            match_enqueue(m, id, (uint16_t)entry, ticket);
+        }
+    }
+}
+
+// Lists a spot, if it is not listed already. Returns false if its bucket
+// is full, leaving the spot unlisted.
+static inline bool match_list(Matchmaker* m, _Atomic uint32_t* tickets, uint16_t id, uint16_t variant) {
+    uint32_t current = atomic_load(&tickets[id]);
+    do {
+        if (current & 1) {
+            return true;
+        }
+    } while (!atomic_compare_exchange_weak(&tickets[id], &current, current + 1));
+    uint32_t listed = current + 1;
+    if (match_enqueue(m, id, variant, listed)) {
+        return true;
+    }
+    atomic_compare_exchange_strong(&tickets[id], &listed, listed + 1);
+    return false;
+}
+
+// Takes a spot off the list before anyone else does. Returns false if it
+// was not listed or has just been taken.
+static inline bool match_withdraw(_Atomic uint32_t* tickets, uint16_t id) {
+    uint32_t current = atomic_load_explicit(&tickets[id], memory_order_acquire);
+    return (current & 1) &&
+           atomic_compare_exchange_strong_explicit(&tickets[id], &current, current + 1,
+                                                   memory_order_acq_rel, memory_order_acquire);
+}
+
+// Takes the listed spot of the given variant that has waited longest.
+// Returns its id, with the ticket it now has in *taken, or -1 if nobody
+// is waiting. Spots of other variants that could not be put back in line
+// are withdrawn and returned in unlisted (up to MATCH_SCAN of them) for
+// their owners to list again.
+static inline int match_take(Matchmaker* m, _Atomic uint32_t* tickets, uint16_t variant,
+                             uint32_t* taken, uint16_t* unlisted, int* unlisted_count) {
+    Queue* bucket = match_bucket(m, variant);
+    uint64_t others[MATCH_SCAN];
+    int other_count = 0;
+    int id = -1;
+    uint64_t popped;
+    *unlisted_count = 0;
+    while (id < 0 && other_count < MATCH_SCAN && queue_pop(bucket, &popped)) {
+        uint64_t entry = popped >> 16;
+        uint16_t spot = (uint16_t)popped;
+        if (atomic_load_explicit(&m->queued[spot], memory_order_relaxed) != entry) {
+            continue;
+        }
+        if ((uint16_t)entry != variant) {
+            others[other_count++] = popped;
+            continue;
+        }
+        uint32_t listed = atomic_load(&tickets[spot]);
+        if ((listed & 1) && atomic_compare_exchange_strong(&tickets[spot], &listed, listed + 1)) {
+            id = spot;
+            *taken = listed + 1;
+        }
+        match_dequeue(m, tickets, spot, entry);
+    }
+    
+    // Players waiting for other variants go back in line. There was room
+    // for them a moment ago; should the bucket have filled up since, they
+    // are withdrawn rather than left listed where no one can find them.
+    for (int i = 0; i < other_count; i++) {
+        if (queue_push(bucket, others[i])) {
+            continue;
+        }
+        uint64_t entry = others[i] >> 16;
+        uint16_t spot = (uint16_t)others[i];
+        if (atomic_compare_exchange_strong(&m->queued[spot], &entry, 0) &&
+            match_withdraw(tickets, spot)) {
+            unlisted[(*unlisted_count)++] = spot;
+        }
+    }
+    return id;
+}
+
+// Lists a spot again that was taken with match_take but cannot be used,
+// unless its owner has listed it anew since. Returns false if its bucket
+// is full, leaving the spot unlisted for its owner to list again.
+static inline bool match_return(Matchmaker* m, _Atomic uint32_t* tickets, uint16_t id,
+                                uint16_t variant, uint32_t taken) {
+    uint32_t expected = taken;
+    if (!atomic_compare_exchange_strong_explicit(&tickets[id], &expected, taken + 1,
+                                                 memory_order_acq_rel, memory_order_relaxed) ||
+        match_enqueue(m, id, variant, taken + 1)) {
+        return true;
+    }
+    match_withdraw(tickets, id);
+    return false;
+}
+
+#endif
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "match.h"
+
+#define MAX_THREADS 64
+#define MAX_SPOTS 65536
+#define MAX_VARIANTS 64
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    uint64_t elapsed_ns;
+    long pairings;   // Spots this thread took
+    long listed;     // Spots this thread put in line
+} Worker;
+
+// Settings
+long arrival_count = 1000000;
+int thread_count = 1;
+int variant_count = 1;
+
+Matchmaker matchmaker;
+_Atomic uint32_t tickets[MAX_SPOTS];
+
+Worker workers[MAX_THREADS];
+pthread_barrier_t start_barrier;
+
+// Function prototypes
+uint64_t now_ns();
+void* run_worker(void* arg);
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:v:")) != -1) {
+        switch (opt) {
+            case 'n':
+                arrival_count = atol(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'v':
+                variant_count = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n arrivals_per_thread] [-t threads] [-v variants]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (thread_count < 1 || thread_count > MAX_THREADS || arrival_count < 1 ||
+        variant_count < 1 || variant_count > MAX_VARIANTS) {
+        fprintf(stderr, "Need 1 to %d threads, 1 to %d variants and at least one arrival\n",
+                MAX_THREADS, MAX_VARIANTS);
+        exit(EXIT_FAILURE);
+    }
+    if (match_init(&matchmaker, MAX_SPOTS) < 0) {
+        perror("Failed to allocate matchmaker");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Every thread stands for a worker accepting a burst of players: each
+    // one takes a waiting opponent of its variant, or waits in line itself
+    pthread_barrier_init(&start_barrier, NULL, thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    uint64_t slowest = 0;
+    long pairings = 0;
+    long listed = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        pairings += workers[i].pairings;
+        listed += workers[i].listed;
+        if (workers[i].elapsed_ns > slowest) {
+            slowest = workers[i].elapsed_ns;
+        }
+    }
+    
+    printf("Arrivals:  %ld per thread on %d threads, %d variants\n",
+           arrival_count, thread_count, variant_count);
+    printf("Pairings:  %ld (%ld listed, %ld still waiting)\n", pairings, listed, listed - pairings);
+    printf("Time:      %.1f ns per arrival, %.2f M pairings/s total\n",
+           (double)slowest / arrival_count, pairings / (slowest / 1e3));
+    return 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void* run_worker(void* arg) {
+    Worker* worker = arg;
+    uint32_t rng = 2463534242u + worker->id;
+    
+    // Each thread lists spots of its own. A spot whose ticket is even is
+    // not listed, either because it never was or because it was taken.
+    int per_thread = MAX_SPOTS / thread_count;
+    int first = worker->id * per_thread;
+    int next = 0;
+    
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (long i = 0; i < arrival_count; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        uint16_t variant = (uint16_t)(((uint64_t)rng * variant_count) >> 32);
+        uint32_t taken;
+        uint16_t unlisted[MATCH_SCAN];
+        int unlisted_count;
+        if (match_take(&matchmaker, tickets, variant, &taken, unlisted, &unlisted_count) >= 0) {
+            worker->pairings++;
+            continue;
+        }
+        for (int tries = 0; tries < per_thread; tries++) {
+            int spot = first + next;
+            next = next + 1 < per_thread ? next + 1 : 0;
+            if (!(atomic_load_explicit(&tickets[spot], memory_order_relaxed) & 1)) {
+                if (match_list(&matchmaker, tickets, spot, variant)) {
+                    worker->listed++;
+                }
+                break;
+            }
+        }
+    }
+    worker->elapsed_ns = now_ns() - start;
+    return NULL;
+}
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define METRICS_MAX_THREADS 128
+
+typedef struct {
+    const char* name;
+    const char* type;
+    const char* help;
+} MetricInfo;
+
+static const MetricInfo metric_info[METRIC_COUNT] = {
+    { "ttt_connections_open", "gauge", "Client connections currently open" },
+    { "ttt_rooms_active", "gauge", "Rooms holding at least one player" },
+    { "ttt_connections_total", "counter", "Client connections accepted" },
+    { "ttt_moves_accepted_total", "counter", "Moves placed on a board" },
+    { "ttt_moves_rejected_total", "counter", "Moves refused as invalid, early or out of turn" },
+    { "ttt_games_finished_total", "counter", "Games ended by a win or a draw" },
+    { "ttt_bytes_in_total", "counter", "Bytes read from clients" },
+    { "ttt_bytes_out_total", "counter", "Bytes written to clients" },
+    { "ttt_send_errors_total", "counter", "Writes to clients that failed" },
+    { "ttt_output_overflows_total", "counter", "Clients dropped for not reading their output" },
+    { "ttt_game_timeouts_total", "counter", "Games closed after running out of time" },
+    { "ttt_idle_timeouts_total", "counter", "Connections closed for sending nothing" },
+    { "ttt_journal_dropped_total", "counter", "Journal records lost because the writer fell behind" },
+    { "ttt_snapshots_total", "counter", "Snapshots of the running games written" },
+    { "ttt_seats_held_total", "counter", "Seats held for a player who dropped out of a game" },
+    { "ttt_resumes_total", "counter", "Seats taken back with a resume token" },
+    { "ttt_games_abandoned_total", "counter", "Games ended because a player quit or did not come back" },
+    { "ttt_output_chunks", "gauge", "Output queue chunks in use" },
+    { "ttt_big_boards", "gauge", "Boards bigger than 3x3 in use" },
+    { "ttt_pool_reserved_bytes", "gauge", "Memory taken from malloc for the output chunk and board pools" },
+    { "ttt_spectators", "gauge", "Connections watching a room" },
+    { "ttt_broadcasts_total", "counter", "State updates encoded once and shared by every spectator of a room" },
+    { "ttt_broadcasts_skipped_total", "counter", "State updates a slow spectator skipped because a newer one replaced them" },
+    { "ttt_broadcasts", "gauge", "Shared state updates still queued for a spectator" },
+    { "ttt_syscalls_total", "counter", "System calls made by the event loops to wait, accept, read and write" },
+};
+
+static const MetricInfo histogram_info[HISTOGRAM_COUNT] = {
+    { "ttt_loop_seconds", "histogram", "Time spent handling one batch of events" },
+    { "ttt_move_latency_seconds", "histogram", "Time from receiving a move to sending the new board" },
+    { "ttt_snapshot_fork_seconds", "histogram", "Time spent in fork() to start a snapshot" },
+    { "ttt_match_seconds", "histogram", "Time from taking a waiting player off the matchmaking queue to seating their opponent" },
+};
+
+static Metrics thread_metrics[METRICS_MAX_THREADS];
+static _Atomic int thread_count = 0;
+static Metrics unregistered;  // Sink for threads without a block, never reported
+
+__thread Metrics* metrics = &unregistered;
+
+static int stats_fd = -1;
+static char stats_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static pthread_t stats_thread;
+
+static void* run_stats(void* arg);
+static void write_report(FILE* out);
+static uint64_t bucket_max(int bucket);
+
+void metrics_register_thread() {
+    int index = atomic_fetch_add(&thread_count, 1);
+    if (index >= METRICS_MAX_THREADS) {
+        atomic_fetch_sub(&thread_count, 1);
+        return;
+    }
+    metrics = &thread_metrics[index];
+}
+
+int metrics_serve(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Stats socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (stats_fd < 0) {
+        perror("Stats socket creation failed");
+        return -1;
+    }
+    
+    // A socket left behind by a previous run would make bind fail
+    unlink(path);
+    if (bind(stats_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(stats_fd, 16) < 0) {
+        perror("Stats socket bind failed");
+        close(stats_fd);
+        stats_fd = -1;
+        return -1;
+    }
+    strcpy(stats_path, path);
+    
+    // The stats thread never takes SIGINT either
+    sigset_t interrupt, previous;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, &previous);
+    int started = pthread_create(&stats_thread, NULL, run_stats, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (started != 0) {
+        perror("Failed to start stats thread");
+        metrics_close();
+        return -1;
+    }
+    pthread_detach(stats_thread);
+    return 0;
+}
+
+void metrics_close() {
+    if (stats_fd >= 0) {
+        unlink(stats_path);
+        close(stats_fd);
+        stats_fd = -1;
+    }
+}
+
+uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Answers every connection with one report, then closes it
+static void* run_stats(void* arg) {
+    (void)arg;
+    while (1) {
+        int client = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return NULL;
+        }
+        
+        char* report = NULL;
+        size_t length = 0;
+        FILE* out = open_memstream(&report, &length);
+        if (out != NULL) {
+            write_report(out);
+            fclose(out);
+            size_t sent = 0;
+            while (sent < length) {
+                ssize_t written = send(client, report + sent, length - sent, MSG_NOSIGNAL);
+                if (written <= 0 && errno != EINTR) {
+                    break;
+                }
+                sent += written > 0 ? (size_t)written : 0;
+            }
+            free(report);
+        }
+        close(client);
+    }
+}
+
+static void write_report(FILE* out) {
+    int threads = atomic_load(&thread_count);
+    
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        int64_t total = 0;
+        for (int t = 0; t < threads; t++) {
+            total += atomic_load_explicit(&thread_metrics[t].values[metric], memory_order_relaxed);
+        }
+        const MetricInfo* info = &metric_info[metric];
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", info->name, info->help,
+                info->name, info->type, info->name, (long long)total);
+    }
+    
+    for (int histogram = 0; histogram < HISTOGRAM_COUNT; histogram++) {
+        const MetricInfo* info = &histogram_info[histogram];
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", info->name, info->help, info->name, info->type);
+        
+        // Buckets are cumulative; empty ones add nothing, so they are left out
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            uint64_t in_bucket = 0;
+            for (int t = 0; t < threads; t++) {
+                in_bucket += atomic_load_explicit(&thread_metrics[t].buckets[histogram][bucket],
+                                                  memory_order_relaxed);
+            }
+            count += in_bucket;
+            if (in_bucket > 0 && bucket < HISTOGRAM_BUCKETS - 1) {
+                fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", info->name,
+                        bucket_max(bucket) / 1e9, (unsigned long long)count);
+            }
+        }
+        for (int t = 0; t < threads; t++) {
+            sum += atomic_load_explicit(&thread_metrics[t].sums[histogram], memory_order_relaxed);
+        }
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                info->name, (unsigned long long)count, info->name, sum / 1e9,
+                info->name, (unsigned long long)count);
+    }
+}
+
+// Largest value that lands in the bucket: one below where the next one starts
+static uint64_t bucket_max(int bucket) {
+    int next = bucket + 1;
+    if (next < 2 * HISTOGRAM_SUB) {
+        return (uint64_t)next - 1;
+    }
+    int exponent = next / HISTOGRAM_SUB - 1;
+    return ((uint64_t)(HISTOGRAM_SUB + next % HISTOGRAM_SUB) << exponent) - 1;
+}
@@ -0,0 +1,105 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Server counters, gauges and latency histograms.
+//
+// Every worker thread updates a block of its own with relaxed loads and
+// stores, which compile to plain memory operations: no locks, no shared
+// cache lines and no atomic read-modify-write on the hot path. The stats
+// thread sums the blocks whenever someone connects to the stats socket and
+// answers in the Prometheus text format, e.g.
+//     socat - UNIX-CONNECT:/tmp/ttt_stats.sock
+
+// Counters, and gauges kept as per-thread deltas
+#define METRIC_CONNECTIONS_OPEN 0   // Gauge
+#define METRIC_ROOMS_ACTIVE 1       // Gauge
+#define METRIC_CONNECTIONS 2
+#define METRIC_MOVES_ACCEPTED 3
+#define METRIC_MOVES_REJECTED 4
+#define METRIC_GAMES_FINISHED 5
+#define METRIC_BYTES_IN 6
+#define METRIC_BYTES_OUT 7
+#define METRIC_SEND_ERRORS 8
+#define METRIC_OUTPUT_OVERFLOWS 9
+#define METRIC_GAME_TIMEOUTS 10
+#define METRIC_IDLE_TIMEOUTS 11
+#define METRIC_JOURNAL_DROPPED 12
+#define METRIC_SNAPSHOTS 13
+#define METRIC_SEATS_HELD 14
+#define METRIC_RESUMES 15
+#define METRIC_GAMES_ABANDONED 16
+#define METRIC_OUT_CHUNKS 17        // Gauge
+#define METRIC_BIG_BOARDS 18        // Gauge
+#define METRIC_POOL_BYTES 19        // Gauge
+#define METRIC_SPECTATORS 20        // Gauge
+#define METRIC_BROADCASTS 21
+#define METRIC_BROADCASTS_SKIPPED 22
+#define METRIC_BROADCASTS_LIVE 23   // Gauge
+#define METRIC_SYSCALLS 24
+#define METRIC_COUNT 25
+
+// Histograms of durations in nanoseconds
+#define HISTOGRAM_LOOP 0   // One pass of the event loop, not counting the wait
+#define HISTOGRAM_MOVE 1   // From the move being received to the new board being sent
+#define HISTOGRAM_FORK 2   // The fork that starts a snapshot
+#define HISTOGRAM_MATCH 3  // From taking a waiting player off the queue to seating their opponent
+#define HISTOGRAM_COUNT 4
+
+// Log-linear buckets as in HDR histograms: every power of two is split
+// into 2^HISTOGRAM_SUB_BITS buckets, so a bucket is within 12.5% of its
+// values. Values from 2^40 ns (about 18 minutes) up share the last bucket.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+typedef struct {
+    _Alignas(64) _Atomic int64_t values[METRIC_COUNT];
+    _Atomic uint64_t buckets[HISTOGRAM_COUNT][HISTOGRAM_BUCKETS];
+    _Atomic uint64_t sums[HISTOGRAM_COUNT];
+} Metrics;
+
+extern __thread Metrics* metrics;  // Calling thread's block
+
+// Gives the calling thread a block of its own; until then its updates are
+// discarded
+void metrics_register_thread();
+
+// Starts the stats thread on a Unix socket at path. Returns -1 after
+// printing the error.
+int metrics_serve(const char* path);
+
+// Removes the stats socket
+void metrics_close();
+
+uint64_t metrics_now_ns();
+
+static inline void metrics_add(int metric, int64_t amount) {
+    _Atomic int64_t* value = &metrics->values[metric];
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+static inline int histogram_bucket(uint64_t value) {
+    if (value < 2 * HISTOGRAM_SUB) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    int bucket = (exponent + 1) * HISTOGRAM_SUB + (int)((value >> exponent) & (HISTOGRAM_SUB - 1));
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+// Records count observations of the same value
+static inline void metrics_observe(int histogram, uint64_t value, uint64_t count) {
+    _Atomic uint64_t* bucket = &metrics->buckets[histogram][histogram_bucket(value)];
+    _Atomic uint64_t* sum = &metrics->sums[histogram];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + count,
+                          memory_order_relaxed);
+    atomic_store_explicit(sum, atomic_load_explicit(sum, memory_order_relaxed) + value * count,
+                          memory_order_relaxed);
+}
+
+#endif
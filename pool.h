@@ -0,0 +1,90 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Pool of fixed-size objects for one thread.
+//
+// Objects are carved out of slabs of many objects at a time, and a freed
+// object goes on a free list to be handed out again first, most recently
+// freed (and so most likely still cached) first. After warm-up, allocating
+// and freeing are a pointer pop and push with no locks and no trips into
+// malloc. Slabs are never given back, so a pool stays at the peak its
+// thread has needed.
+//
+// Nothing ties an object to the pool it came from: one freed into another
+// thread's pool simply stays there, which is how output queues follow
+// connections from shard to shard.
+
+typedef struct PoolObject {
+    struct PoolObject* next;
+} PoolObject;
+
+typedef struct {
+    size_t object_size;
+    size_t slab_objects;     // Objects per slab
+    PoolObject* free_list;
+    char* slab_next;         // Next never-used object of the newest slab
+    size_t slab_left;        // Never-used objects left in the newest slab
+    
+    // Statistics
+    uint64_t allocations;    // Objects handed out
+    uint64_t slab_count;     // Slabs taken from malloc
+    int64_t in_use;          // Handed out minus freed here; negative if this pool adopted objects
+} Pool;
+
+static inline void pool_init(Pool* pool, size_t object_size, size_t slab_objects) {
+    // Every object must be able to hold the free list link and stay aligned
+    size_t align = _Alignof(max_align_t);
+    if (object_size < sizeof(PoolObject)) {
+        object_size = sizeof(PoolObject);
+    }
+    pool->object_size = (object_size + align - 1) & ~(align - 1);
+    pool->slab_objects = slab_objects;
+    pool->free_list = NULL;
+    pool->slab_next = NULL;
+    pool->slab_left = 0;
+    pool->allocations = 0;
+    pool->slab_count = 0;
+    pool->in_use = 0;
+}
+
+// Returns NULL if a new slab was needed and malloc failed
+static inline void* pool_alloc(Pool* pool) {
+    void* object;
+    if (pool->free_list != NULL) {
+        object = pool->free_list;
+        pool->free_list = pool->free_list->next;
+    } else {
+        if (pool->slab_left == 0) {
+            pool->slab_next = malloc(pool->object_size * pool->slab_objects);
+            if (pool->slab_next == NULL) {
+                return NULL;
+            }
+            pool->slab_left = pool->slab_objects;
+            pool->slab_count++;
+        }
+        object = pool->slab_next;
+        pool->slab_next += pool->object_size;
+        pool->slab_left--;
+    }
+    pool->allocations++;
+    pool->in_use++;
+    return object;
+}
+
+static inline void pool_free(Pool* pool, void* object) {
+    PoolObject* freed = object;
+    freed->next = pool->free_list;
+    pool->free_list = freed;
+    pool->in_use--;
+}
+
+// Bytes taken from malloc for slabs
+static inline size_t pool_reserved(const Pool* pool) {
+    return pool->slab_count * pool->slab_objects * pool->object_size;
+}
+
+#endif
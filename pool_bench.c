@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pool.h"
+
+#define MAX_THREADS 64
+#define CHUNK_SIZE 2048      // As OUT_CHUNK_SIZE in the server
+#define BIG_BOARD_SIZE 2148  // sizeof(BigBoard) in the server
+#define MAX_GAMES 100000
+#define BATCH_CHUNKS 256     // Chunks queued before a batch is flushed
+#define MOVES_PER_GAME 9
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    bool pooled;
+    uint64_t elapsed_ns;
+    uint32_t checksum;  // Keeps the writes from being optimized away
+} Worker;
+
+// Settings
+long cycle_count = 1000000;
+int thread_count = 1;
+int game_count = 1000;
+
+Worker workers[MAX_THREADS];
+pthread_barrier_t start_barrier;
+
+// Function prototypes
+uint64_t now_ns();
+uint64_t run_all(bool pooled, uint32_t* checksum);
+void* run_worker(void* arg);
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:g:")) != -1) {
+        switch (opt) {
+            case 'n':
+                cycle_count = atol(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'g':
+                game_count = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n cycles_per_thread] [-t threads] [-g games_per_thread]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (thread_count < 1 || thread_count > MAX_THREADS || cycle_count < 1 ||
+        game_count < 1 || game_count > MAX_GAMES) {
+        fprintf(stderr, "Need 1 to %d threads, 1 to %d games and at least one cycle\n",
+                MAX_THREADS, MAX_GAMES);
+        exit(EXIT_FAILURE);
+    }
+    
+    // The same churn, once through malloc and once through pools
+    uint32_t malloc_checksum, pool_checksum;
+    uint64_t malloc_ns = run_all(false, &malloc_checksum);
+    uint64_t pool_ns = run_all(true, &pool_checksum);
+    
+    long total = cycle_count * thread_count;
+    printf("Cycles:    %ld per thread on %d threads, %d games in flight per thread\n",
+           cycle_count, thread_count, game_count);
+    printf("malloc:    %.1f ns per cycle, %.2f M cycles/s total\n",
+           (double)malloc_ns / cycle_count, total / (malloc_ns / 1e3));
+    printf("Pools:     %.1f ns per cycle, %.2f M cycles/s total (%.2fx)\n",
+           (double)pool_ns / cycle_count, total / (pool_ns / 1e3), (double)malloc_ns / pool_ns);
+    printf("Checksum:  %08x %08x\n", malloc_checksum, pool_checksum);
+    return 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns the time the slowest thread took
+uint64_t run_all(bool pooled, uint32_t* checksum) {
+    pthread_barrier_init(&start_barrier, NULL, thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].id = i;
+        workers[i].pooled = pooled;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    uint64_t slowest = 0;
+    *checksum = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        *checksum += workers[i].checksum;
+        if (workers[i].elapsed_ns > slowest) {
+            slowest = workers[i].elapsed_ns;
+        }
+    }
+    pthread_barrier_destroy(&start_barrier);
+    return slowest;
+}
+
+// One cycle is a connect, a game and a disconnect as the server sees them:
+// a chunk of output for each player on joining and after every move, all
+// freed when the batch they were queued in is flushed, and for one game in
+// eight a big board that lives until the next game takes the room.
+void* run_worker(void* arg) {
+    Worker* worker = arg;
+    uint32_t rng = 2463534242u + worker->id;
+    uint32_t checksum = 0;
+    Pool chunks;
+    Pool boards;
+    pool_init(&chunks, CHUNK_SIZE, 64);
+    pool_init(&boards, BIG_BOARD_SIZE, 16);
+    
+    void** big_boards = calloc(game_count, sizeof(void*));
+    void* batch[BATCH_CHUNKS];
+    int batch_count = 0;
+    if (big_boards == NULL) {
+        perror("Failed to allocate game table");
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (long i = 0; i < cycle_count; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        int game = (int)(((uint64_t)rng * game_count) >> 32);
+        
+        // The room's previous game is over and its board goes back
+        if (big_boards[game] != NULL) {
+            if (worker->pooled) {
+                pool_free(&boards, big_boards[game]);
+            } else {
+                free(big_boards[game]);
+            }
+            big_boards[game] = NULL;
+        }
+        if ((rng & 7) == 0) {
+            big_boards[game] = worker->pooled ? pool_alloc(&boards) : malloc(BIG_BOARD_SIZE);
+            if (big_boards[game] == NULL) {
+                perror("Failed to allocate board");
+                exit(EXIT_FAILURE);
+            }
+            memset(big_boards[game], 0, BIG_BOARD_SIZE);
+        }
+        
+        for (int message = 0; message < 2 * (MOVES_PER_GAME + 1); message++) {
+            if (batch_count == BATCH_CHUNKS) {
+                for (int j = 0; j < batch_count; j++) {
+                    checksum += ((uint8_t*)batch[j])[0];
+                    if (worker->pooled) {
+                        pool_free(&chunks, batch[j]);
+                    } else {
+                        free(batch[j]);
+                    }
+                }
+                batch_count = 0;
+            }
+            char* chunk = worker->pooled ? pool_alloc(&chunks) : malloc(CHUNK_SIZE);
+            if (chunk == NULL) {
+                perror("Failed to allocate chunk");
+                exit(EXIT_FAILURE);
+            }
+            memset(chunk, (int)(i + message), 64);
+            batch[batch_count++] = chunk;
+        }
+    }
+    worker->elapsed_ns = now_ns() - start;
+    
+    for (int j = 0; j < batch_count; j++) {
+        checksum += ((uint8_t*)batch[j])[0];
+        if (!worker->pooled) {
+            free(batch[j]);
+        }
+    }
+    for (int j = 0; j < game_count && !worker->pooled; j++) {
+        free(big_boards[j]);
+    }
+    free(big_boards);
+    worker->checksum = checksum;
+    return NULL;
+}
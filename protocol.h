@@ -0,0 +1,181 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Binary protocol
+//
+// A client switches its connection to the binary protocol by sending the
+// text command "binary". The server answers with the line "OK binary\n" and
+// from then on both directions carry fixed-size frames instead of text.
+// All multi-byte fields are in network byte order.
+//
+// Client to server, CLIENT_FRAME_SIZE bytes:
+//   type (1)  FRAME_MOVE, FRAME_QUIT, FRAME_PLAY_BOT, FRAME_ANALYZE, FRAME_SET_BOARD,
+//             FRAME_RESUME or FRAME_WATCH
+//   flags (1) Reserved, zero
+//   seq (2)   Chosen by the client, echoed in events answering this frame
+//   room (4)  Room the move is meant for, or the room to watch for FRAME_WATCH
+//   cell (2)  row * cols + col (cols is 3 unless the room plays a bigger board),
+//             the bot's difficulty (1 easy to 3 hard) for FRAME_PLAY_BOT,
+//             or rows << 10 | cols << 5 | k for FRAME_SET_BOARD
+//
+// FRAME_RESUME carries a resume token instead: its low half (the room) in
+// room, its high half in seq (upper 16 bits) and cell (lower 16 bits).
+//
+// Server to client, SERVER_FRAME_SIZE bytes:
+//   type (1)  FRAME_STATE, FRAME_EVENT, FRAME_ANALYSIS, FRAME_CELL, FRAME_BOARD
+//             or FRAME_RESUMED
+//   code (1)  State: STATE_TURN_O bit plus the result shifted by STATE_RESULT_SHIFT
+//             Event: one of the EVENT_* codes
+//             Analysis: the best cell for the player to move
+//   seq (2)   State: the room's state counter, bumped on every change
+//             Event: seq of the client frame it answers, or the seat for EVENT_JOINED
+//   a (2)     State: cells taken by X     Event: high half of the room id for EVENT_JOINED
+//                                                and EVENT_WATCHING
+//   b (2)     State: cells taken by O     Event: low half of the room id for EVENT_JOINED
+//                                                and EVENT_WATCHING
+//
+// Rooms playing a board other than 3x3 send no state frames. A board frame
+// (code k, seq the state counter, a rows, b cols) starts an empty board, and
+// a cell frame for every move carries the state code and counter of a state
+// frame, with a = row << 8 | col and b = the player (0 for X, 1 for O).
+//
+// An analysis frame answers FRAME_ANALYZE with the value of every cell for
+// the player to move, 2 bits per cell (ANALYSIS_*): cells 0-7 in a, cell 8 in b.
+//
+// A resumed frame answers a FRAME_RESUME that got the seat back. It is a
+// state frame with RESUMED_SEAT_O set in code if the seat is O's. With
+// RESUMED_BIG_BOARD set, a and b are zero and board and cell frames follow.
+//
+// A spectator, after EVENT_WATCHING, gets the same state, board and cell
+// frames as the players of the room it watches. It may miss states in
+// between if it reads slower than the game moves, but never a result.
+
+#define CLIENT_FRAME_SIZE 10
+#define SERVER_FRAME_SIZE 8
+
+// Client frame types
+#define FRAME_MOVE 1
+#define FRAME_QUIT 2
+#define FRAME_PLAY_BOT 3        // Play the server's bot instead of waiting
+#define FRAME_ANALYZE 4         // Ask for the value of every move on the current board
+#define FRAME_SET_BOARD 5       // Choose the board size while waiting for an opponent
+#define FRAME_RESUME 6          // Take back a seat with its resume token
+#define FRAME_WATCH 7           // Watch a room instead of waiting for an opponent
+
+// Server frame types
+#define FRAME_STATE 16
+#define FRAME_EVENT 17
+#define FRAME_ANALYSIS 18
+#define FRAME_CELL 19
+#define FRAME_BOARD 20
+#define FRAME_RESUMED 21
+
+// State frame code bits
+#define STATE_TURN_O 0x01       // Set when it is O's turn
+#define STATE_RESULT_SHIFT 1
+#define RESULT_NONE 0
+#define RESULT_X_WINS 1
+#define RESULT_O_WINS 2
+#define RESULT_DRAW 3
+
+// Resumed frame code bits, on top of the state bits
+#define RESUMED_BIG_BOARD 0x40  // The board follows in board and cell frames
+#define RESUMED_SEAT_O 0x80     // The seat taken back is O's
+
+// Analysis values, from the point of view of the player to move
+#define ANALYSIS_TAKEN 0
+#define ANALYSIS_LOSS 1
+#define ANALYSIS_DRAW 2
+#define ANALYSIS_WIN 3
+
+// Event codes
+#define EVENT_NONE 0            // Not sent; marks text-only messages in the server
+#define EVENT_JOINED 1          // Sent right after switching: seat and room
+#define EVENT_WAITING 2         // Waiting for an opponent
+#define EVENT_STARTED 3         // Both players present, game is starting
+#define EVENT_NOT_STARTED 4     // Move rejected, no opponent yet
+#define EVENT_NOT_YOUR_TURN 5   // Move rejected, wrong turn
+#define EVENT_INVALID_MOVE 6    // Move rejected, cell taken or out of range
+#define EVENT_OPPONENT_QUIT 7   // A player sent quit
+#define EVENT_OPPONENT_LEFT 8   // A player disconnected
+#define EVENT_TIMEOUT 9         // Game timed out due to inactivity
+#define EVENT_SHUTDOWN 10       // Server is shutting down
+#define EVENT_UNKNOWN_COMMAND 11
+#define EVENT_BOT_UNAVAILABLE 12 // Bot requested while not waiting for an opponent
+#define EVENT_UNSUPPORTED 13    // Not available on this board size
+#define EVENT_INVALID_BOARD 14  // Board size rejected, or changed outside the waiting state
+#define EVENT_RESUMED 15        // Back in the game the resume token belongs to
+#define EVENT_RESUME_FAILED 16  // No game is waiting for that token; seated as a new player
+#define EVENT_OPPONENT_AWAY 17  // A player dropped; their seat is held for a while
+#define EVENT_WATCHING 18       // Watching a room: room id as in EVENT_JOINED
+#define EVENT_WATCH_FAILED 19   // Nothing to watch in that room, or not waiting for an opponent
+#define EVENT_WATCH_ENDED 20    // The room being watched has closed; the server disconnects
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t seq;
+    uint32_t room;
+    uint16_t cell;
+} ClientFrame;
+
+typedef struct {
+    uint8_t type;
+    uint8_t code;
+    uint16_t seq;
+    uint16_t a;
+    uint16_t b;
+} ServerFrame;
+
+static inline void encode_client_frame(const ClientFrame* frame, unsigned char* out) {
+    uint16_t seq = htons(frame->seq);
+    uint32_t room = htonl(frame->room);
+    uint16_t cell = htons(frame->cell);
+    out[0] = frame->type;
+    out[1] = frame->flags;
+    memcpy(out + 2, &seq, 2);
+    memcpy(out + 4, &room, 4);
+    memcpy(out + 8, &cell, 2);
+}
+
+static inline void decode_client_frame(const unsigned char* in, ClientFrame* frame) {
+    uint16_t seq, cell;
+    uint32_t room;
+    memcpy(&seq, in + 2, 2);
+    memcpy(&room, in + 4, 4);
+    memcpy(&cell, in + 8, 2);
+    frame->type = in[0];
+    frame->flags = in[1];
+    frame->seq = ntohs(seq);
+    frame->room = ntohl(room);
+    frame->cell = ntohs(cell);
+}
+
+static inline void encode_server_frame(const ServerFrame* frame, unsigned char* out) {
+    uint16_t seq = htons(frame->seq);
+    uint16_t a = htons(frame->a);
+    uint16_t b = htons(frame->b);
+    out[0] = frame->type;
+    out[1] = frame->code;
+    memcpy(out + 2, &seq, 2);
+    memcpy(out + 4, &a, 2);
+    memcpy(out + 6, &b, 2);
+}
+
+static inline void decode_server_frame(const unsigned char* in, ServerFrame* frame) {
+    uint16_t seq, a, b;
+    memcpy(&seq, in + 2, 2);
+    memcpy(&a, in + 4, 2);
+    memcpy(&b, in + 6, 2);
+    frame->type = in[0];
+    frame->code = in[1];
+    frame->seq = ntohs(seq);
+    frame->a = ntohs(a);
+    frame->b = ntohs(b);
+}
+
+#endif
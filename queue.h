@@ -0,0 +1,97 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Bounded lock-free multi-producer/multi-consumer queue of 64-bit values.
+// Each cell carries a sequence number that tells producers and consumers
+// whether it is free for the current lap of the ring (Vyukov's design).
+typedef struct {
+    _Atomic size_t seq;
+    uint64_t value;
+} QueueCell;
+
+typedef struct {
+    QueueCell* cells;
+    size_t mask;
+    _Alignas(64) _Atomic size_t head;  // Next cell to pop
+    _Alignas(64) _Atomic size_t tail;  // Next cell to push
+} Queue;
+
+// Capacity is rounded up to a power of two
+static inline int queue_init(Queue* q, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    
+    q->cells = malloc(size * sizeof(QueueCell));
+    if (q->cells == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->cells[i].seq, i);
+    }
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+static inline void queue_destroy(Queue* q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+// Returns false if the queue is full
+static inline bool queue_push(Queue* q, uint64_t value) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (1) {
+        QueueCell* cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->value = value;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns false if the queue is empty
+static inline bool queue_pop(Queue* q, uint64_t* value) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (1) {
+        QueueCell* cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *value = cell->value;
+                atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+#endif
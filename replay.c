@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "journal.h"
+#include "geometry.h"
+
+#define MAX_SIDE 19
+
+// A game being replayed, one per room
+typedef struct {
+    bool active;
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t k;
+    uint8_t bot_level;
+    bool decided;        // The last move completed a line
+    uint16_t ply;
+    uint16_t first_cell;
+    uint16_t marks[2];   // 3x3 boards
+    uint8_t* grid;       // Bigger boards: 0 free, 1 X, 2 O
+    uint64_t start_ms;   // Unix time
+    char* moves;         // Move list for -p, as text
+    size_t moves_length;
+} Game;
+
+typedef struct {
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t records;
+    uint64_t sessions;
+    uint64_t started;
+    uint64_t results[4];      // By RESULT_* code
+    uint64_t abandoned[2];    // By ABANDON_* reason
+    uint64_t unfinished;      // Still running at the end, or replaced by a new game
+    uint64_t moves;
+    uint64_t finished_moves;  // Moves of games that ended with a result
+    uint64_t finished_ms;
+    uint64_t bot_games;
+    uint64_t big_games;
+    uint64_t openings[9];     // First cell of finished 3x3 games
+    uint64_t mismatches;      // Records the replay does not agree with
+    uint64_t corrupt;         // Bytes skipped at the end of a cut-off file
+} Totals;
+
+// Settings
+bool print_games = false;
+
+Game* games = NULL;
+uint32_t game_capacity = 0;
+Totals totals;
+uint64_t session_ms = 0;  // Unix time the current session began
+
+// Function prototypes
+uint64_t now_ns();
+void replay_file(const char* path);
+void replay_record(JournalRecord* record);
+Game* find_game(uint32_t room);
+void end_session();
+void end_game(Game* game);
+bool place(Game* game, uint32_t cell, int player);
+bool has_win(Game* game, uint32_t cell, int player);
+int big_run(Game* game, int row, int col, int dr, int dc, int player);
+void print_game(uint32_t room, Game* game, const char* outcome, uint64_t time_ms);
+void print_totals(uint64_t elapsed_ns);
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        switch (opt) {
+            case 'p':
+                print_games = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p] <journal_file>...\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-p] <journal_file>...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    uint64_t start = now_ns();
+    for (int i = optind; i < argc; i++) {
+        replay_file(argv[i]);
+    }
+    print_totals(now_ns() - start);
+    return 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void replay_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open journal");
+        exit(EXIT_FAILURE);
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        perror("Failed to read journal size");
+        exit(EXIT_FAILURE);
+    }
+    totals.files++;
+    if (info.st_size == 0) {
+        close(fd);
+        return;
+    }
+    
+    const uint8_t* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Failed to map journal");
+        exit(EXIT_FAILURE);
+    }
+    madvise((void*)data, info.st_size, MADV_SEQUENTIAL);
+    close(fd);
+    
+    const uint8_t* at = data;
+    const uint8_t* end = data + info.st_size;
+    while (at < end) {
+        JournalRecord record;
+        size_t used = journal_decode(at, end, &record);
+        if (used == 0) {
+            // A crash can leave half a record at the end. The next server cuts it
+            // off before appending, so nothing follows it.
+            totals.corrupt += end - at;
+            break;
+        }
+        at += used;
+        totals.records++;
+        replay_record(&record);
+    }
+    end_session();
+    totals.bytes += info.st_size;
+    munmap((void*)data, info.st_size);
+}
+
+void replay_record(JournalRecord* record) {
+    if (record->type == JOURNAL_SESSION) {
+        // A server that recovered its games carries on with them in the new
+        // session, so running games stay open; one that did not simply
+        // starts new games over them
+        session_ms = record->time_ms;
+        totals.sessions++;
+        return;
+    }
+    
+    Game* game = find_game(record->room);
+    if (record->type == JOURNAL_START) {
+        if (game->active) {
+            totals.unfinished++;
+            end_game(game);
+        }
+        if (record->rows < 3 || record->rows > MAX_SIDE ||
+            record->cols < 3 || record->cols > MAX_SIDE) {
+            totals.mismatches++;
+            return;
+        }
+        game->active = true;
+        game->rows = record->rows;
+        game->cols = record->cols;
+        game->k = record->k;
+        game->bot_level = record->bot_level;
+        game->ply = 0;
+        game->decided = false;
+        game->marks[0] = 0;
+        game->marks[1] = 0;
+        game->start_ms = session_ms + record->time_ms;
+        game->moves_length = 0;
+        if (game->rows != 3 || game->cols != 3) {
+            if (game->grid == NULL) {
+                game->grid = malloc(MAX_SIDE * MAX_SIDE);
+            }
+            memset(game->grid, 0, MAX_SIDE * MAX_SIDE);
+            totals.big_games++;
+        }
+        if (game->bot_level != 0) {
+            totals.bot_games++;
+        }
+        totals.started++;
+        return;
+    }
+    
+    // Everything else has to continue the game exactly where it stands
+    if (!game->active || record->ply != game->ply) {
+        totals.mismatches++;
+        return;
+    }
+    
+    if (record->type == JOURNAL_MOVE) {
+        int player = game->ply & 1;
+        if (record->value >= (uint32_t)game->rows * game->cols || !place(game, record->value, player)) {
+            totals.mismatches++;
+            return;
+        }
+        if (game->ply == 0) {
+            game->first_cell = (uint16_t)record->value;
+        }
+        if (print_games) {
+            game->moves = realloc(game->moves, game->moves_length + 16);
+            game->moves_length += sprintf(game->moves + game->moves_length, " %u,%u",
+                                          record->value / game->cols, record->value % game->cols);
+        }
+        game->ply++;
+        totals.moves++;
+        
+        // Remember whether this move decided the game, to check the result against
+        game->decided = has_win(game, record->value, player);
+    } else if (record->type == JOURNAL_RESULT) {
+        int expected;
+        if (game->decided) {
+            expected = (game->ply & 1) ? RESULT_X_WINS : RESULT_O_WINS;
+        } else {
+            expected = game->ply == game->rows * game->cols ? RESULT_DRAW : RESULT_NONE;
+        }
+        if (record->value != (uint32_t)expected || expected == RESULT_NONE) {
+            totals.mismatches++;
+        }
+        totals.results[record->value & 3]++;
+        totals.finished_moves += game->ply;
+        totals.finished_ms += session_ms + record->time_ms - game->start_ms;
+        if (game->rows == 3 && game->cols == 3 && game->ply > 0) {
+            totals.openings[game->first_cell]++;
+        }
+        if (print_games) {
+            const char* outcome = record->value == RESULT_X_WINS ? "X wins" :
+                                  record->value == RESULT_O_WINS ? "O wins" : "draw";
+            print_game(record->room, game, outcome, session_ms + record->time_ms);
+        }
+        end_game(game);
+    } else {
+        totals.abandoned[record->value ? 1 : 0]++;
+        if (print_games) {
+            print_game(record->room, game, "abandoned", session_ms + record->time_ms);
+        }
+        end_game(game);
+    }
+}
+
+Game* find_game(uint32_t room) {
+    if (room >= game_capacity) {
+        uint32_t capacity = game_capacity ? game_capacity : 1024;
+        while (capacity <= room) {
+            capacity *= 2;
+        }
+        games = realloc(games, capacity * sizeof(Game));
+        if (games == NULL) {
+            perror("Failed to allocate games");
+            exit(EXIT_FAILURE);
+        }
+        memset(games + game_capacity, 0, (capacity - game_capacity) * sizeof(Game));
+        game_capacity = capacity;
+    }
+    return &games[room];
+}
+
+void end_session() {
+    for (uint32_t room = 0; room < game_capacity; room++) {
+        if (games[room].active) {
+            totals.unfinished++;
+            end_game(&games[room]);
+        }
+    }
+}
+
+void end_game(Game* game) {
+    game->active = false;
+}
+
+bool place(Game* game, uint32_t cell, int player) {
+    if (game->rows == 3 && game->cols == 3) {
+        uint16_t bit = 1 << cell;
+        if ((game->marks[0] | game->marks[1]) & bit) {
+            return false;
+        }
+        game->marks[player] |= bit;
+        return true;
+    }
+    int row = cell / game->cols;
+    int col = cell % game->cols;
+    if (game->grid[row * MAX_SIDE + col] != 0) {
+        return false;
+    }
+    game->grid[row * MAX_SIDE + col] = (uint8_t)(player + 1);
+    return true;
+}
+
+bool has_win(Game* game, uint32_t cell, int player) {
+    if (game->rows == 3 && game->cols == 3) {
+        return holds_line(game->marks[player]);
+    }
+    
+    // Only the four lines through the move can have been completed by it
+    int row = cell / game->cols;
+    int col = cell % game->cols;
+    return big_run(game, row, col, 0, 1, player) >= game->k ||
+           big_run(game, row, col, 1, 0, player) >= game->k ||
+           big_run(game, row, col, 1, 1, player) >= game->k ||
+           big_run(game, row, col, 1, -1, player) >= game->k;
+}
+
+// Length of the player's run through (row, col) along one direction
+int big_run(Game* game, int row, int col, int dr, int dc, int player) {
+    int length = 1;
+    for (int sign = -1; sign <= 1; sign += 2) {
+        int r = row + sign * dr;
+        int c = col + sign * dc;
+        while (r >= 0 && r < game->rows && c >= 0 && c < game->cols &&
+               game->grid[r * MAX_SIDE + c] == player + 1) {
+            length++;
+            r += sign * dr;
+            c += sign * dc;
+        }
+    }
+    return length;
+}
+
+void print_game(uint32_t room, Game* game, const char* outcome, uint64_t time_ms) {
+    printf("room %u %dx%d k%d%s: %s after %u moves in %.1f s:%.*s\n", room,
+           game->rows, game->cols, game->k, game->bot_level ? " vs bot" : "", outcome,
+           game->ply, (time_ms - game->start_ms) / 1000.0, (int)game->moves_length,
+           game->moves ? game->moves : "");
+}
+
+void print_totals(uint64_t elapsed_ns) {
+    uint64_t finished = totals.results[RESULT_X_WINS] + totals.results[RESULT_O_WINS] +
+                        totals.results[RESULT_DRAW];
+    double seconds = elapsed_ns / 1e9;
+    
+    printf("Journals:  %llu files, %llu sessions, %.1f MB, %llu records\n",
+           (unsigned long long)totals.files, (unsigned long long)totals.sessions,
+           totals.bytes / 1e6, (unsigned long long)totals.records);
+    printf("Games:     %llu started (%llu against the bot, %llu on bigger boards)\n",
+           (unsigned long long)totals.started, (unsigned long long)totals.bot_games,
+           (unsigned long long)totals.big_games);
+    printf("Results:   %llu finished: X %llu, O %llu, draw %llu\n", (unsigned long long)finished,
+           (unsigned long long)totals.results[RESULT_X_WINS],
+           (unsigned long long)totals.results[RESULT_O_WINS],
+           (unsigned long long)totals.results[RESULT_DRAW]);
+    printf("Abandoned: %llu on disconnect, %llu on timeout, %llu unfinished\n",
+           (unsigned long long)totals.abandoned[ABANDON_DISCONNECT],
+           (unsigned long long)totals.abandoned[ABANDON_TIMEOUT],
+           (unsigned long long)totals.unfinished);
+    if (finished > 0) {
+        printf("Length:    %llu moves, %.2f per finished game, %.2f s average\n",
+               (unsigned long long)totals.moves, (double)totals.finished_moves / finished,
+               totals.finished_ms / 1000.0 / finished);
+    }
+    
+    uint64_t openings = 0;
+    for (int cell = 0; cell < 9; cell++) {
+        openings += totals.openings[cell];
+    }
+    if (openings > 0) {
+        printf("Openings:  3x3 first moves by cell, %%\n");
+        for (int row = 0; row < 3; row++) {
+            printf("          ");
+            for (int col = 0; col < 3; col++) {
+                printf(" %5.1f", 100.0 * totals.openings[row * 3 + col] / openings);
+            }
+            printf("\n");
+        }
+    }
+    
+    if (totals.mismatches > 0 || totals.corrupt > 0) {
+        printf("Problems:  %llu records out of step with the replay, %llu trailing bytes cut off\n",
+               (unsigned long long)totals.mismatches, (unsigned long long)totals.corrupt);
+    }
+    printf("Replayed:  %.3f s, %.1f M records/s, %.2f M games/s\n", seconds,
+           totals.records / seconds / 1e6, totals.started / seconds / 1e6);
+}
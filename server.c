@@ -1,533 +1,4460 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "protocol.h"
+#include "queue.h"
+#include "pool.h"
+#include "match.h"
+#include "timer.h"
+#include "game.h"
+#include "tt.h"
+#include "capture.h"
+#include "trace.h"
+#include "metrics.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "upgrade.h"
+#include "uring.h"
+#include "shm.h"
 
 #define SERVER_PORT 8080
-#define MAX_CLIENTS 2
+#define MAX_CLIENTS 2        // Players per room
+#define MAX_ROOMS 65536      // Concurrent matches hosted by one server
+#define MAX_FDS (MAX_ROOMS * MAX_CLIENTS + 64)
+#define MAX_EVENTS 256       // Events fetched per epoll_wait call
+#define MAX_SHARDS 64        // Worker threads, each with its own event loop
+#define INBOX_SIZE 4096      // Connections that can be in flight between shards
 #define BUFFER_SIZE 1024
+#define MAX_BOARD_SIZE 19    // Largest m,n,k board side
+#define BOARD_TEXT_SIZE 2048 // Fits a message plus the rendering of the largest board
+#define SMALL_BOARD_TEXT_SIZE 62   // Fits the rendering of the 3x3 board
+#define BIG_BOARD_TEXT_SIZE 1232   // Fits the rendering of the largest board
+#define BOARD_FRAMES_SIZE ((1 + MAX_BOARD_SIZE * MAX_BOARD_SIZE) * SERVER_FRAME_SIZE)
+#define RECV_BUFFER_SIZE 256 // Per-connection input ring, must be a power of two
+#define SHM_INPUT_BUDGET (4 * RECV_BUFFER_SIZE)  // Shared-memory input handled per wakeup
+#define OUT_CHUNK_SIZE 2048  // Allocation unit of per-connection output queues
+#define OUT_CHUNK_SLAB 64    // Output chunks taken from malloc at a time
+#define BROADCAST_SIZE 4096  // Largest state sent to spectators, the frames of a full 19x19 board
+#define BROADCAST_SLAB 16    // Broadcasts taken from malloc at a time
+#define BIG_BOARD_SLAB 16    // Big boards taken from malloc at a time
+#define MAX_WRITE_IOVECS 64  // Chunks handed to one writev call, or linked sends to the ring
+#define URING_ENTRIES 1024   // Submission slots of a shard's io_uring
+#define URING_BUFFERS 1024   // Provided receive buffers per shard, a power of two
+#define URING_BUFFER_SIZE 1024
+#define URING_GROUP 0        // Buffer group of the receive buffers
+#define DEFAULT_HIGH_WATER (64 * 1024) // Queued output bytes before a client is dropped
 #define TIMEOUT_SECONDS 300 // 5 minutes timeout
+#define IDLE_TIMEOUT_SECONDS 900 // Connections that send nothing for 15 minutes are dropped
+#define DEFAULT_STATS_PATH "/tmp/ttt_stats.sock"
+#define DEFAULT_FSYNC_MS 100  // Journal group commit interval
+#define DEFAULT_SNAPSHOT_SECONDS 10
+#define DEFAULT_UPGRADE_PATH "/tmp/ttt_upgrade.sock"
+#define DEFAULT_LOCAL_PATH "/tmp/ttt_local.sock"
+#define DEFAULT_GRACE_SECONDS 60  // Seat of a player who dropped out of a game is held this long
+#define INBOX_RESUME (1ULL << 32)  // Inbox entry is a connection claiming a seat in this shard
+#define INBOX_MATCH (1ULL << 33)   // Inbox entry is a connection paired with a player waiting here
+#define INBOX_SPECTATE (1ULL << 34) // Inbox entry is a connection that wants to watch a room here
+#define EPOLL_SHM (1ULL << 32)     // Epoll data of a shared-memory eventfd, the socket in the low half
+#define CLASSIC_VARIANT (3 << 10 | 3 << 5 | 3)  // rows << 10 | cols << 5 | k, as in FRAME_SET_BOARD
+
+#define BOT_SEAT 1           // The bot always plays O
+
+// What a completion of a shard's io_uring belongs to, in the high half of
+// its user_data; the low half holds the socket
+#define RING_ACCEPT 1        // Multishot accept on the listen socket
+#define RING_WAKE 2          // Multishot poll on the inbox eventfd
+#define RING_RAW 3           // Multishot poll on the packet capture ring
+#define RING_RECV 4          // Multishot recv of a connection
+#define RING_SEND 5          // One of a connection's linked sends
+#define RING_CANCEL 6
+
+// What happens to a connection once the ring is done with it
+#define DETACH_NONE 0
+#define DETACH_CLOSE 1       // Closed, as flush_pending_closes does
+#define DETACH_HANDOFF 2     // Passed to another shard, as flush_handoffs does
+
+// What the id of a timer refers to
+#define TIMER_ROOM 0         // rooms[id], a running game
+#define TIMER_IDLE 1         // connections[id]
+#define TIMER_GRACE 2        // rooms[id], a seat held for a player who dropped
+
+// A 3x3 board as rendered for text clients. Each move patches its cell in
+// place, so sending the board is a copy rather than a render.
+typedef struct {
+    uint16_t length;
+    char text[SMALL_BOARD_TEXT_SIZE];
+} BoardText;
+
+// Cells of a rows x cols board won by k in a row. Every cell is a bit in four
+// packed lines, one per direction, so the lines through a move are one word each.
+typedef struct {
+    int rows;
+    int cols;
+    int k;
+    int moves;                                         // Cells taken so far
+    uint32_t row_bits[2][MAX_BOARD_SIZE];              // Bit col of row
+    uint32_t col_bits[2][MAX_BOARD_SIZE];              // Bit row of col
+    uint32_t diag_bits[2][2 * MAX_BOARD_SIZE - 1];     // Index row - col + cols - 1, bit row
+    uint32_t anti_bits[2][2 * MAX_BOARD_SIZE - 1];     // Index row + col, bit row
+    uint16_t text_length;
+    char text[BIG_BOARD_TEXT_SIZE];                    // Rendered for text clients, patched like BoardText
+} BigBoard;
 
-// Game state
+// Players and bookkeeping of one room
 typedef struct {
-    char board[3][3];
-    int current_player;  // 0 for first player (X), 1 for second player (O)
     int connected_clients;
-    int client_sockets[MAX_CLIENTS];
+    int client_sockets[MAX_CLIENTS];  // -1 for an empty seat
+    uint64_t tokens[MAX_CLIENTS];     // Resume token of each seat, 0 for the bot or an empty seat
     bool game_active;
-    time_t last_activity;
-} GameState;
+    bool in_use;
+    uint16_t state_seq;  // Bumped on every board change, sent in state frames and lines
+    int bot_level;       // BOT_NONE, or the difficulty of the bot sitting in BOT_SEAT
+    BigBoard* big;       // Cells of an m,n,k board; NULL for the 3x3 board in boards[]
+    bool waiting;  // Listed in the matchmaker with a player waiting for an opponent
+} Room;
+
+// Deadlines of one room. Kept apart from Room, like its board, so that the
+// fields a move touches fit one cache line per room.
+typedef struct {
+    Timer game;   // Inactivity deadline while a game is running
+    Timer grace;  // Runs while a seat is held for a player who dropped
+} Deadlines;
+
+// Growable list of file descriptors
+typedef struct {
+    int* fds;
+    int count;
+    int capacity;
+} FdList;
+
+// A state update encoded once and shared by the output queues of every
+// spectator of a room. Never changed once published; whoever drops the last
+// reference frees it, which may be another shard once a spectator moves on.
+typedef struct {
+    _Atomic int refs;
+    uint32_t length;
+    bool keep;   // Holds a result, so a newer state must not take its place
+    char data[BROADCAST_SIZE];
+} Broadcast;
+
+// One piece of a connection's output queue; [start, end) is still unsent.
+// A chunk that refers to a broadcast sends its bytes and has no data of its
+// own; it is allocated without the data array.
+typedef struct OutChunk {
+    struct OutChunk* next;
+    uint32_t start;
+    uint32_t end;
+    Broadcast* shared;
+    bool sending;  // Handed to a send in the ring, so neither appended to nor replaced
+    char data[OUT_CHUNK_SIZE];
+} OutChunk;
+
+// Connections watching a room, each knowing its index in the list
+typedef struct {
+    FdList spectators;
+} Audience;
+
+// A room handed over by the server this one replaced, adopted by its shard
+typedef struct {
+    UpgradeRoom room;  // Seats renumbered to the sockets of this process
+    uint32_t row_bits[2][MAX_BOARD_SIZE];
+} HandedRoom;
+
+// A connection handed over by the server this one replaced
+typedef struct {
+    int fd;
+    int state;   // UPGRADE_SEATED, UPGRADE_ACCEPTED, UPGRADE_RESUMING or UPGRADE_MATCHING
+    int shard;   // Shard that takes it
+} HandedConnection;
+
+// Per-connection state, indexed directly by file descriptor
+typedef struct {
+    bool in_use;
+    int room;   // Index into rooms[]
+    int seat;   // Index into the room's client_sockets[], -1 while spectating
+    bool binary;  // Speaks the binary protocol from protocol.h
+    bool deltas;  // Text client that asked for state and delta lines instead of boards
+    bool spectating;     // Watching room rather than playing in it
+    int spectator_index; // Position in the room's audience while spectating
+    bool local;          // Came in through the Unix listen socket
+    
+    // Rings shared with a local client that asked for them with 'shm', NULL
+    // otherwise. Input and output then go through the rings, and the socket
+    // only tells when the client is gone.
+    ShmChannel* shm;
+    int shm_wake_fd;     // Written by the client: input, or room for output
+    int shm_notify_fd;   // Written here: output, or room for input
+    
+    // Input ring. The indices run freely and are masked on access:
+    // [recv_head, recv_scan) is a partial line known to hold no newline,
+    // [recv_scan, recv_tail) has been received but not searched yet.
+    uint32_t recv_head;
+    uint32_t recv_scan;
+    uint32_t recv_tail;
+    bool recv_discard;  // Dropping the rest of an over-long line
+    char recv_buffer[RECV_BUFFER_SIZE];
+    
+    // Output queue, written out with writev at the end of each event batch
+    // and whenever the socket becomes writable again
+    OutChunk* out_head;
+    OutChunk* out_tail;
+    size_t out_bytes;
+    bool out_dirty;     // Listed in the shard's dirty list
+    bool out_overflow;  // Passed the high-water mark, to be dropped
+    
+    // Requests of the io_uring backend in flight for the connection. It
+    // leaves the shard's ring, closed or passed on, only once all are done.
+    bool receiving;     // Multishot recv armed
+    int sends;          // Linked sends not completed yet
+    bool send_failed;   // A send came up short and the rest of its chain is cancelled
+    int detach;         // DETACH_CLOSE or DETACH_HANDOFF once they are done
+    
+    Timer idle_timer;   // Re-armed whenever the client sends something
+    uint64_t resume_token;  // Seat being claimed while handed to another shard
+    uint64_t handoff;       // INBOX_RESUME, INBOX_MATCH or INBOX_SPECTATE while passed to another shard
+    
+    // Room of the waiting player the connection was paired with, while it
+    // is on its way to the shard running that room
+    int match_room;
+    uint32_t match_ticket;  // Ticket the pairing left the room with
+    uint16_t match_variant;
+    uint64_t match_ns;      // When the pairing was made
+} Connection;
+
+// One worker thread: its own listen socket, event loop and slice of rooms.
+// Nothing in here is touched by other threads except the inbox.
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    int listen_fd;
+    int wake_fd;         // eventfd signalled when the inbox has connections
+    int raw_fd;          // Packet capture ring, only watched by shard 0
+    int local_fd;        // Unix listen socket, shared by every shard
+    
+    // rooms[first_room .. first_room + room_count) belong to this shard
+    int first_room;
+    int room_count;
+    int* free_rooms;     // Stack of unused room indices
+    int free_room_count;
+    int active_rooms;
+    
+    // Deadlines of this shard's rooms and connections, in seconds
+    TimerWheel timers;
+    uint64_t now;        // Current tick, read once per batch of events
+    int batch_moves;     // Moves made in the current batch, for the latency histogram
+    
+    Queue inbox;         // Accepted fds handed over by other shards
+    Queue relists;       // Waiting rooms here that matchmaking had to take off its queue
+    
+    // Sockets dropped during the current batch of events. They are closed
+    // once the batch is done so that their fd numbers (and connection
+    // slots) cannot be reused by another shard while still referenced here.
+    FdList pending_close;
+    
+    // Connections that queued output during the current batch of events
+    FdList dirty;
+    
+    // Connections resuming a game or joining a waiting player on another
+    // shard, passed on once the batch is done
+    FdList handoffs;
+    
+    // With the io_uring backend, the ring takes the place of the epoll set
+    Uring ring;
+    int ring_ops;        // Requests in the ring that have not completed for the last time
+    bool draining;       // Winding the ring down for an upgrade: input is kept, not handled
+} Shard;
+
+Room rooms[MAX_ROOMS];
+Board boards[MAX_ROOMS];  // boards[i] is the board of rooms[i], kept out of Room to pack densely
+BoardText board_texts[MAX_ROOMS];  // board_texts[i] renders boards[i]
+Deadlines deadlines[MAX_ROOMS];  // deadlines[i] are the timers of rooms[i]
+Audience audiences[MAX_ROOMS];   // audiences[i] watch rooms[i]
+Connection connections[MAX_FDS];
+
+// What text clients are told follows the board, by whose turn it is or by result
+const char* turn_lines[2] = { "It's Player 1's (X) turn\n", "It's Player 2's (O) turn\n" };
+const char* result_lines[4] = { "", "Player 1 (X) wins!\n", "Player 2 (O) wins!\n",
+                                "Game ended in a draw!\n" };
+
+// The same, as the end of a delta line
+const char* delta_turns[2] = { "turn X", "turn O" };
+const char* delta_results[4] = { "", "X wins", "O wins", "draw" };
+
+Shard shards[MAX_SHARDS];
+int shard_count = 1;
+__thread Shard* shard;  // Shard owned by the calling thread
+
+// Output chunks and big boards released by the calling thread, handed out
+// again before anything new is taken from malloc
+__thread Pool out_chunk_pool;
+__thread Pool shared_chunk_pool;  // Chunks that refer to a broadcast
+__thread Pool broadcast_pool;
+__thread Pool big_board_pool;
+
+// Clients on this host may connect through a Unix socket instead (-L)
+const char* local_path = DEFAULT_LOCAL_PATH;
+
+// Sockets are driven through a per-shard io_uring instead of epoll (-E uring)
+bool use_uring = false;
+
+// Output a client may leave unread before it is disconnected (-w)
+size_t output_high_water = DEFAULT_HIGH_WATER;
+
+// Seconds a dropped player has to come back with their token (-g), 0 to end
+// the game right away
+int grace_seconds = DEFAULT_GRACE_SECONDS;
+
+// Players waiting for an opponent, by board variant, shared by all shards.
+// match_tickets[i] is the matchmaking ticket of rooms[i].
+Matchmaker matchmaker;
+_Atomic uint32_t match_tickets[MAX_ROOMS];
+
+// Games recovered at startup, adopted by the shard owning each room
+SavedGame* recovered_games = NULL;
+uint32_t recovered_count = 0;
+bool snapshots_on = false;  // Running games survive a restart (-P)
+
+// Handing the server over to a new binary (-U, -u). The upgrade thread
+// raises the flag and waits for every shard to park at the end of its
+// batch; from then on it has the rooms and connections to itself.
+const char* upgrade_path = DEFAULT_UPGRADE_PATH;
+int upgrade_fd = -1;
+pthread_t upgrade_thread;
+_Atomic bool upgrading = false;
+int parked_shards = 0;
+pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t park_changed = PTHREAD_COND_INITIALIZER;
+
+// Ctrl-C only raises this flag and wakes the shards; each says goodbye to
+// the clients in its own rooms at the end of its batch
+_Atomic bool stopping = false;
+
+// What the replaced server handed over, adopted by each shard as it starts
+HandedRoom* handed_rooms = NULL;
+uint32_t handed_room_count = 0;
+HandedConnection* handed_connections = NULL;
+uint32_t handed_connection_count = 0;
+uint64_t handover_paused_ns = 0;   // When the replaced server stopped serving
+_Atomic int shards_adopting = 0;   // Shards still taking over their part
+
+// Function prototypes
+void initialize_shard(Shard* s, int id, int raw_fd, int listen_fd, int local_fd);
+void* run_shard(void* arg);
+void initialize_ring();
+void arm_ring_listeners();
+void handle_completions();
+uint64_t ring_data(int op, int fd);
+void arm_poll(int fd, int op);
+void arm_recv(int client_socket);
+void accept_completed(int listen_fd, int result, bool last);
+void recv_completed(int client_socket, int result, uint32_t flags);
+void send_completed(int client_socket, int result);
+void submit_output(int client_socket);
+void detach_connection(int client_socket, int how);
+void ring_op_done(int client_socket);
+void drain_ring();
+void resume_ring();
+void initialize_pools();
+void initialize_game(Room* room);
+int allocate_room();
+void release_room(int room_id);
+void push_waiting_room(int room_id);
+void remove_waiting_room(int room_id);
+void relist_room(int room_id);
+void handle_new_connections(int listen_fd);
+void handle_inbox();
+void seat_connection(int client_socket, bool local);
+void prepare_connection(int client_socket, bool local);
+bool place_connection(int client_socket);
+void match_connection(int client_socket);
+int take_opponent(int client_socket, uint16_t variant);
+void join_opponent(int client_socket);
+void find_opponent(int client_socket);
+void open_room(int client_socket);
+uint16_t room_variant(Room* room);
+Shard* room_shard(int room_id);
+void pass_on(int client_socket, uint64_t kind);
+int watch_connection(int client_socket);
+void enter_room(int client_socket, int room_id);
+void leave_room(int client_socket);
+void hold_seat(int client_socket);
+void abandon_game(int room_id, char* message);
+bool has_held_seat(Room* room);
+void resume_game(int client_socket, uint64_t token);
+void resume_connection(int client_socket);
+void spectate_room(int client_socket, uint32_t room_id);
+void spectator_connection(int client_socket);
+void add_spectator(int client_socket);
+void remove_spectator(int client_socket);
+void publish_state(Room* room, int result, const char* text, int cell);
+void claim_seat(int client_socket);
+void flush_handoffs();
+void finish_handoff(int client_socket);
+uint64_t new_token(int room_id);
+void handle_raw_packets(int server_fd);
+void log_raw_packet(const unsigned char* packet, uint32_t length);
+void handle_client_input(int client_socket);
+void take_input(int client_socket, const char* data, uint32_t length);
+void discard_overlong_line(int client_socket);
+void process_input_lines(int client_socket);
+void dispatch_line(int client_socket, uint32_t start, uint32_t end);
+void process_input_frames(int client_socket);
+void handle_client_message(int client_socket, char* message);
+void handle_client_frame(int client_socket, ClientFrame* frame);
+void play_move(int client_socket, int row, int col, uint16_t seq);
+void finish_move(Room* room, int player_index, int row, int col);
+void start_bot_game(int client_socket, int level, uint16_t seq);
+void play_bot_move(Room* room);
+void quit_game(int client_socket);
+void switch_to_binary(int client_socket);
+void open_shm(int client_socket);
+void handle_shm_input(int client_socket);
+void send_analysis(int client_socket, bool full, uint16_t seq);
+int best_move(Board* board, uint32_t values);
+Board* room_board(Room* room);
+Deadlines* room_deadlines(Room* room);
+bool make_big_move(BigBoard* big, int row, int col, int player);
+bool check_big_win(BigBoard* big, int row, int col, int player);
+int run_length(uint32_t bits, int index);
+void clear_big_board(BigBoard* big);
+void choose_board(int client_socket, int rows, int cols, int k, uint16_t seq);
+void send_board_frames(int client_socket, Room* room);
+size_t encode_board_frames(Room* room, int result, unsigned char* out);
+void print_board_to_string(Room* room, char* buffer);
+void render_board(Room* room);
+void patch_board(Room* room, int row, int col, int player);
+const char* board_text(Room* room, size_t* length);
+void send_game_state(Room* room);
+void send_game_state_to(Room* room, int only_socket);
+void format_game_state(Room* room, char* buffer);
+int format_state_line(Room* room, char* buffer);
+int format_delta_line(Room* room, int cell, int result, char* buffer);
+void set_deltas(int client_socket, bool on);
+void resync(int client_socket);
+void send_to_client(int client_socket, char* message);
+void send_frame(int client_socket, ServerFrame* frame);
+void queue_output(int client_socket, const void* data, size_t length);
+void queue_broadcast(int client_socket, Broadcast* broadcast);
+void mark_dirty(int client_socket);
+bool append_output(Connection* conn, const void* data, size_t length);
+int flush_output(int client_socket);
+int flush_shm_output(int client_socket);
+void flush_dirty_connections();
+void free_output(Connection* conn);
+void* take_pooled(Pool* pool, int metric);
+void give_back_pooled(Pool* pool, void* object, int metric);
+char* chunk_bytes(OutChunk* chunk);
+void free_chunk(OutChunk* chunk);
+Broadcast* alloc_broadcast();
+void release_broadcast(Broadcast* broadcast);
+bool fd_list_push(FdList* list, int fd);
+void send_event(int client_socket, int event, uint16_t seq, char* message);
+void broadcast_event(Room* room, int event, char* message);
+void fill_state_frame(Room* room, int result, ServerFrame* frame);
+void handle_client_disconnect(int client_socket);
+void close_connection(int client_socket);
+void flush_pending_closes();
+void finish_close(int client_socket);
+void discard_connection(int client_socket);
+void arm_room_timer(Room* room);
+void record_game_start(Room* room);
+void record_game_event(Room* room, int type, int ply, int value);
+int moves_made(Room* room);
+bool save_game(uint32_t room_id, SavedGame* game);
+void recover_games(const char* snapshot_path, const char* journal_path);
+void restore_games();
+void restore_game(SavedGame* game);
+void compact_free_rooms();
+bool set_board(Room* room, int rows, int cols, int k, uint32_t row_bits[2][MAX_BOARD_SIZE]);
+void* run_upgrades(void* arg);
+void park_shard();
+bool hand_over(int sock);
+bool hand_over_connection(int sock, UpgradeMessage* message, int fd, int state, int shard_id);
+bool hand_over_output(int sock, UpgradeMessage* message, int fd);
+int take_over_listeners(const char* path, int* listen_fds, int* local_fd);
+void take_over_server(int sock);
+void take_over_connections(UpgradeMessage* message, int* fd_map);
+void take_over_rooms(UpgradeMessage* message, int* fd_map);
+void adopt_handover();
+void adopt_room(HandedRoom* handed);
+void adopt_connection(HandedConnection* handed);
+void handle_timer(Timer* timer);
+uint64_t monotonic_ms();
+void request_shutdown(int sig);
+bool may_stop();
+void stop_shard();
+void cleanup_and_exit();
+void print_board(Room* room);
+int set_nonblocking(int fd);
+void raise_fd_limit();
+int create_listen_socket();
+int create_local_socket(const char* path);
+
+int main(int argc, char* argv[]) {
+    // One worker per core unless told otherwise
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    shard_count = cores > 0 ? (int)cores : 1;
+    
+    const char* trace_path = NULL;
+    const char* stats_path = DEFAULT_STATS_PATH;
+    const char* journal_path = NULL;
+    const char* snapshot_path = NULL;
+    int fsync_ms = DEFAULT_FSYNC_MS;
+    int snapshot_seconds = DEFAULT_SNAPSHOT_SECONDS;
+    int verbosity = TRACE_EVENTS;
+    bool take_over = false;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:T:v:S:J:F:P:I:U:ug:E:L:")) != -1) {
+        switch (opt) {
+            case 't':
+                shard_count = atoi(optarg);
+                break;
+            case 'w':
+                output_high_water = strtoul(optarg, NULL, 10);
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 'v':
+                verbosity = atoi(optarg);
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'F':
+                fsync_ms = atoi(optarg);
+                break;
+            case 'P':
+                snapshot_path = optarg;
+                break;
+            case 'I':
+                snapshot_seconds = atoi(optarg);
+                break;
+            case 'U':
+                upgrade_path = optarg;
+                break;
+            case 'u':
+                take_over = true;
+                break;
+            case 'g':
+                grace_seconds = atoi(optarg);
+                break;
+            case 'L':
+                local_path = optarg;
+                break;
+            case 'E':
+                if (strcmp(optarg, "uring") == 0) {
+                    use_uring = true;
+                } else if (strcmp(optarg, "epoll") != 0) {
+                    fprintf(stderr, "Backend must be epoll or uring\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-w output_high_water_bytes] "
+                        "[-T trace_file] [-v trace_level] [-S stats_socket] "
+                        "[-J journal_file] [-F fsync_interval_ms] "
+                        "[-P snapshot_file] [-I snapshot_interval_s] "
+                        "[-U upgrade_socket] [-u] [-g grace_seconds] [-E epoll|uring] "
+                        "[-L local_socket]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (shard_count < 1 || shard_count > MAX_SHARDS) {
+        fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_SHARDS);
+        exit(EXIT_FAILURE);
+    }
+    if (snapshot_path != NULL && journal_path == NULL) {
+        fprintf(stderr, "Snapshots need a journal (-J) to recover from\n");
+        exit(EXIT_FAILURE);
+    }
+    if (grace_seconds < 0 || grace_seconds > TIMEOUT_SECONDS) {
+        fprintf(stderr, "Grace period must be between 0 and %d seconds\n", TIMEOUT_SECONDS);
+        exit(EXIT_FAILURE);
+    }
+    
+    // Set up signal handling for clean exit. Every thread started from here
+    // on inherits SIGINT blocked, so only shard 0 ever takes it.
+    sigset_t interrupt;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, NULL);
+    signal(SIGINT, request_shutdown);
+    signal(SIGPIPE, SIG_IGN);  // Report closed peers through send() errors instead
+    raise_fd_limit();
+    game_init();
+    tt_init();
+    
+    // Note: For raw sockets, we need root privileges
+    if (getuid() != 0) {
+        fprintf(stderr, "Raw sockets require root privileges. Please run as root.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Capture the segments sent to our port through a filtered packet ring
+    int server_fd = capture_open(SERVER_PORT);
+    if (server_fd < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    // Waiting players of every shard meet in one matchmaking queue
+    if (match_init(&matchmaker, MAX_ROOMS) < 0) {
+        perror("Failed to allocate matchmaking queue");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Taking over from a running server starts with its listen sockets
+    int listen_fds[MAX_SHARDS];
+    int local_fd = -1;
+    int upgrade_sock = -1;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        listen_fds[i] = -1;
+    }
+    if (take_over) {
+        upgrade_sock = take_over_listeners(upgrade_path, listen_fds, &local_fd);
+    }
+    
+    // Clients on this host can skip the TCP stack through a Unix socket
+    if (local_fd < 0) {
+        local_fd = create_local_socket(local_path);
+        if (local_fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Every shard gets its own listen socket, event loop and slice of rooms
+    for (int i = 0; i < shard_count; i++) {
+        initialize_shard(&shards[i], i, i == 0 ? server_fd : -1, listen_fds[i], local_fd);
+    }
+    
+    // The main thread runs shard 0, and taking over queues output from it
+    // before that starts
+    metrics_register_thread();
+    initialize_pools();
+    
+    if (take_over) {
+        // Take the players of the running server. Everything slow is done by
+        // now, so play only stops for the handover itself.
+        take_over_server(upgrade_sock);
+    } else if (snapshot_path != NULL) {
+        // Bring back the games that were running when the server last stopped
+        recover_games(snapshot_path, journal_path);
+    }
+    
+    // Events go to a binary trace instead of stdout, read it with ttt_tracedump
+    if (trace_path != NULL && trace_open(trace_path, verbosity) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    // Every move and result is appended to the journal, read it with ttt_replay
+    if (journal_path != NULL && journal_open(journal_path, fsync_ms) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    // Counters and histograms are read through a Unix socket
+    if (metrics_serve(stats_path) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    // The next binary takes over through the upgrade socket
+    upgrade_fd = upgrade_listen(upgrade_path);
+    if (upgrade_fd < 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&upgrade_thread, NULL, run_upgrades, NULL) != 0) {
+        perror("Failed to start upgrade thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(upgrade_thread);
+    
+    // From now on the running games are copied out in the background
+    if (snapshot_path != NULL) {
+        if (snapshot_start(snapshot_path, snapshot_seconds, MAX_ROOMS, save_game) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        snapshots_on = true;
+    }
+    
+    printf("Tic-Tac-Toe server started on port %d and %s (%d threads, up to %d rooms, %s)\n",
+           SERVER_PORT, local_path, shard_count, MAX_ROOMS, use_uring ? "io_uring" : "epoll");
+    printf("Waiting for players to connect...\n");
+    
+    // Shard 0 runs on the main thread
+    for (int i = 1; i < shard_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_UNBLOCK, &interrupt, NULL);
+    run_shard(&shards[0]);
+    
+    // Interrupted: wait for the other shards to see off their clients
+    for (int i = 1; i < shard_count; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+    cleanup_and_exit();
+    return 0;
+}
+
+int create_listen_socket() {
+    // Create a standard TCP socket for accepting connections
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        perror("Listen socket creation failed");
+        return -1;
+    }
+    
+    // Set socket options to reuse address, and let every shard bind the same
+    // port so that the kernel spreads incoming connections across them
+    int opt = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Setsockopt failed");
+        close(listen_fd);
+        return -1;
+    }
+    
+    // Prepare the sockaddr_in structure
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(SERVER_PORT);
+    
+    // Bind the socket
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(listen_fd);
+        return -1;
+    }
+    
+    // Listen for connections
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        perror("Listen failed");
+        close(listen_fd);
+        return -1;
+    }
+    
+    return listen_fd;
+}
+
+int create_local_socket(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Local socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    
+    int local_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (local_fd < 0) {
+        perror("Local socket creation failed");
+        return -1;
+    }
+    
+    // A socket left behind by a previous run would make bind fail
+    unlink(path);
+    if (bind(local_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(local_fd, SOMAXCONN) < 0) {
+        perror("Local socket bind failed");
+        close(local_fd);
+        return -1;
+    }
+    return local_fd;
+}
+
+void initialize_shard(Shard* s, int id, int raw_fd, int listen_fd, int local_fd) {
+    s->id = id;
+    s->raw_fd = raw_fd;
+    s->local_fd = local_fd;
+    
+    // Split the room table evenly between shards
+    int per_shard = MAX_ROOMS / shard_count;
+    s->first_room = id * per_shard;
+    s->room_count = per_shard;
+    
+    // Push indices in reverse so that the shard's first room is handed out first
+    s->free_rooms = malloc(per_shard * sizeof(int));
+    if (s->free_rooms == NULL) {
+        perror("Failed to allocate room table");
+        exit(EXIT_FAILURE);
+    }
+    s->free_room_count = 0;
+    for (int i = per_shard - 1; i >= 0; i--) {
+        rooms[s->first_room + i].in_use = false;
+        rooms[s->first_room + i].waiting = false;
+        rooms[s->first_room + i].big = NULL;
+        timer_init(&deadlines[s->first_room + i].game, TIMER_ROOM, s->first_room + i);
+        timer_init(&deadlines[s->first_room + i].grace, TIMER_GRACE, s->first_room + i);
+        s->free_rooms[s->free_room_count++] = s->first_room + i;
+    }
+    s->active_rooms = 0;
+    s->now = monotonic_ms() / 1000;
+    timer_wheel_init(&s->timers, s->now);
+    memset(&s->pending_close, 0, sizeof(s->pending_close));
+    memset(&s->dirty, 0, sizeof(s->dirty));
+    memset(&s->handoffs, 0, sizeof(s->handoffs));
+    
+    if (queue_init(&s->inbox, INBOX_SIZE) < 0 || queue_init(&s->relists, INBOX_SIZE) < 0) {
+        perror("Failed to allocate shard inbox");
+        exit(EXIT_FAILURE);
+    }
+    
+    // A listen socket handed over by the previous server keeps its backlog
+    s->listen_fd = listen_fd >= 0 ? listen_fd : create_listen_socket();
+    if (s->listen_fd < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    s->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (s->wake_fd < 0) {
+        perror("Eventfd creation failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    // The io_uring backend sets up its ring on the shard's own thread
+    if (use_uring) {
+        return;
+    }
+    s->epoll_fd = epoll_create1(0);
+    if (s->epoll_fd < 0) {
+        perror("Epoll creation failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Every shard accepts local clients; only one of them is woken for each
+    int watched[4] = { s->listen_fd, s->wake_fd, s->raw_fd, s->local_fd };
+    for (int i = 0; i < 4; i++) {
+        if (watched[i] < 0) {
+            continue;
+        }
+        struct epoll_event ev;
+        ev.events = watched[i] == s->local_fd ? EPOLLIN | EPOLLET | EPOLLEXCLUSIVE : EPOLLIN | EPOLLET;
+        ev.data.u64 = (uint32_t)watched[i];
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, watched[i], &ev) < 0) {
+            perror("Epoll registration failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void initialize_pools() {
+    pool_init(&out_chunk_pool, sizeof(OutChunk), OUT_CHUNK_SLAB);
+    pool_init(&shared_chunk_pool, offsetof(OutChunk, data), OUT_CHUNK_SLAB);
+    pool_init(&broadcast_pool, sizeof(Broadcast), BROADCAST_SLAB);
+    pool_init(&big_board_pool, sizeof(BigBoard), BIG_BOARD_SLAB);
+}
+
+void* run_shard(void* arg) {
+    shard = arg;
+    if (shard->id != 0) {
+        // Shard 0 runs on the main thread, which has them already
+        metrics_register_thread();
+        initialize_pools();
+    }
+    if (use_uring) {
+        initialize_ring();
+    }
+    restore_games();
+    adopt_handover();
+    random_state = monotonic_ms() * 0x9E3779B97F4A7C15ULL + shard->id + 1;
+    struct epoll_event events[MAX_EVENTS];
+    
+    // Main server loop
+    while (1) {
+        // Sleep until the next deadline, or indefinitely if nothing is armed
+        int timeout = -1;
+        uint64_t next = timer_next_expiry(&shard->timers);
+        if (next != TIMER_NONE) {
+            uint64_t now_ms = monotonic_ms();
+            timeout = next * 1000 > now_ms ? (int)(next * 1000 - now_ms) : 0;
+        }
+        
+        uint64_t batch_start;
+        if (use_uring) {
+            // One call submits the output of the last batch and waits for
+            // the completions of this one
+            int result = uring_enter(&shard->ring, true, timeout);
+            metrics_add(METRIC_SYSCALLS, shard->ring.enters);
+            shard->ring.enters = 0;
+            batch_start = metrics_now_ns();
+            shard->now = batch_start / 1000000000ULL;
+            shard->batch_moves = 0;
+            if (result < 0 && result != -ETIME && result != -EINTR) {
+                errno = -result;
+                perror("io_uring wait error");
+            }
+            handle_completions();
+        } else {
+            // Wait for activity on any socket
+            int ready = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, timeout);
+            metrics_add(METRIC_SYSCALLS, 1);
+            batch_start = metrics_now_ns();
+            shard->now = batch_start / 1000000000ULL;
+            shard->batch_moves = 0;
+            
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue; // Interrupted by signal, continue the loop
+                }
+                perror("Epoll wait error");
+                continue;
+            }
+            
+            for (int i = 0; i < ready; i++) {
+                int fd = (int)(uint32_t)events[i].data.u64;
+                
+                if (events[i].data.u64 & EPOLL_SHM) {
+                    handle_shm_input(fd);
+                } else if (fd == shard->raw_fd) {
+                    handle_raw_packets(fd);
+                } else if (fd == shard->listen_fd || fd == shard->local_fd) {
+                    handle_new_connections(fd);
+                } else if (fd == shard->wake_fd) {
+                    handle_inbox();
+                } else {
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                        handle_client_input(fd);
+                    }
+                    if ((events[i].events & EPOLLOUT) && connections[fd].in_use &&
+                        flush_output(fd) < 0) {
+                        handle_client_disconnect(fd);
+                    }
+                }
+            }
+        }
+        
+        // Expire the games and connections whose deadline has passed
+        timer_run(&shard->timers, shard->now, handle_timer);
+        
+        // Write out everything this batch produced, one writev (or one chain
+        // of linked sends) per client. Every move of the batch was received
+        // when the wait returned.
+        flush_dirty_connections();
+        uint64_t sent = metrics_now_ns();
+        if (shard->batch_moves > 0) {
+            metrics_observe(HISTOGRAM_MOVE, sent - batch_start, shard->batch_moves);
+        }
+        flush_pending_closes();
+        flush_handoffs();
+        metrics_observe(HISTOGRAM_LOOP, metrics_now_ns() - batch_start, 1);
+        
+        // A new server is taking over: stop here, with the batch finished.
+        // Nothing may be left in flight in a ring while it is parked.
+        if (atomic_load_explicit(&upgrading, memory_order_relaxed)) {
+            if (use_uring) {
+                drain_ring();
+            }
+            park_shard();
+            if (use_uring) {
+                resume_ring();
+            }
+        }
+        
+        // Ctrl-C: see off this shard's clients and stop
+        if (atomic_load_explicit(&stopping, memory_order_relaxed) && may_stop()) {
+            stop_shard();
+            return NULL;
+        }
+    }
+}
+
+// Sets up the calling shard's io_uring and arms the requests that stay in
+// it for good: accepting on the listen socket and watching the inbox
+// eventfd and, on shard 0, the packet capture ring
+void initialize_ring() {
+    if (uring_init(&shard->ring, URING_ENTRIES) < 0 ||
+        uring_add_buffers(&shard->ring, URING_GROUP, URING_BUFFERS, URING_BUFFER_SIZE) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    shard->ring_ops = 0;
+    shard->draining = false;
+    arm_ring_listeners();
+}
+
+void arm_ring_listeners() {
+    struct io_uring_sqe* sqe = uring_sqe(&shard->ring);
+    uring_prep_accept_multishot(sqe, shard->listen_fd, SOCK_NONBLOCK, ring_data(RING_ACCEPT, shard->listen_fd));
+    shard->ring_ops++;
+    if (shard->local_fd >= 0) {
+        sqe = uring_sqe(&shard->ring);
+        uring_prep_accept_multishot(sqe, shard->local_fd, SOCK_NONBLOCK, ring_data(RING_ACCEPT, shard->local_fd));
+        shard->ring_ops++;
+    }
+    arm_poll(shard->wake_fd, RING_WAKE);
+    if (shard->raw_fd >= 0) {
+        arm_poll(shard->raw_fd, RING_RAW);
+    }
+}
+
+uint64_t ring_data(int op, int fd) {
+    return (uint64_t)op << 32 | (uint32_t)fd;
+}
+
+void arm_poll(int fd, int op) {
+    uring_prep_poll_multishot(uring_sqe(&shard->ring), fd, POLLIN, ring_data(op, fd));
+    shard->ring_ops++;
+}
+
+void arm_recv(int client_socket) {
+    uring_prep_recv_multishot(uring_sqe(&shard->ring), client_socket, URING_GROUP,
+                              ring_data(RING_RECV, client_socket));
+    connections[client_socket].receiving = true;
+    shard->ring_ops++;
+}
+
+// Handles every completion the last wait collected. A multishot request
+// that ends on its own, without being cancelled, is armed again.
+void handle_completions() {
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek(&shard->ring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int result = cqe->res;
+        uint32_t flags = cqe->flags;
+        uring_advance(&shard->ring);
+        
+        bool last = !(flags & IORING_CQE_F_MORE);
+        if (last) {
+            shard->ring_ops--;
+        }
+        int fd = (int)(uint32_t)data;
+        switch (data >> 32) {
+            case RING_ACCEPT:
+                accept_completed(fd, result, last);
+                break;
+            case RING_WAKE:
+                // The handover empties the inboxes of parked shards itself
+                if (!shard->draining) {
+                    handle_inbox();
+                    if (last) {
+                        arm_poll(fd, RING_WAKE);
+                    }
+                }
+                break;
+            case RING_RAW:
+                if (!shard->draining) {
+                    handle_raw_packets(fd);
+                    if (last) {
+                        arm_poll(fd, RING_RAW);
+                    }
+                }
+                break;
+            case RING_RECV:
+                recv_completed(fd, result, flags);
+                break;
+            case RING_SEND:
+                send_completed(fd, result);
+                break;
+        }
+    }
+}
+
+void accept_completed(int listen_fd, int result, bool last) {
+    if (result >= 0) {
+        if (trace_on(TRACE_EVENTS)) {
+            // Multishot accept leaves the address out
+            struct sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
+            memset(&client_addr, 0, sizeof(client_addr));
+            getpeername(result, (struct sockaddr *)&client_addr, &client_len);
+            metrics_add(METRIC_SYSCALLS, 1);
+            TRACE(TRACE_EVENTS, TRACE_CONNECT, -1, result, client_addr.sin_addr.s_addr,
+                  ntohs(client_addr.sin_port));
+        }
+        seat_connection(result, listen_fd == shard->local_fd);
+    } else if (result != -ECANCELED) {
+        errno = -result;
+        perror("Accept failed");
+    }
+    if (last && !shard->draining) {
+        uring_prep_accept_multishot(uring_sqe(&shard->ring), listen_fd, SOCK_NONBLOCK,
+                                    ring_data(RING_ACCEPT, listen_fd));
+        shard->ring_ops++;
+    }
+}
+
+void recv_completed(int client_socket, int result, uint32_t flags) {
+    Connection* conn = &connections[client_socket];
+    bool serving = conn->in_use && !shard->draining;
+    if (result > 0) {
+        uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+        take_input(client_socket, uring_buffer(&shard->ring, id), result);
+        uring_recycle(&shard->ring, id);
+    } else if (result != -ENOBUFS && result != -ECANCELED && serving) {
+        // Client disconnected
+        handle_client_disconnect(client_socket);
+    }
+    
+    // Running out of buffers ends the request, so does a full completion queue
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->receiving = false;
+        if (conn->in_use && !shard->draining && conn->detach == DETACH_NONE) {
+            arm_recv(client_socket);
+        }
+        ring_op_done(client_socket);
+    }
+}
+
+// The sends of a chain complete in order, each for the chunk at the head of
+// the queue. Each waits for its whole chunk, so one only comes up short on
+// an error; that fails the link and the sends after it complete with
+// -ECANCELED without having sent anything. Whatever is left goes out with
+// the next batch.
+void send_completed(int client_socket, int result) {
+    Connection* conn = &connections[client_socket];
+    conn->sends--;
+    if (!conn->send_failed) {
+        OutChunk* chunk = conn->out_head;
+        uint32_t pending = chunk->end - chunk->start;
+        chunk->sending = false;
+        if (result > 0) {
+            conn->out_bytes -= result;
+            metrics_add(METRIC_BYTES_OUT, result);
+            chunk->start += result;
+            if (chunk->start == chunk->end) {
+                conn->out_head = chunk->next;
+                if (conn->out_head == NULL) {
+                    conn->out_tail = NULL;
+                }
+                free_chunk(chunk);
+            }
+        }
+        if (result < (int)pending) {
+            conn->send_failed = true;
+            for (chunk = conn->out_head; chunk != NULL; chunk = chunk->next) {
+                chunk->sending = false;
+            }
+            if (result < 0 && result != -ECANCELED) {
+                TRACE(TRACE_EVENTS, TRACE_SEND_ERROR, conn->room, client_socket, -result, 0);
+                metrics_add(METRIC_SEND_ERRORS, 1);
+                if (conn->in_use && !shard->draining) {
+                    handle_client_disconnect(client_socket);
+                }
+            }
+        }
+    }
+    if (conn->sends == 0) {
+        conn->send_failed = false;
+        if (conn->out_head != NULL && conn->in_use) {
+            mark_dirty(client_socket);
+        }
+    }
+    ring_op_done(client_socket);
+}
+
+// Queues up to MAX_WRITE_IOVECS chunks as a chain of linked sends, which
+// the next io_uring_enter submits along with every other connection's.
+// Every send carries MSG_WAITALL: without it a send the socket buffer cuts
+// short completes as a success, the next link goes out ahead of the
+// unsent rest of its chunk and the stream is scrambled.
+void submit_output(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    int count = 0;
+    for (OutChunk* chunk = conn->out_head;
+         chunk != NULL && count < MAX_WRITE_IOVECS; chunk = chunk->next) {
+        count++;
+    }
+    
+    // A chain must reach the kernel in one piece
+    uring_reserve(&shard->ring, count);
+    OutChunk* chunk = conn->out_head;
+    for (int i = 0; i < count; i++, chunk = chunk->next) {
+        struct io_uring_sqe* sqe = uring_sqe(&shard->ring);
+        uring_prep_send(sqe, client_socket, chunk_bytes(chunk) + chunk->start,
+                        chunk->end - chunk->start, MSG_NOSIGNAL | MSG_WAITALL,
+                        ring_data(RING_SEND, client_socket));
+        if (i < count - 1) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        chunk->sending = true;
+    }
+    conn->sends += count;
+    shard->ring_ops += count;
+}
+
+// Takes a connection that no longer belongs to the shard off its ring:
+// right away if nothing is in flight, otherwise by cancelling what is and
+// finishing once the last of it completes
+void detach_connection(int client_socket, int how) {
+    Connection* conn = &connections[client_socket];
+    conn->detach = how;
+    if (conn->receiving || conn->sends > 0) {
+        uring_prep_cancel(uring_sqe(&shard->ring), client_socket, ring_data(RING_CANCEL, client_socket));
+        shard->ring_ops++;
+    } else {
+        ring_op_done(client_socket);
+    }
+}
+
+void ring_op_done(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    if (conn->detach == DETACH_NONE || conn->receiving || conn->sends > 0) {
+        return;
+    }
+    int how = conn->detach;
+    conn->detach = DETACH_NONE;
+    if (how == DETACH_CLOSE) {
+        finish_close(client_socket);
+    } else {
+        finish_handoff(client_socket);
+    }
+}
+
+// Cancels everything in the shard's ring and waits until it has all
+// completed, so that nothing touches a socket or its output while another
+// process takes them over. Input that arrives meanwhile is kept in the
+// connections' rings, which are handed over with them.
+void drain_ring() {
+    shard->draining = true;
+    uring_prep_cancel(uring_sqe(&shard->ring), -1, ring_data(RING_CANCEL, 0));
+    shard->ring_ops++;
+    while (shard->ring_ops > 0) {
+        uring_enter(&shard->ring, true, -1);
+        handle_completions();
+    }
+}
+
+// Picks up where drain_ring left off after a handover that did not go
+// through. Connections in an inbox are armed as the inbox is read.
+void resume_ring() {
+    shard->draining = false;
+    arm_ring_listeners();
+    FdList served;
+    memset(&served, 0, sizeof(served));
+    for (int room_id = shard->first_room; room_id < shard->first_room + shard->room_count; room_id++) {
+        for (int i = 0; rooms[room_id].in_use && i < MAX_CLIENTS; i++) {
+            int fd = rooms[room_id].client_sockets[i];
+            if (fd >= 0) {
+                fd_list_push(&served, fd);
+            }
+        }
+        FdList* spectators = &audiences[room_id].spectators;
+        for (int i = 0; i < spectators->count; i++) {
+            fd_list_push(&served, spectators->fds[i]);
+        }
+    }
+    
+    // Commands that came in while the shard was parked are handled last,
+    // as they may move connections between rooms
+    for (int i = 0; i < served.count; i++) {
+        if (connections[served.fds[i]].in_use) {
+            arm_recv(served.fds[i]);
+        }
+    }
+    for (int i = 0; i < served.count; i++) {
+        process_input_lines(served.fds[i]);
+        process_input_frames(served.fds[i]);
+    }
+    free(served.fds);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void raise_fd_limit() {
+    // Every player needs a descriptor, so allow as many as the hard limit permits
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+            perror("Failed to raise file descriptor limit");
+        }
+    }
+}
+
+void initialize_game(Room* room) {
+    // Initialize the board
+    Board* board = room_board(room);
+    board->marks[0] = 0;
+    board->marks[1] = 0;
+    board->current_player = 0;  // X goes first
+    if (room->big != NULL) {
+        clear_big_board(room->big);
+    }
+    render_board(room);
+    room->state_seq++;
+    arm_room_timer(room);
+}
+
+int allocate_room() {
+    if (shard->free_room_count == 0) {
+        return -1;
+    }
+    
+    int room_id = shard->free_rooms[--shard->free_room_count];
+    Room* room = &rooms[room_id];
+    initialize_game(room);
+    room->in_use = true;
+    room->game_active = false;
+    room->connected_clients = 0;
+    room->waiting = false;
+    room->bot_level = BOT_NONE;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        room->client_sockets[i] = -1;
+        room->tokens[i] = 0;
+    }
+    shard->active_rooms++;
+    metrics_add(METRIC_ROOMS_ACTIVE, 1);
+    return room_id;
+}
+
+void release_room(int room_id) {
+    Room* room = &rooms[room_id];
+    if (room->waiting) {
+        remove_waiting_room(room_id);
+    }
+    timer_cancel(&shard->timers, &room_deadlines(room)->game);
+    timer_cancel(&shard->timers, &room_deadlines(room)->grace);
+    if (room->big != NULL) {
+        give_back_pooled(&big_board_pool, room->big, METRIC_BIG_BOARDS);
+        room->big = NULL;
+    }
+    
+    // Nothing is left to watch
+    FdList* spectators = &audiences[room_id].spectators;
+    while (spectators->count > 0) {
+        int client_socket = spectators->fds[spectators->count - 1];
+        send_event(client_socket, EVENT_WATCH_ENDED, 0, "The game you were watching is over.\n");
+        close_connection(client_socket);
+        remove_spectator(client_socket);
+    }
+    room->in_use = false;
+    room->game_active = false;
+    room->connected_clients = 0;
+    shard->free_rooms[shard->free_room_count++] = room_id;
+    shard->active_rooms--;
+    metrics_add(METRIC_ROOMS_ACTIVE, -1);
+}
+
+void push_waiting_room(int room_id) {
+    // Anyone looking for an opponent on any shard can take the room from now
+    // on. Should its bucket be full, the player waits without being found.
+    Room* room = &rooms[room_id];
+    room->waiting = true;
+    match_list(&matchmaker, match_tickets, room_id, room_variant(room));
+}
+
+void remove_waiting_room(int room_id) {
+    // If someone has just taken the room, the player they pass on finds it
+    // no longer waiting and is seated elsewhere
+    rooms[room_id].waiting = false;
+    match_withdraw(match_tickets, room_id);
+}
+
+// Has the shard that owns a waiting room list it again, after matchmaking
+// had to take it off its full queue. Should the shard's relist queue be
+// full as well, the player waits without being found, as when listing
+// fails in the first place.
+void relist_room(int room_id) {
+    Shard* owner = room_shard(room_id);
+    if (owner == shard) {
+        if (rooms[room_id].in_use && rooms[room_id].waiting) {
+            push_waiting_room(room_id);
+        }
+    } else if (queue_push(&owner->relists, (uint64_t)room_id)) {
+        eventfd_write(owner->wake_fd, 1);
+        metrics_add(METRIC_SYSCALLS, 1);
+    }
+}
+
+void handle_raw_packets(int server_fd) {
+    (void)server_fd;
+    // Read every block the kernel has filled; the filter already dropped
+    // everything that is not a TCP segment for our port
+    capture_drain(log_raw_packet);
+}
+
+void log_raw_packet(const unsigned char* packet, uint32_t length) {
+    struct iphdr* ip_header = (struct iphdr*)packet;
+    int ip_header_length = ip_header->ihl * 4;
+    if (length < (uint32_t)ip_header_length + sizeof(struct tcphdr)) {
+        return;
+    }
+    
+    // Get the TCP header
+    struct tcphdr* tcp_header = (struct tcphdr*)(packet + ip_header_length);
+    
+    // Only the headers are captured, so size the payload from the IP total length
+    int tcp_header_length = tcp_header->doff * 4;
+    int payload_length = ntohs(ip_header->tot_len) - ip_header_length - tcp_header_length;
+    
+    if (payload_length > 0) {
+        TRACE(TRACE_MESSAGES, TRACE_RAW_PACKET, -1, -1, ip_header->saddr,
+              ntohs(tcp_header->source));
+    }
+}
+
+void handle_new_connections(int listen_fd) {
+    // Accept until the backlog is empty since epoll only reports the edge
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        memset(&client_addr, 0, sizeof(client_addr));  // A local client has no address to trace
+        int new_socket = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_len,
+                                 SOCK_NONBLOCK);
+        metrics_add(METRIC_SYSCALLS, 1);
+        
+        if (new_socket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed");
+            }
+            return;
+        }
+        
+        TRACE(TRACE_EVENTS, TRACE_CONNECT, -1, new_socket, client_addr.sin_addr.s_addr,
+              ntohs(client_addr.sin_port));
+        seat_connection(new_socket, listen_fd == shard->local_fd);
+    }
+}
+
+void handle_inbox() {
+    // Clear the wakeup counter before draining so that no handoff is missed
+    eventfd_t count;
+    eventfd_read(shard->wake_fd, &count);
+    metrics_add(METRIC_SYSCALLS, 1);
+    
+    uint64_t value;
+    while (queue_pop(&shard->inbox, &value)) {
+        if (value & INBOX_RESUME) {
+            resume_connection((int)(uint32_t)value);
+        } else if (value & INBOX_SPECTATE) {
+            spectator_connection((int)(uint32_t)value);
+        } else {
+            match_connection((int)(uint32_t)value);
+        }
+    }
+    while (queue_pop(&shard->relists, &value)) {
+        Room* room = &rooms[value];
+        if (room->in_use && room->waiting) {
+            push_waiting_room((int)value);
+        }
+    }
+}
+
+void seat_connection(int new_socket, bool local) {
+    if (new_socket >= MAX_FDS) {
+        char* message = "Server is full. Try again later.\n";
+        send(new_socket, message, strlen(message), 0);
+        close(new_socket);
+        return;
+    }
+    prepare_connection(new_socket, local);
+    place_connection(new_socket);
+}
+
+void prepare_connection(int new_socket, bool local) {
+    // Output is already coalesced into one writev per batch, so Nagle's
+    // algorithm would only hold replies back until the peer's delayed ACK
+    if (!local) {
+        int nodelay = 1;
+        setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        metrics_add(METRIC_SYSCALLS, 1);
+    }
+    
+    Connection* conn = &connections[new_socket];
+    conn->local = local;
+    conn->shm = NULL;
+    conn->recv_head = 0;
+    conn->recv_scan = 0;
+    conn->recv_tail = 0;
+    conn->recv_discard = false;
+    conn->binary = false;
+    conn->deltas = false;
+    conn->out_head = NULL;
+    conn->out_tail = NULL;
+    conn->out_bytes = 0;
+    conn->out_dirty = false;
+    conn->out_overflow = false;
+    conn->spectating = false;
+    metrics_add(METRIC_CONNECTIONS, 1);
+}
+
+// Seats a connection that no shard watches yet opposite the player who has
+// waited longest for a classic game, or in a room of its own to wait in.
+// Returns false if it went to another shard, which may already be serving it.
+bool place_connection(int client_socket) {
+    int room_id = take_opponent(client_socket, CLASSIC_VARIANT);
+    if (room_id >= 0 && room_shard(room_id) != shard) {
+        Shard* target = room_shard(room_id);
+        if (queue_push(&target->inbox, (uint64_t)client_socket | INBOX_MATCH)) {
+            eventfd_write(target->wake_fd, 1);
+            metrics_add(METRIC_SYSCALLS, 1);
+            return false;
+        }
+        if (!match_return(&matchmaker, match_tickets, room_id, CLASSIC_VARIANT,
+                          connections[client_socket].match_ticket)) {
+            relist_room(room_id);
+        }
+        room_id = -1;
+    }
+    
+    if (watch_connection(client_socket) < 0) {
+        discard_connection(client_socket);
+        if (room_id >= 0) {
+            push_waiting_room(room_id);
+        }
+        return true;
+    }
+    if (room_id >= 0) {
+        join_opponent(client_socket);
+    } else {
+        open_room(client_socket);
+    }
+    return true;
+}
+
+// Takes in a connection another shard paired with a player waiting here
+void match_connection(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    Room* room = &rooms[conn->match_room];
+    
+    // The room is still held for the connection unless its player has
+    // stopped waiting, or the room has been listed and taken again since
+    bool held = room->in_use && room->waiting && room->connected_clients == 1 &&
+                atomic_load_explicit(&match_tickets[conn->match_room], memory_order_acquire) ==
+                conn->match_ticket;
+    if (!held) {
+        if (!place_connection(client_socket)) {
+            return;
+        }
+    } else if (watch_connection(client_socket) < 0) {
+        discard_connection(client_socket);
+        push_waiting_room(conn->match_room);
+        return;
+    } else {
+        join_opponent(client_socket);
+    }
+    
+    // A player switching boards may have sent more commands already
+    process_input_lines(client_socket);
+    process_input_frames(client_socket);
+}
+
+// Takes the player who has waited longest for the variant off the
+// matchmaking queue. Returns their room, held for client_socket, or -1.
+int take_opponent(int client_socket, uint16_t variant) {
+    Connection* conn = &connections[client_socket];
+    uint16_t unlisted[MATCH_SCAN];
+    int unlisted_count;
+    int room_id = match_take(&matchmaker, match_tickets, variant, &conn->match_ticket,
+                             unlisted, &unlisted_count);
+    for (int i = 0; i < unlisted_count; i++) {
+        relist_room(unlisted[i]);
+    }
+    if (room_id >= 0) {
+        conn->match_room = room_id;
+        conn->match_variant = variant;
+        conn->match_ns = metrics_now_ns();
+    }
+    return room_id;
+}
+
+// Seats a connection this shard watches in the room held for it
+void join_opponent(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    rooms[conn->match_room].waiting = false;
+    metrics_observe(HISTOGRAM_MATCH, metrics_now_ns() - conn->match_ns, 1);
+    enter_room(client_socket, conn->match_room);
+}
+
+// Seats a connection this shard watches opposite a waiting player, wherever
+// they are, or in a room of its own
+void find_opponent(int client_socket) {
+    int room_id = take_opponent(client_socket, CLASSIC_VARIANT);
+    if (room_id < 0) {
+        open_room(client_socket);
+    } else if (room_shard(room_id) == shard) {
+        join_opponent(client_socket);
+    } else {
+        pass_on(client_socket, INBOX_MATCH);
+    }
+}
+
+void open_room(int client_socket) {
+    int room_id = allocate_room();
+    if (room_id < 0) {
+        send_to_client(client_socket, "Server is full. Try again later.\n");
+        close_connection(client_socket);
+        return;
+    }
+    enter_room(client_socket, room_id);
+}
+
+uint16_t room_variant(Room* room) {
+    if (room->big == NULL) {
+        return CLASSIC_VARIANT;
+    }
+    return (uint16_t)(room->big->rows << 10 | room->big->cols << 5 | room->big->k);
+}
+
+Shard* room_shard(int room_id) {
+    return &shards[room_id / (MAX_ROOMS / shard_count)];
+}
+
+// Stops serving a connection here and passes it to the shard it is headed
+// for once this batch has flushed its output
+void pass_on(int client_socket, uint64_t kind) {
+    Connection* conn = &connections[client_socket];
+    conn->in_use = false;
+    conn->handoff = kind;
+    timer_cancel(&shard->timers, &conn->idle_timer);
+    if (!use_uring) {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, client_socket, NULL);
+        metrics_add(METRIC_SYSCALLS, 1);
+        if (conn->shm != NULL) {
+            epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, conn->shm_wake_fd, NULL);
+            metrics_add(METRIC_SYSCALLS, 1);
+        }
+    }
+    metrics_add(METRIC_CONNECTIONS_OPEN, -1);
+    if (!fd_list_push(&shard->handoffs, client_socket)) {
+        if (kind == INBOX_MATCH) {
+            if (!match_return(&matchmaker, match_tickets, conn->match_room, conn->match_variant,
+                              conn->match_ticket)) {
+                relist_room(conn->match_room);
+            }
+        }
+        if (use_uring) {
+            detach_connection(client_socket, DETACH_CLOSE);
+        } else {
+            discard_connection(client_socket);
+        }
+    }
+}
+
+int watch_connection(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    if (use_uring) {
+        // A shard winding its ring down arms the connection if it resumes
+        if (!shard->draining) {
+            arm_recv(client_socket);
+        }
+    } else {
+        struct epoll_event ev;
+        // With edge triggering EPOLLOUT only fires when a full socket drains,
+        // so it can stay registered for the life of the connection
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = (uint32_t)client_socket;
+        metrics_add(METRIC_SYSCALLS, 1);
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("Epoll registration failed");
+            return -1;
+        }
+        
+        // A shared-memory client may have written while passed between
+        // shards, so its ring is looked at once it is watched
+        if (conn->shm != NULL) {
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.u64 = EPOLL_SHM | (uint32_t)client_socket;
+            metrics_add(METRIC_SYSCALLS, 2);
+            if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, conn->shm_wake_fd, &ev) < 0) {
+                perror("Epoll registration failed");
+                epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, client_socket, NULL);
+                return -1;
+            }
+            eventfd_write(conn->shm_wake_fd, 1);
+        }
+    }
+    
+    conn->in_use = true;
+    timer_init(&conn->idle_timer, TIMER_IDLE, client_socket);
+    timer_arm(&shard->timers, &conn->idle_timer, shard->now + IDLE_TIMEOUT_SECONDS);
+    metrics_add(METRIC_CONNECTIONS_OPEN, 1);
+    return 0;
+}
+
+void enter_room(int client_socket, int room_id) {
+    // Add new client to the first free seat, so a player waiting alone is X
+    Room* room = &rooms[room_id];
+    int seat = 0;
+    while (room->client_sockets[seat] >= 0) {
+        seat++;
+    }
+    room->client_sockets[seat] = client_socket;
+    room->tokens[seat] = new_token(room_id);
+    room->connected_clients++;
+    
+    Connection* conn = &connections[client_socket];
+    conn->room = room_id;
+    conn->seat = seat;
+    TRACE(TRACE_EVENTS, TRACE_SEATED, room_id, client_socket, seat, 0);
+    
+    // Send welcome message, with the token that gets the player back in
+    char welcome_msg[BUFFER_SIZE];
+    sprintf(welcome_msg, "Welcome! You are Player %d (%c)\nYour resume token is %016llx\n",
+            seat + 1, (seat == 0) ? 'X' : 'O', (unsigned long long)room->tokens[seat]);
+    send_to_client(client_socket, welcome_msg);
+    
+    // If game is ready to start
+    if (room->connected_clients == MAX_CLIENTS && !room->game_active) {
+        room->game_active = true;
+        arm_room_timer(room);
+        record_game_start(room);
+        broadcast_event(room, EVENT_STARTED, "Game is starting!\n");
+        if (room->big != NULL) {
+            char size_msg[BUFFER_SIZE];
+            sprintf(size_msg, "Playing on a %dx%d board, %d in a row wins.\n",
+                    room->big->rows, room->big->cols, room->big->k);
+            broadcast_event(room, EVENT_NONE, size_msg);
+        }
+        send_game_state(room);
+    } else if (room->connected_clients < MAX_CLIENTS) {
+        send_event(client_socket, EVENT_WAITING, 0, "Waiting for another player to join...\n");
+        push_waiting_room(room_id);
+    }
+}
+
+void leave_room(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    Room* room = &rooms[conn->room];
+    room->client_sockets[conn->seat] = -1;
+    room->tokens[conn->seat] = 0;
+    room->connected_clients--;
+    abandon_game(conn->room, "A player has disconnected.\n");
+}
+
+void hold_seat(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    int room_id = conn->room;
+    Room* room = &rooms[room_id];
+    if (!room->game_active || grace_seconds == 0) {
+        leave_room(client_socket);
+        return;
+    }
+    
+    // The token stays, so the player can take the seat back from a new connection
+    room->client_sockets[conn->seat] = -1;
+    room->connected_clients--;
+    metrics_add(METRIC_SEATS_HELD, 1);
+    TRACE(TRACE_EVENTS, TRACE_HOLD, room_id, client_socket, conn->seat, grace_seconds);
+    
+    // If both players drop, the first one's deadline stands for both
+    if (room_deadlines(room)->grace.slot < 0) {
+        timer_arm(&shard->timers, &room_deadlines(room)->grace, shard->now + grace_seconds);
+    }
+    char message[BUFFER_SIZE];
+    sprintf(message, "Player %d lost their connection. Their seat is held for %d seconds.\n",
+            conn->seat + 1, grace_seconds);
+    broadcast_event(room, EVENT_OPPONENT_AWAY, message);
+}
+
+// Ends the room's game once a seat has been given up, along with any seat
+// still held for a player who dropped. The room is freed if nobody is left,
+// otherwise it goes back in the queue with the player who stayed as X.
+void abandon_game(int room_id, char* message) {
+    Room* room = &rooms[room_id];
+    bool abandoned = room->game_active;
+    int ply = moves_made(room);
+    
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (room->client_sockets[i] < 0) {
+            room->tokens[i] = 0;
+        }
+    }
+    timer_cancel(&shard->timers, &room_deadlines(room)->grace);
+    
+    if (room->connected_clients == 0) {
+        release_room(room_id);
+    } else {
+        // Notify remaining clients
+        broadcast_event(room, EVENT_OPPONENT_LEFT, message);
+        
+        if (room->game_active) {
+            room->game_active = false;
+            timer_cancel(&shard->timers, &room_deadlines(room)->game);
+            if (room->client_sockets[0] < 0) {
+                room->client_sockets[0] = room->client_sockets[1];
+                room->tokens[0] = room->tokens[1];
+                room->client_sockets[1] = -1;
+                room->tokens[1] = 0;
+                connections[room->client_sockets[0]].seat = 0;
+            }
+            initialize_game(room);
+            broadcast_event(room, EVENT_WAITING, "Waiting for another player to join...\n");
+            push_waiting_room(room_id);
+        }
+    }
+    
+    // Logged once the room has moved on, so that a snapshot can never hold
+    // a game that the journal before it has already ended
+    if (abandoned) {
+        metrics_add(METRIC_GAMES_ABANDONED, 1);
+        record_game_event(room, JOURNAL_ABANDON, ply, ABANDON_DISCONNECT);
+    }
+}
+
+bool has_held_seat(Room* room) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (room->client_sockets[i] < 0 && room->tokens[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void resume_game(int client_socket, uint64_t token) {
+    Connection* conn = &connections[client_socket];
+    int per_shard = MAX_ROOMS / shard_count;
+    uint32_t room_id = (uint32_t)token;
+    if (room_id >= (uint32_t)(per_shard * shard_count) || room_id == (uint32_t)conn->room) {
+        send_event(client_socket, EVENT_RESUME_FAILED, 0, "No game to resume for that token.\n");
+        return;
+    }
+    
+    // The seat handed out on connecting makes way for the one being resumed
+    leave_room(client_socket);
+    conn->resume_token = token;
+    Shard* owner = &shards[room_id / per_shard];
+    if (owner == shard) {
+        claim_seat(client_socket);
+        return;
+    }
+    
+    // Another shard runs that game
+    pass_on(client_socket, INBOX_RESUME);
+}
+
+void resume_connection(int client_socket) {
+    if (watch_connection(client_socket) < 0) {
+        discard_connection(client_socket);
+        return;
+    }
+    claim_seat(client_socket);
+    
+    // Commands sent right behind the resume are still in the input ring
+    process_input_lines(client_socket);
+    process_input_frames(client_socket);
+}
+
+void claim_seat(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    uint64_t token = conn->resume_token;
+    int room_id = (int)(uint32_t)token;
+    Room* room = &rooms[room_id];
+    
+    int seat = -1;
+    for (int i = 0; i < MAX_CLIENTS && room->in_use && room->game_active; i++) {
+        if (room->client_sockets[i] < 0 && room->tokens[i] == token) {
+            seat = i;
+        }
+    }
+    
+    // The game is over or the seat is taken: start afresh
+    if (seat < 0) {
+        send_event(client_socket, EVENT_RESUME_FAILED, 0, "No game to resume for that token.\n");
+        find_opponent(client_socket);
+        return;
+    }
+    
+    room->client_sockets[seat] = client_socket;
+    room->connected_clients++;
+    conn->room = room_id;
+    conn->seat = seat;
+    TRACE(TRACE_EVENTS, TRACE_RESUME, room_id, client_socket, seat, 0);
+    metrics_add(METRIC_RESUMES, 1);
+    arm_room_timer(room);
+    if (!has_held_seat(room)) {
+        timer_cancel(&shard->timers, &room_deadlines(room)->grace);
+    }
+    
+    // The seat and the board come back in one frame, or one message
+    if (conn->binary) {
+        ServerFrame resumed;
+        fill_state_frame(room, RESULT_NONE, &resumed);
+        resumed.type = FRAME_RESUMED;
+        resumed.code |= seat == 1 ? RESUMED_SEAT_O : 0;
+        if (room->big != NULL) {
+            resumed.code |= RESUMED_BIG_BOARD;
+            resumed.a = 0;
+            resumed.b = 0;
+        }
+        send_frame(client_socket, &resumed);
+        if (room->big != NULL) {
+            send_board_frames(client_socket, room);
+        }
+    } else {
+        char text[BOARD_TEXT_SIZE];
+        int length = sprintf(text, "Resumed your game as Player %d (%c).\n",
+                             seat + 1, seat == 0 ? 'X' : 'O');
+        if (conn->deltas) {
+            format_state_line(room, text + length);
+        } else {
+            format_game_state(room, text + length);
+        }
+        send_to_client(client_socket, text);
+    }
+    
+    char message[BUFFER_SIZE];
+    sprintf(message, "Player %d is back.\n", seat + 1);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i != seat && room->client_sockets[i] >= 0) {
+            send_event(room->client_sockets[i], EVENT_NONE, 0, message);
+        }
+    }
+    
+    // The game may have been saved with the bot about to move
+    play_bot_move(room);
+}
+
+// Makes a player who is waiting for an opponent, or a spectator, watch
+// another room
+void spectate_room(int client_socket, uint32_t room_id) {
+    Connection* conn = &connections[client_socket];
+    int per_shard = MAX_ROOMS / shard_count;
+    if (room_id >= (uint32_t)(per_shard * shard_count) ||
+        (!conn->spectating && room_id == (uint32_t)conn->room)) {
+        send_event(client_socket, EVENT_WATCH_FAILED, 0, "No game to watch in that room.\n");
+        return;
+    }
+    if (!conn->spectating && rooms[conn->room].game_active) {
+        send_event(client_socket, EVENT_WATCH_FAILED, 0,
+                   "You can only watch while waiting for an opponent.\n");
+        return;
+    }
+    
+    // Only this shard may look at its own rooms; another shard checks on arrival
+    bool local = room_shard(room_id) == shard;
+    if (local && !rooms[room_id].in_use) {
+        send_event(client_socket, EVENT_WATCH_FAILED, 0, "No game to watch in that room.\n");
+        return;
+    }
+    if (conn->spectating) {
+        remove_spectator(client_socket);
+    } else {
+        leave_room(client_socket);
+    }
+    conn->room = room_id;
+    if (local) {
+        add_spectator(client_socket);
+    } else {
+        pass_on(client_socket, INBOX_SPECTATE);
+    }
+}
+
+// Takes in a connection another shard passed on to watch a room here
+void spectator_connection(int client_socket) {
+    if (watch_connection(client_socket) < 0) {
+        discard_connection(client_socket);
+        return;
+    }
+    add_spectator(client_socket);
+    process_input_lines(client_socket);
+    process_input_frames(client_socket);
+}
+
+void remove_spectator(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    FdList* spectators = &audiences[conn->room].spectators;
+    int last = spectators->fds[--spectators->count];
+    spectators->fds[conn->spectator_index] = last;
+    connections[last].spectator_index = conn->spectator_index;
+    conn->spectating = false;
+    metrics_add(METRIC_SPECTATORS, -1);
+}
+
+// Adds a connection to the audience of conn->room and sends it the current
+// state. If the room has closed since, the connection goes back to looking
+// for an opponent.
+void add_spectator(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    Room* room = &rooms[conn->room];
+    FdList* spectators = &audiences[conn->room].spectators;
+    conn->spectating = false;
+    if (!room->in_use || !fd_list_push(spectators, client_socket)) {
+        send_event(client_socket, EVENT_WATCH_FAILED, 0, "No game to watch in that room.\n");
+        find_opponent(client_socket);
+        return;
+    }
+    conn->spectating = true;
+    conn->seat = -1;
+    conn->spectator_index = spectators->count - 1;
+    
+    // Watching is not idling; the room's players keep it open or close it
+    timer_cancel(&shard->timers, &conn->idle_timer);
+    metrics_add(METRIC_SPECTATORS, 1);
+    TRACE(TRACE_EVENTS, TRACE_SPECTATE, conn->room, client_socket, 0, 0);
+    
+    if (conn->binary) {
+        ServerFrame watching = { FRAME_EVENT, EVENT_WATCHING, 0, (uint16_t)(conn->room >> 16),
+                                 (uint16_t)conn->room };
+        send_frame(client_socket, &watching);
+    } else {
+        char message[BUFFER_SIZE];
+        sprintf(message, "Watching room %d. Send 'watch <room>' to watch another, 'quit' to leave.\n",
+                conn->room);
+        send_to_client(client_socket, message);
+    }
+    if (!room->game_active) {
+        send_event(client_socket, EVENT_WAITING, 0, "Waiting for the game to start...\n");
+    } else if (conn->binary && room->big != NULL) {
+        send_board_frames(client_socket, room);
+    } else if (conn->binary) {
+        ServerFrame state;
+        fill_state_frame(room, RESULT_NONE, &state);
+        send_frame(client_socket, &state);
+    } else {
+        resync(client_socket);
+    }
+}
+
+void flush_handoffs() {
+    for (int i = 0; i < shard->handoffs.count; i++) {
+        if (use_uring) {
+            detach_connection(shard->handoffs.fds[i], DETACH_HANDOFF);
+        } else {
+            finish_handoff(shard->handoffs.fds[i]);
+        }
+    }
+    shard->handoffs.count = 0;
+}
+
+void finish_handoff(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    
+    // Output queued here goes first; anything the socket did not take
+    // moves along with the rest of the connection
+    flush_output(client_socket);
+    bool matched = conn->handoff == INBOX_MATCH;
+    int room_id = matched ? conn->match_room
+                : conn->handoff == INBOX_SPECTATE ? conn->room : (int)(uint32_t)conn->resume_token;
+    Shard* target = room_shard(room_id);
+    if (queue_push(&target->inbox, (uint64_t)client_socket | conn->handoff)) {
+        eventfd_write(target->wake_fd, 1);
+        metrics_add(METRIC_SYSCALLS, 1);
+    } else {
+        if (matched) {
+            if (!match_return(&matchmaker, match_tickets, conn->match_room, conn->match_variant,
+                              conn->match_ticket)) {
+                relist_room(conn->match_room);
+            }
+        }
+        char* message = "Server is busy. Try again later.\n";
+        send(client_socket, message, strlen(message), MSG_NOSIGNAL);
+        discard_connection(client_socket);
+    }
+}
+
+uint64_t new_token(int room_id) {
+    // The low half says which room to look in, the random high half proves
+    // the seat is yours
+    uint32_t secret;
+    if (getrandom(&secret, sizeof(secret), 0) != sizeof(secret)) {
+        secret = random_below(UINT32_MAX);
+    }
+    if (secret == 0) {
+        secret = 1;
+    }
+    return (uint64_t)secret << 32 | (uint32_t)room_id;
+}
+
+void handle_client_input(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    
+    // Read until the socket is drained since epoll only reports the edge
+    while (conn->in_use) {
+        uint32_t used = conn->recv_tail - conn->recv_head;
+        if (used == RECV_BUFFER_SIZE) {
+            discard_overlong_line(client_socket);
+            used = 0;
+        }
+        
+        // Read straight into the free part of the ring, which may wrap around
+        uint32_t tail = conn->recv_tail & (RECV_BUFFER_SIZE - 1);
+        uint32_t free_space = RECV_BUFFER_SIZE - used;
+        uint32_t first = RECV_BUFFER_SIZE - tail;
+        struct iovec iov[2];
+        int iov_count = 1;
+        iov[0].iov_base = conn->recv_buffer + tail;
+        iov[0].iov_len = first < free_space ? first : free_space;
+        if (first < free_space) {
+            iov[1].iov_base = conn->recv_buffer;
+            iov[1].iov_len = free_space - first;
+            iov_count = 2;
+        }
+        
+        ssize_t valread = readv(client_socket, iov, iov_count);
+        metrics_add(METRIC_SYSCALLS, 1);
+        
+        if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (valread < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        if (valread <= 0) {
+            // Client disconnected
+            handle_client_disconnect(client_socket);
+            return;
+        }
+        
+        conn->recv_tail += valread;
+        metrics_add(METRIC_BYTES_IN, valread);
+        if (!conn->spectating) {
+            timer_arm(&shard->timers, &conn->idle_timer, shard->now + IDLE_TIMEOUT_SECONDS);
+        }
+        process_input_lines(client_socket);
+        process_input_frames(client_socket);
+    }
+}
+
+// Copies what the io_uring backend or a shared-memory ring received into the
+// connection's input ring, handling every complete command as it goes. Input for a connection
+// the shard no longer serves, or while it drains, is only kept; what does
+// not fit then is lost.
+void take_input(int client_socket, const char* data, uint32_t length) {
+    Connection* conn = &connections[client_socket];
+    metrics_add(METRIC_BYTES_IN, length);
+    if (conn->in_use && !conn->spectating) {
+        timer_arm(&shard->timers, &conn->idle_timer, shard->now + IDLE_TIMEOUT_SECONDS);
+    }
+    while (length > 0) {
+        bool serving = conn->in_use && !shard->draining;
+        uint32_t used = conn->recv_tail - conn->recv_head;
+        if (used == RECV_BUFFER_SIZE) {
+            if (!serving) {
+                return;
+            }
+            discard_overlong_line(client_socket);
+            used = 0;
+        }
+        
+        uint32_t tail = conn->recv_tail & (RECV_BUFFER_SIZE - 1);
+        uint32_t part = RECV_BUFFER_SIZE - used;
+        if (part > RECV_BUFFER_SIZE - tail) {
+            part = RECV_BUFFER_SIZE - tail;
+        }
+        if (part > length) {
+            part = length;
+        }
+        memcpy(conn->recv_buffer + tail, data, part);
+        conn->recv_tail += part;
+        data += part;
+        length -= part;
+        if (serving) {
+            process_input_lines(client_socket);
+            process_input_frames(client_socket);
+        }
+    }
+}
+
+// The ring is full without a newline, so the line can never complete.
+// Drop it, along with whatever else arrives before its newline.
+void discard_overlong_line(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    if (!conn->recv_discard) {
+        send_to_client(client_socket, "Command too long.\n");
+        conn->recv_discard = true;
+    }
+    conn->recv_head = conn->recv_tail;
+    conn->recv_scan = conn->recv_tail;
+}
+
+void process_input_lines(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    
+    // Hand every complete line to the command handler; a trailing partial
+    // line stays in the ring until the rest of it arrives
+    while (conn->in_use && !conn->binary && conn->recv_scan != conn->recv_tail) {
+        uint32_t scan = conn->recv_scan & (RECV_BUFFER_SIZE - 1);
+        uint32_t pending = conn->recv_tail - conn->recv_scan;
+        uint32_t contiguous = RECV_BUFFER_SIZE - scan;
+        if (contiguous > pending) {
+            contiguous = pending;
+        }
+        
+        char* newline = memchr(conn->recv_buffer + scan, '\n', contiguous);
+        if (newline == NULL) {
+            conn->recv_scan += contiguous;
+            continue;
+        }
+        
+        uint32_t end = conn->recv_scan + (uint32_t)(newline - (conn->recv_buffer + scan));
+        uint32_t start = conn->recv_head;
+        conn->recv_head = end + 1;
+        conn->recv_scan = end + 1;
+        if (conn->recv_discard) {
+            conn->recv_discard = false;
+            continue;
+        }
+        dispatch_line(client_socket, start, end);
+    }
+}
+
+void dispatch_line(int client_socket, uint32_t start, uint32_t end) {
+    Connection* conn = &connections[client_socket];
+    uint32_t first = start & (RECV_BUFFER_SIZE - 1);
+    uint32_t last = end & (RECV_BUFFER_SIZE - 1);
+    char* line;
+    char wrapped[RECV_BUFFER_SIZE];
+    
+    if (first <= last) {
+        // The usual case: parse the line in place, terminating it over the newline
+        line = conn->recv_buffer + first;
+        conn->recv_buffer[last] = '\0';
+    } else {
+        // Only a line that wraps around the end of the ring is copied
+        uint32_t head_part = RECV_BUFFER_SIZE - first;
+        memcpy(wrapped, conn->recv_buffer + first, head_part);
+        memcpy(wrapped + head_part, conn->recv_buffer, last);
+        wrapped[head_part + last] = '\0';
+        line = wrapped;
+    }
+    
+    // Accept CRLF line endings from telnet-style clients
+    size_t length = end - start;
+    if (length > 0 && line[length - 1] == '\r') {
+        line[length - 1] = '\0';
+    }
+    
+    handle_client_message(client_socket, line);
+}
+
+void process_input_frames(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    
+    // Decode every complete fixed-size frame; a partial one waits for more data
+    while (conn->in_use && conn->binary &&
+           conn->recv_tail - conn->recv_head >= CLIENT_FRAME_SIZE) {
+        uint32_t first = conn->recv_head & (RECV_BUFFER_SIZE - 1);
+        unsigned char wrapped[CLIENT_FRAME_SIZE];
+        unsigned char* bytes = (unsigned char*)conn->recv_buffer + first;
+        
+        if (first + CLIENT_FRAME_SIZE > RECV_BUFFER_SIZE) {
+            uint32_t head_part = RECV_BUFFER_SIZE - first;
+            memcpy(wrapped, conn->recv_buffer + first, head_part);
+            memcpy(wrapped + head_part, conn->recv_buffer, CLIENT_FRAME_SIZE - head_part);
+            bytes = wrapped;
+        }
+        
+        ClientFrame frame;
+        decode_client_frame(bytes, &frame);
+        conn->recv_head += CLIENT_FRAME_SIZE;
+        conn->recv_scan = conn->recv_head;
+        handle_client_frame(client_socket, &frame);
+    }
+}
+
+void handle_client_message(int client_socket, char* message) {
+    // Find which room and seat this player occupies
+    if (client_socket < 0 || client_socket >= MAX_FDS || !connections[client_socket].in_use) {
+        printf("Error: Client not found\n");
+        return;
+    }
+    
+    Connection* conn = &connections[client_socket];
+    size_t length = strlen(message);
+    TRACE(TRACE_MESSAGES, TRACE_MESSAGE, conn->room, client_socket,
+          (uint32_t)length, trace_text(message, length));
+    
+    // A spectator has no seat to play from, and does not keep the game alive
+    int row, col, k;
+    unsigned int watched;
+    unsigned long long token;
+    if (conn->spectating) {
+        if (sscanf(message, "watch %u", &watched) != 1 && strncmp(message, "quit", 4) != 0 &&
+            strcmp(message, "binary") != 0 && strncmp(message, "help", 4) != 0 &&
+            strncmp(message, "delta", 5) != 0 && strcmp(message, "resync") != 0 &&
+            strcmp(message, "shm") != 0) {
+            send_to_client(client_socket, "You are watching. Use 'watch <room>' or 'quit'.\n");
+            return;
+        }
+    } else {
+        arm_room_timer(&rooms[conn->room]);
+    }
+    
+    // Parse the message: expect format "move row col" (e.g., "move 0 1")
+    if (sscanf(message, "move %d %d", &row, &col) == 2) {
+        play_move(client_socket, row, col, 0);
+    } else if (strncmp(message, "quit", 4) == 0) {
+        quit_game(client_socket);
+    } else if (strcmp(message, "binary") == 0) {
+        switch_to_binary(client_socket);
+    } else if (strcmp(message, "delta") == 0 || strcmp(message, "delta on") == 0) {
+        set_deltas(client_socket, true);
+    } else if (strcmp(message, "delta off") == 0) {
+        set_deltas(client_socket, false);
+    } else if (strcmp(message, "resync") == 0) {
+        resync(client_socket);
+    } else if (strcmp(message, "shm") == 0) {
+        open_shm(client_socket);
+    } else if (sscanf(message, "board %d %d %d", &row, &col, &k) == 3) {
+        choose_board(client_socket, row, col, k, 0);
+    } else if (strcmp(message, "hint") == 0) {
+        send_analysis(client_socket, false, 0);
+    } else if (strcmp(message, "analyze") == 0) {
+        send_analysis(client_socket, true, 0);
+    } else if (strncmp(message, "play bot", 8) == 0) {
+        char* level = message + 8;
+        while (*level == ' ') {
+            level++;
+        }
+        if (*level == '\0' || strcmp(level, "hard") == 0) {
+            start_bot_game(client_socket, BOT_HARD, 0);
+        } else if (strcmp(level, "medium") == 0) {
+            start_bot_game(client_socket, BOT_MEDIUM, 0);
+        } else if (strcmp(level, "easy") == 0) {
+            start_bot_game(client_socket, BOT_EASY, 0);
+        } else {
+            send_to_client(client_socket, "Unknown difficulty. Use easy, medium or hard.\n");
+        }
+    } else if (sscanf(message, "resume %llx", &token) == 1) {
+        resume_game(client_socket, token);
+    } else if (sscanf(message, "watch %u", &watched) == 1) {
+        spectate_room(client_socket, watched);
+    } else if (strncmp(message, "help", 4) == 0) {
+        // Player asked for help
+        char help_msg[BUFFER_SIZE];
+        sprintf(help_msg, "Commands:\n"
+                          "  move <row> <col> - Make a move (rows and cols count from 0)\n"
+                          "  board <rows> <cols> <k> - Play a bigger board, k in a row wins (while waiting)\n"
+                          "  play bot [easy|medium|hard] - Play the server instead of waiting\n"
+                          "  hint - Suggest the best move for the player to move\n"
+                          "  analyze - Show how every free cell would turn out\n"
+                          "  resume <token> - Get back into your game after a disconnect or restart\n"
+                          "  watch <room> - Watch another room's game (while waiting)\n"
+                          "  binary - Switch to the binary protocol\n"
+                          "  delta [off] - Get one-line state and delta updates instead of boards\n"
+                          "  resync - Send the whole board again\n"
+                          "  shm - Move this connection to shared memory (Unix socket clients)\n"
+                          "  quit - Exit the game\n"
+                          "  help - Show this help message\n");
+        send_to_client(client_socket, help_msg);
+    } else {
+        // Unknown command
+        send_to_client(client_socket, "Unknown command. Type 'help' for available commands.\n");
+    }
+}
+
+void handle_client_frame(int client_socket, ClientFrame* frame) {
+    Connection* conn = &connections[client_socket];
+    TRACE(TRACE_MESSAGES, TRACE_FRAME, conn->room, client_socket, frame->type,
+          frame->cell | (uint64_t)frame->seq << 16);
+    if (conn->spectating) {
+        if (frame->type != FRAME_WATCH && frame->type != FRAME_QUIT) {
+            send_event(client_socket, EVENT_UNKNOWN_COMMAND, frame->seq, NULL);
+            return;
+        }
+    } else {
+        arm_room_timer(&rooms[conn->room]);
+    }
+    
+    if (frame->type == FRAME_MOVE) {
+        // The room id guards against moves queued for a room the player has left
+        BigBoard* big = rooms[conn->room].big;
+        int cols = big != NULL ? big->cols : 3;
+        int cells = big != NULL ? big->rows * big->cols : 9;
+        if (frame->room != (uint32_t)conn->room || frame->cell >= cells) {
+            metrics_add(METRIC_MOVES_REJECTED, 1);
+            send_event(client_socket, EVENT_INVALID_MOVE, frame->seq, NULL);
+            return;
+        }
+        play_move(client_socket, frame->cell / cols, frame->cell % cols, frame->seq);
+    } else if (frame->type == FRAME_QUIT) {
+        quit_game(client_socket);
+    } else if (frame->type == FRAME_PLAY_BOT && frame->cell >= BOT_EASY && frame->cell <= BOT_HARD) {
+        start_bot_game(client_socket, frame->cell, frame->seq);
+    } else if (frame->type == FRAME_SET_BOARD) {
+        choose_board(client_socket, frame->cell >> 10, (frame->cell >> 5) & 31, frame->cell & 31,
+                     frame->seq);
+    } else if (frame->type == FRAME_ANALYZE) {
+        send_analysis(client_socket, true, frame->seq);
+    } else if (frame->type == FRAME_RESUME) {
+        uint32_t secret = (uint32_t)frame->seq << 16 | frame->cell;
+        resume_game(client_socket, (uint64_t)secret << 32 | frame->room);
+    } else if (frame->type == FRAME_WATCH) {
+        spectate_room(client_socket, frame->room);
+    } else {
+        send_event(client_socket, EVENT_UNKNOWN_COMMAND, frame->seq, NULL);
+    }
+}
+
+void play_move(int client_socket, int row, int col, uint16_t seq) {
+    Room* room = &rooms[connections[client_socket].room];
+    Board* board = room_board(room);
+    int player_index = connections[client_socket].seat;
+    
+    // Moves are only accepted once both players are present
+    if (!room->game_active) {
+        metrics_add(METRIC_MOVES_REJECTED, 1);
+        send_event(client_socket, EVENT_NOT_STARTED, seq,
+                   "The game has not started yet. Please wait.\n");
+        return;
+    }
+    
+    // Check if it's this player's turn
+    if (player_index != board->current_player) {
+        metrics_add(METRIC_MOVES_REJECTED, 1);
+        send_event(client_socket, EVENT_NOT_YOUR_TURN, seq, "Not your turn! Please wait.\n");
+        return;
+    }
+    
+    // Make the move
+    bool placed = room->big != NULL ? make_big_move(room->big, row, col, player_index)
+                                    : make_move(board, row, col, player_index);
+    if (!placed) {
+        // Invalid move
+        metrics_add(METRIC_MOVES_REJECTED, 1);
+        send_event(client_socket, EVENT_INVALID_MOVE, seq, "Invalid move! Try again.\n");
+        return;
+    }
+    finish_move(room, player_index, row, col);
+    
+    // The bot answers right away, in the same batch of output
+    play_bot_move(room);
+}
+
+void finish_move(Room* room, int player_index, int row, int col) {
+    Board* board = room_board(room);
+    room->state_seq++;
+    int room_id = (int)(room - rooms);
+    BigBoard* big = room->big;
+    TRACE(TRACE_MESSAGES, TRACE_MOVE, room_id, -1, (uint32_t)(row << 8 | col), player_index);
+    metrics_add(METRIC_MOVES_ACCEPTED, 1);
+    shard->batch_moves++;
+    int ply = moves_made(room) - 1;
+    int cell = big != NULL ? row * big->cols + col : row * 3 + col;
+    record_game_event(room, JOURNAL_MOVE, ply, cell);
+    
+    // Check for win or draw, otherwise switch to next player. Big boards only
+    // look at the four lines through the move.
+    int result = RESULT_NONE;
+    if (big != NULL ? check_big_win(big, row, col, player_index) : check_win(board)) {
+        result = (player_index == 0) ? RESULT_X_WINS : RESULT_O_WINS;
+    } else if (big != NULL ? big->moves == big->rows * big->cols : check_draw(board)) {
+        result = RESULT_DRAW;
+    } else {
+        board->current_player = 1 - board->current_player;
+    }
+    
+    // Binary clients get one state frame (or cell frame on big boards), text
+    // clients the move, board and outcome, or a delta line if they asked
+    ServerFrame state;
+    fill_state_frame(room, result, &state);
+    if (big != NULL) {
+        state.type = FRAME_CELL;
+        state.a = (uint16_t)(row << 8 | col);
+        state.b = (uint16_t)player_index;
+    }
+    patch_board(room, row, col, player_index);
+    char text[BOARD_TEXT_SIZE];
+    int length = sprintf(text, "Player %d (%c) placed at position (%d,%d)\n",
+                         player_index + 1, (player_index == 0) ? 'X' : 'O', row, col);
+    size_t board_length;
+    const char* rendered = board_text(room, &board_length);
+    memcpy(text + length, rendered, board_length);
+    length += board_length;
+    strcpy(text + length, result == RESULT_NONE ? turn_lines[board->current_player] : result_lines[result]);
+    char delta[BUFFER_SIZE];
+    delta[0] = '\0';
+    
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        int client_fd = room->client_sockets[i];
+        if (client_fd < 0) {
+            continue;
+        }
+        if (connections[client_fd].binary) {
+            send_frame(client_fd, &state);
+        } else if (connections[client_fd].deltas) {
+            if (delta[0] == '\0') {
+                format_delta_line(room, cell, result, delta);
+            }
+            send_to_client(client_fd, delta);
+        } else {
+            send_to_client(client_fd, text);
+        }
+    }
+    publish_state(room, result, text, cell);
+    
+    if (result != RESULT_NONE) {
+        TRACE(TRACE_EVENTS, TRACE_GAME_OVER, room_id, -1, result, 0);
+        metrics_add(METRIC_GAMES_FINISHED, 1);
+        record_game_event(room, JOURNAL_RESULT, ply + 1, result);
+        
+        // Reset the game, keeping both players in the room
+        broadcast_event(room, EVENT_NONE, "Starting a new game...\n");
+        initialize_game(room);
+        record_game_start(room);
+        send_game_state(room);
+    }
+}
+
+void start_bot_game(int client_socket, int level, uint16_t seq) {
+    Connection* conn = &connections[client_socket];
+    Room* room = &rooms[conn->room];
+    
+    // The bot only takes the place of an opponent that has not shown up yet
+    if (room->game_active || room->connected_clients != 1) {
+        send_event(client_socket, EVENT_BOT_UNAVAILABLE, seq,
+                   "You can only play the bot while waiting for an opponent.\n");
+        return;
+    }
+    if (room->big != NULL) {
+        send_event(client_socket, EVENT_BOT_UNAVAILABLE, seq,
+                   "The bot only plays on the 3x3 board.\n");
+        return;
+    }
+    
+    if (room->waiting) {
+        remove_waiting_room(conn->room);
+    }
+    room->bot_level = level;
+    room->game_active = true;
+    initialize_game(room);
+    record_game_start(room);
+    
+    char message[BUFFER_SIZE];
+    sprintf(message, "Game is starting against the bot (%s)!\n",
+            level == BOT_EASY ? "easy" : level == BOT_MEDIUM ? "medium" : "hard");
+    send_event(client_socket, EVENT_STARTED, seq, message);
+    send_game_state(room);
+}
+
+void play_bot_move(Room* room) {
+    Board* board = room_board(room);
+    if (room->bot_level == BOT_NONE || !room->game_active || board->current_player != BOT_SEAT) {
+        return;
+    }
+    
+    int cell = choose_bot_move(board, room->bot_level);
+    make_move(board, cell / 3, cell % 3, BOT_SEAT);
+    finish_move(room, BOT_SEAT, cell / 3, cell % 3);
+}
+
+void quit_game(int client_socket) {
+    if (connections[client_socket].spectating) {
+        TRACE(TRACE_EVENTS, TRACE_DISCONNECT, connections[client_socket].room, client_socket, 0, 0);
+        close_connection(client_socket);
+        remove_spectator(client_socket);
+        return;
+    }
+    
+    // Player wants to quit
+    char quit_msg[BUFFER_SIZE];
+    sprintf(quit_msg, "Player %d has quit the game.\n", connections[client_socket].seat + 1);
+    broadcast_event(&rooms[connections[client_socket].room], EVENT_OPPONENT_QUIT, quit_msg);
+    
+    // Unlike a dropped connection, the seat is given up right away
+    TRACE(TRACE_EVENTS, TRACE_DISCONNECT, connections[client_socket].room, client_socket, 0, 0);
+    close_connection(client_socket);
+    leave_room(client_socket);
+}
+
+void send_analysis(int client_socket, bool full, uint16_t seq) {
+    Room* room = &rooms[connections[client_socket].room];
+    if (!room->game_active) {
+        send_event(client_socket, EVENT_NOT_STARTED, seq,
+                   "The game has not started yet. Please wait.\n");
+        return;
+    }
+    
+    if (room->big != NULL) {
+        send_event(client_socket, EVENT_UNSUPPORTED, seq,
+                   "Analysis is only available on the 3x3 board.\n");
+        return;
+    }
+    
+    // Answered from the shared table, so repeated questions cost one lookup
+    Board* board = room_board(room);
+    uint32_t values = tt_analyze(board->marks[0], board->marks[1]);
+    int best = best_move(board, values);
+    
+    if (connections[client_socket].binary) {
+        ServerFrame frame;
+        frame.type = FRAME_ANALYSIS;
+        frame.code = best;
+        frame.seq = seq;
+        frame.a = (uint16_t)values;
+        frame.b = (uint16_t)(values >> 16);
+        send_frame(client_socket, &frame);
+        return;
+    }
+    
+    static const char* value_names[4] = { "", "loss", "draw", "win" };
+    int player = board->current_player;
+    char text[BUFFER_SIZE];
+    int length = 0;
+    if (full) {
+        // Free cells show what the move leads to with perfect play on both sides
+        static const char value_marks[4] = { ' ', 'L', 'D', 'W' };
+        char cells[9];
+        for (int cell = 0; cell < 9; cell++) {
+            cells[cell] = cell_mark(board, cell);
+            if (cells[cell] == ' ') {
+                cells[cell] = value_marks[(values >> (cell * 2)) & 3];
+            }
+        }
+        length = sprintf(text, "Analysis for Player %d (%c): W = win, D = draw, L = loss\n"
+                               "\n  0 1 2\n"
+                               "0 %c|%c|%c\n"
+                               "  -+-+-\n"
+                               "1 %c|%c|%c\n"
+                               "  -+-+-\n"
+                               "2 %c|%c|%c\n\n",
+                         player + 1, player == 0 ? 'X' : 'O',
+                         cells[0], cells[1], cells[2], cells[3], cells[4], cells[5],
+                         cells[6], cells[7], cells[8]);
+    }
+    sprintf(text + length, "Best move for Player %d (%c): move %d %d (%s)\n",
+            player + 1, player == 0 ? 'X' : 'O', best / 3, best % 3,
+            value_names[(values >> (best * 2)) & 3]);
+    send_to_client(client_socket, text);
+}
+
+int best_move(Board* board, uint32_t values) {
+    // Highest value first, and among winning moves one that wins on the spot
+    uint16_t own = board->marks[board->current_player];
+    int best = -1, best_value = 0;
+    for (int cell = 0; cell < 9; cell++) {
+        int value = (values >> (cell * 2)) & 3;
+        if (value == TT_VALUE_TAKEN) {
+            continue;
+        }
+        uint16_t after = own | (1 << cell);
+        if (value == TT_VALUE_WIN && ((win_table[after >> 6] >> (after & 63)) & 1)) {
+            value = TT_VALUE_WIN + 1;
+        }
+        if (value > best_value) {
+            best = cell;
+            best_value = value;
+        }
+    }
+    return best;
+}
+
+void switch_to_binary(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    Room* room = &rooms[conn->room];
+    
+    // Everything after this line is framed, in both directions
+    send_to_client(client_socket, "OK binary\n");
+    conn->binary = true;
+    
+    // Tell the client its seat and room, then the current state
+    ServerFrame joined;
+    joined.type = FRAME_EVENT;
+    joined.code = conn->spectating ? EVENT_WATCHING : EVENT_JOINED;
+    joined.seq = conn->spectating ? 0 : conn->seat;
+    joined.a = (uint16_t)(conn->room >> 16);
+    joined.b = (uint16_t)conn->room;
+    send_frame(client_socket, &joined);
+    
+    if (room->big != NULL) {
+        send_board_frames(client_socket, room);
+    }
+    if (room->game_active && room->big == NULL) {
+        ServerFrame state;
+        fill_state_frame(room, RESULT_NONE, &state);
+        send_frame(client_socket, &state);
+    } else if (!room->game_active) {
+        send_event(client_socket, EVENT_WAITING, 0, NULL);
+    }
+}
+
+// Moves a local client onto a pair of rings in shared memory. The answer
+// carries the memfd and both eventfds; everything after it, both ways, goes
+// through the rings. The socket stays open to tell when the client is gone.
+void open_shm(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    if (!conn->local || use_uring || conn->shm != NULL) {
+        send_to_client(client_socket, "Shared memory is only for local clients of the epoll backend.\n");
+        return;
+    }
+    
+    // What is already queued has to arrive ahead of the answer
+    if (flush_output(client_socket) < 0 || conn->out_head != NULL) {
+        send_to_client(client_socket, "Cannot switch to shared memory now. Try again later.\n");
+        return;
+    }
+    
+    int fds[3] = { shm_create(), eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                   eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) };
+    ShmChannel* channel = fds[0] >= 0 ? shm_map(fds[0]) : NULL;
+    metrics_add(METRIC_SYSCALLS, 6);
+    bool sent = false;
+    if (channel != NULL && fds[1] >= 0 && fds[2] >= 0) {
+        // Nothing sits in epoll waiting for input yet
+        atomic_store(&channel->server_sleeping, 1);
+        
+        char reply[] = "OK shm\n";
+        struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) - 1 };
+        union {
+            char buffer[CMSG_SPACE(sizeof(fds))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = &iov;
+        header.msg_iovlen = 1;
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        sent = sendmsg(client_socket, &header, MSG_NOSIGNAL) == (ssize_t)iov.iov_len;
+        metrics_add(METRIC_SYSCALLS, 1);
+    }
+    
+    // The mapping keeps the memory; the client has its own descriptor
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+    if (!sent) {
+        if (channel != NULL) {
+            shm_unmap(channel);
+        }
+        for (int i = 1; i < 3; i++) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        send_to_client(client_socket, "Shared memory is not available.\n");
+        return;
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = EPOLL_SHM | (uint32_t)client_socket;
+    metrics_add(METRIC_SYSCALLS, 1);
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fds[1], &ev) < 0) {
+        perror("Epoll registration failed");
+    }
+    conn->shm = channel;
+    conn->shm_wake_fd = fds[1];
+    conn->shm_notify_fd = fds[2];
+}
+
+// Handles what a shared-memory client put in its ring, and queued output it
+// has made room for. The shard only goes back to waiting for the eventfd
+// once the ring is empty with the sleeping flag up. A client that keeps the
+// ring full gets SHM_INPUT_BUDGET bytes per wakeup and then wakes the shard
+// again itself, so the other connections get their turn in between.
+void handle_shm_input(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    if (!conn->in_use || conn->shm == NULL) {
+        return;
+    }
+    ShmChannel* channel = conn->shm;
+    eventfd_t count;
+    eventfd_read(conn->shm_wake_fd, &count);
+    metrics_add(METRIC_SYSCALLS, 1);
+    
+    // A connection that moves on or closes stops reading here; the shard
+    // that takes it reads the rest
+    uint32_t budget = SHM_INPUT_BUDGET;
+    do {
+        uint32_t length;
+        const char* data = shm_peek(&channel->to_server, &length);
+        while (conn->in_use && length > 0 && budget > 0) {
+            if (length > budget) {
+                length = budget;
+            }
+            take_input(client_socket, data, length);
+            budget -= length;
+            if (shm_consume(&channel->to_server, length)) {
+                eventfd_write(conn->shm_notify_fd, 1);
+                metrics_add(METRIC_SYSCALLS, 1);
+            }
+            data = shm_peek(&channel->to_server, &length);
+        }
+    } while (conn->in_use && budget > 0 && !shm_sleep(&channel->to_server, &channel->server_sleeping));
+    
+    // The sleeping flag stays down, so the client will not write the
+    // eventfd; the shard comes back to the rest after the next wait
+    if (conn->in_use && budget == 0) {
+        eventfd_write(conn->shm_wake_fd, 1);
+        metrics_add(METRIC_SYSCALLS, 1);
+    }
+    if (conn->in_use && conn->out_head != NULL) {
+        mark_dirty(client_socket);
+    }
+}
+
+void choose_board(int client_socket, int rows, int cols, int k, uint16_t seq) {
+    Connection* conn = &connections[client_socket];
+    Room* room = &rooms[conn->room];
+    
+    // The size is picked by the player who opened the room, before anyone joins
+    if (room->game_active || room->connected_clients != 1) {
+        send_event(client_socket, EVENT_INVALID_BOARD, seq,
+                   "The board can only be changed while waiting for an opponent.\n");
+        return;
+    }
+    if (rows < 3 || rows > MAX_BOARD_SIZE || cols < 3 || cols > MAX_BOARD_SIZE ||
+        k < 3 || (k > rows && k > cols)) {
+        char error[BUFFER_SIZE];
+        sprintf(error, "Invalid board. Sides must be 3-%d and k at least 3 and at most the longer side.\n",
+                MAX_BOARD_SIZE);
+        send_event(client_socket, EVENT_INVALID_BOARD, seq, error);
+        return;
+    }
+    
+    // The player leaves the line for the old board
+    if (room->waiting) {
+        remove_waiting_room(conn->room);
+    }
+    
+    // The classic board keeps its bitboard fast path
+    if (rows == 3 && cols == 3 && k == 3) {
+        if (room->big != NULL) {
+            give_back_pooled(&big_board_pool, room->big, METRIC_BIG_BOARDS);
+            room->big = NULL;
+        }
+    } else {
+        if (room->big == NULL) {
+            room->big = take_pooled(&big_board_pool, METRIC_BIG_BOARDS);
+            if (room->big == NULL) {
+                send_to_client(client_socket, "Server is out of memory. Try again later.\n");
+                push_waiting_room(conn->room);
+                return;
+            }
+        }
+        room->big->rows = rows;
+        room->big->cols = cols;
+        room->big->k = k;
+    }
+    initialize_game(room);
+    
+    if (conn->binary) {
+        ServerFrame frame = { FRAME_BOARD, (uint8_t)k, room->state_seq, (uint16_t)rows, (uint16_t)cols };
+        send_frame(client_socket, &frame);
+    } else {
+        char reply[BUFFER_SIZE];
+        sprintf(reply, "Board set to %dx%d, %d in a row wins.\n", rows, cols, k);
+        send_to_client(client_socket, reply);
+    }
+    
+    // Join whoever already waits for this board, or wait in line for it
+    if (take_opponent(client_socket, room_variant(room)) < 0) {
+        push_waiting_room(conn->room);
+        return;
+    }
+    leave_room(client_socket);
+    if (room_shard(conn->match_room) == shard) {
+        join_opponent(client_socket);
+    } else {
+        pass_on(client_socket, INBOX_MATCH);
+    }
+}
+
+void send_board_frames(int client_socket, Room* room) {
+    unsigned char bytes[BOARD_FRAMES_SIZE];
+    queue_output(client_socket, bytes, encode_board_frames(room, RESULT_NONE, bytes));
+}
+
+// Encodes a big board as a board frame, which clears the client's board,
+// then one cell frame per taken cell. Returns the length, at most
+// BOARD_FRAMES_SIZE.
+size_t encode_board_frames(Room* room, int result, unsigned char* out) {
+    BigBoard* big = room->big;
+    ServerFrame frame = { FRAME_BOARD, (uint8_t)big->k, room->state_seq,
+                          (uint16_t)big->rows, (uint16_t)big->cols };
+    encode_server_frame(&frame, out);
+    size_t length = SERVER_FRAME_SIZE;
+    
+    ServerFrame cell;
+    fill_state_frame(room, result, &cell);
+    cell.type = FRAME_CELL;
+    for (int row = 0; row < big->rows; row++) {
+        for (int player = 0; player < 2; player++) {
+            uint32_t bits = big->row_bits[player][row];
+            while (bits != 0) {
+                cell.a = (uint16_t)(row << 8 | __builtin_ctz(bits));
+                cell.b = (uint16_t)player;
+                encode_server_frame(&cell, out + length);
+                length += SERVER_FRAME_SIZE;
+                bits &= bits - 1;
+            }
+        }
+    }
+    return length;
+}
+
+Board* room_board(Room* room) {
+    return &boards[room - rooms];
+}
+
+Deadlines* room_deadlines(Room* room) {
+    return &deadlines[room - rooms];
+}
+
+bool make_big_move(BigBoard* big, int row, int col, int player) {
+    if (row < 0 || row >= big->rows || col < 0 || col >= big->cols) {
+        return false;
+    }
+    uint32_t bit = 1u << col;
+    if ((big->row_bits[0][row] | big->row_bits[1][row]) & bit) {
+        return false;
+    }
+    
+    // Record the cell in the line of every direction that passes through it
+    big->row_bits[player][row] |= bit;
+    big->col_bits[player][col] |= 1u << row;
+    big->diag_bits[player][row - col + big->cols - 1] |= 1u << row;
+    big->anti_bits[player][row + col] |= 1u << row;
+    big->moves++;
+    return true;
+}
+
+bool check_big_win(BigBoard* big, int row, int col, int player) {
+    // Only the four lines through the last move can have become a win
+    return run_length(big->row_bits[player][row], col) >= big->k ||
+           run_length(big->col_bits[player][col], row) >= big->k ||
+           run_length(big->diag_bits[player][row - col + big->cols - 1], row) >= big->k ||
+           run_length(big->anti_bits[player][row + col], row) >= big->k;
+}
+
+int run_length(uint32_t bits, int index) {
+    // Length of the run of set bits that contains bit index
+    int above = __builtin_ctz(~(bits >> index));
+    int below = index > 0 ? __builtin_clz(~(bits << (32 - index))) : 0;
+    return above + below;
+}
+
+void clear_big_board(BigBoard* big) {
+    memset(big->row_bits, 0, sizeof(big->row_bits));
+    memset(big->col_bits, 0, sizeof(big->col_bits));
+    memset(big->diag_bits, 0, sizeof(big->diag_bits));
+    memset(big->anti_bits, 0, sizeof(big->anti_bits));
+    big->moves = 0;
+}
+
+void print_board_to_string(Room* room, char* buffer) {
+    BigBoard* big = room->big;
+    if (big != NULL) {
+        // Column numbers on top, then one line per row with '.' for free cells
+        int length = sprintf(buffer, "\n   ");
+        for (int col = 0; col < big->cols; col++) {
+            length += sprintf(buffer + length, "%3d", col);
+        }
+        for (int row = 0; row < big->rows; row++) {
+            length += sprintf(buffer + length, "\n%3d", row);
+            for (int col = 0; col < big->cols; col++) {
+                char mark = (big->row_bits[0][row] >> col) & 1 ? 'X' :
+                            (big->row_bits[1][row] >> col) & 1 ? 'O' : '.';
+                length += sprintf(buffer + length, "  %c", mark);
+            }
+        }
+        sprintf(buffer + length, "\n\n");
+        return;
+    }
+    
+    Board* board = room_board(room);
+    sprintf(buffer,
+            "\n  0 1 2\n"
+            "0 %c|%c|%c\n"
+            "  -+-+-\n"
+            "1 %c|%c|%c\n"
+            "  -+-+-\n"
+            "2 %c|%c|%c\n\n",
+            cell_mark(board, 0), cell_mark(board, 1), cell_mark(board, 2),
+            cell_mark(board, 3), cell_mark(board, 4), cell_mark(board, 5),
+            cell_mark(board, 6), cell_mark(board, 7), cell_mark(board, 8));
+}
+
+// Renders the room's whole board into its cached text. Only needed when the
+// board changes other than by a move: a new game, a new size, a restore.
+void render_board(Room* room) {
+    BigBoard* big = room->big;
+    if (big != NULL) {
+        print_board_to_string(room, big->text);
+        big->text_length = (uint16_t)strlen(big->text);
+    } else {
+        BoardText* cached = &board_texts[room - rooms];
+        print_board_to_string(room, cached->text);
+        cached->length = (uint16_t)strlen(cached->text);
+    }
+}
+
+// Writes a move's mark into the cached text, where print_board_to_string
+// puts that cell
+void patch_board(Room* room, int row, int col, int player) {
+    char mark = player == 0 ? 'X' : 'O';
+    BigBoard* big = room->big;
+    if (big != NULL) {
+        // The column numbers, then every row, are lines of 4 + 3 * cols characters
+        int line = 4 + 3 * big->cols;
+        big->text[(row + 1) * line + 4 + 3 * col + 2] = mark;
+    } else {
+        // Nine characters of column numbers, then 16 per row and its separator
+        board_texts[room - rooms].text[9 + row * 16 + 2 + 2 * col] = mark;
+    }
+}
+
+const char* board_text(Room* room, size_t* length) {
+    if (room->big != NULL) {
+        *length = room->big->text_length;
+        return room->big->text;
+    }
+    BoardText* cached = &board_texts[room - rooms];
+    *length = cached->length;
+    return cached->text;
+}
+
+void send_game_state(Room* room) {
+    send_game_state_to(room, -1);
+}
+
+// Sends the room's state to everyone watching it. Each protocol's encoding
+// is made once, and every spectator's queue gets a reference to the same
+// bytes. A state with a result is always delivered; any other may be
+// skipped by a spectator that has fallen behind, which a delta client
+// notices as a gap in the sequence numbers. cell is the move that led to
+// the state, -1 if there was none.
+void publish_state(Room* room, int result, const char* text, int cell) {
+    FdList* spectators = &audiences[room - rooms].spectators;
+    if (spectators->count == 0) {
+        return;
+    }
+    
+    Broadcast* encoded[3] = { NULL, NULL, NULL };  // Text, binary, delta lines
+    for (int i = 0; i < spectators->count; i++) {
+        int client_socket = spectators->fds[i];
+        Connection* conn = &connections[client_socket];
+        int kind = conn->binary ? 1 : conn->deltas ? 2 : 0;
+        if (encoded[kind] == NULL) {
+            Broadcast* broadcast = alloc_broadcast();
+            if (broadcast == NULL) {
+                continue;  // Out of memory: this state is not shown
+            }
+            if (kind == 0) {
+                broadcast->length = strlen(text);
+                memcpy(broadcast->data, text, broadcast->length);
+            } else if (kind == 2 && cell >= 0) {
+                broadcast->length = format_delta_line(room, cell, result, broadcast->data);
+            } else if (kind == 2) {
+                broadcast->length = format_state_line(room, broadcast->data);
+            } else if (room->big != NULL) {
+                broadcast->length = encode_board_frames(room, result, (unsigned char*)broadcast->data);
+            } else {
+                ServerFrame state;
+                fill_state_frame(room, result, &state);
+                encode_server_frame(&state, (unsigned char*)broadcast->data);
+                broadcast->length = SERVER_FRAME_SIZE;
+            }
+            broadcast->keep = result != RESULT_NONE;
+            metrics_add(METRIC_BROADCASTS, 1);
+            encoded[kind] = broadcast;
+        }
+        queue_broadcast(client_socket, encoded[kind]);
+    }
+    
+    // Only the spectators' queues hold on to them now
+    for (int i = 0; i < 3; i++) {
+        if (encoded[i] != NULL) {
+            release_broadcast(encoded[i]);
+        }
+    }
+}
+
+// Sends the board and whose turn it is to one player, or to all players
+// and spectators for -1
+void send_game_state_to(Room* room, int only_socket) {
+    char board_str[BOARD_TEXT_SIZE];
+    format_game_state(room, board_str);
+    if (only_socket < 0) {
+        publish_state(room, RESULT_NONE, board_str, -1);
+    }
+    
+    ServerFrame state;
+    fill_state_frame(room, RESULT_NONE, &state);
+    char state_line[BOARD_TEXT_SIZE];
+    state_line[0] = '\0';
+    
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        int client_fd = room->client_sockets[i];
+        if (client_fd < 0 || (only_socket >= 0 && client_fd != only_socket)) {
+            continue;
+        }
+        if (connections[client_fd].binary && room->big != NULL) {
+            send_board_frames(client_fd, room);
+        } else if (connections[client_fd].binary) {
+            send_frame(client_fd, &state);
+        } else if (connections[client_fd].deltas) {
+            if (state_line[0] == '\0') {
+                format_state_line(room, state_line);
+            }
+            send_to_client(client_fd, state_line);
+        } else {
+            send_to_client(client_fd, board_str);
+        }
+    }
+}
+
+// The board and whose turn it is, as sent to text clients
+void format_game_state(Room* room, char* buffer) {
+    size_t length;
+    const char* rendered = board_text(room, &length);
+    memcpy(buffer, rendered, length);
+    strcpy(buffer + length, turn_lines[room_board(room)->current_player]);
+}
+
+// The whole board for a delta client: its sequence number and size, one
+// character per cell row by row, and whose turn it is. Returns the length.
+int format_state_line(Room* room, char* buffer) {
+    BigBoard* big = room->big;
+    Board* board = room_board(room);
+    int rows = big != NULL ? big->rows : 3;
+    int cols = big != NULL ? big->cols : 3;
+    int length = sprintf(buffer, "state %u %d %d ", room->state_seq, rows, cols);
+    for (int row = 0; row < rows; row++) {
+        uint32_t x = big != NULL ? big->row_bits[0][row] : (board->marks[0] >> (row * 3)) & 7;
+        uint32_t o = big != NULL ? big->row_bits[1][row] : (board->marks[1] >> (row * 3)) & 7;
+        for (int col = 0; col < cols; col++) {
+            buffer[length++] = (x >> col) & 1 ? 'X' : (o >> col) & 1 ? 'O' : '.';
+        }
+    }
+    length += sprintf(buffer + length, ", %s\n", delta_turns[board->current_player]);
+    return length;
+}
+
+// What the move into cell (row * cols + col) changed, for a delta client:
+// "delta <seq> cell 4 = X, turn O". The mover is whoever would be next had
+// the game not ended, since a result leaves the turn alone.
+int format_delta_line(Room* room, int cell, int result, char* buffer) {
+    int mover = room_board(room)->current_player;
+    if (result == RESULT_NONE) {
+        mover = 1 - mover;
+    }
+    return sprintf(buffer, "delta %u cell %d = %c, %s\n", room->state_seq, cell,
+                   mover == 0 ? 'X' : 'O',
+                   result == RESULT_NONE ? delta_turns[1 - mover] : delta_results[result]);
+}
+
+// Switches a text client between whole boards and state and delta lines
+void set_deltas(int client_socket, bool on) {
+    Connection* conn = &connections[client_socket];
+    conn->deltas = on;
+    send_to_client(client_socket, on ? "OK delta\n" : "OK delta off\n");
+    if (rooms[conn->room].game_active) {
+        resync(client_socket);
+    }
+}
+
+// Sends the whole board again, to a delta client that saw a gap
+void resync(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    Room* room = &rooms[conn->room];
+    if (!room->game_active) {
+        send_to_client(client_socket, "The game has not started yet. Please wait.\n");
+        return;
+    }
+    
+    char text[BOARD_TEXT_SIZE];
+    if (conn->deltas) {
+        format_state_line(room, text);
+    } else {
+        format_game_state(room, text);
+    }
+    send_to_client(client_socket, text);
+}
+
+void fill_state_frame(Room* room, int result, ServerFrame* frame) {
+    Board* board = room_board(room);
+    frame->type = FRAME_STATE;
+    frame->code = (board->current_player ? STATE_TURN_O : 0) | (result << STATE_RESULT_SHIFT);
+    frame->seq = room->state_seq;
+    frame->a = board->marks[0];
+    frame->b = board->marks[1];
+}
+
+void send_frame(int client_socket, ServerFrame* frame) {
+    unsigned char bytes[SERVER_FRAME_SIZE];
+    encode_server_frame(frame, bytes);
+    queue_output(client_socket, bytes, SERVER_FRAME_SIZE);
+}
+
+void send_event(int client_socket, int event, uint16_t seq, char* message) {
+    // Binary clients get the event code, text clients the message (if any)
+    if (connections[client_socket].binary) {
+        if (event != EVENT_NONE) {
+            ServerFrame frame = { FRAME_EVENT, (uint8_t)event, seq, 0, 0 };
+            send_frame(client_socket, &frame);
+        }
+    } else if (message != NULL) {
+        send_to_client(client_socket, message);
+    }
+}
+
+void broadcast_event(Room* room, int event, char* message) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (room->client_sockets[i] >= 0) {
+            send_event(room->client_sockets[i], event, 0, message);
+        }
+    }
+}
+
+void send_to_client(int client_socket, char* message) {
+    queue_output(client_socket, message, strlen(message));
+}
+
+void queue_output(int client_socket, const void* data, size_t length) {
+    Connection* conn = &connections[client_socket];
+    if (!conn->in_use || conn->out_overflow) {
+        return;
+    }
+    
+    // A client this far behind is not reading; drop it once the batch is done
+    if (conn->out_bytes + length > output_high_water) {
+        TRACE(TRACE_EVENTS, TRACE_OVERFLOW, conn->room, client_socket, output_high_water, 0);
+        metrics_add(METRIC_OUTPUT_OVERFLOWS, 1);
+        conn->out_overflow = true;
+    } else if (!append_output(conn, data, length)) {
+        conn->out_overflow = true;
+    }
+    mark_dirty(client_socket);
+}
+
+// Queues a reference to a broadcast, or swaps it in for the one the
+// spectator has not started to receive yet, so that a slow spectator skips
+// straight to the latest state
+void queue_broadcast(int client_socket, Broadcast* broadcast) {
+    Connection* conn = &connections[client_socket];
+    if (!conn->in_use || conn->out_overflow) {
+        return;
+    }
+    
+    atomic_fetch_add_explicit(&broadcast->refs, 1, memory_order_relaxed);
+    OutChunk* tail = conn->out_tail;
+    if (tail != NULL && tail->shared != NULL && tail->start == 0 && !tail->sending &&
+        !tail->shared->keep) {
+        conn->out_bytes = conn->out_bytes - tail->end + broadcast->length;
+        release_broadcast(tail->shared);
+        tail->shared = broadcast;
+        tail->end = broadcast->length;
+        metrics_add(METRIC_BROADCASTS_SKIPPED, 1);
+    } else if (conn->out_bytes + broadcast->length > output_high_water) {
+        TRACE(TRACE_EVENTS, TRACE_OVERFLOW, conn->room, client_socket, output_high_water, 0);
+        metrics_add(METRIC_OUTPUT_OVERFLOWS, 1);
+        release_broadcast(broadcast);
+        conn->out_overflow = true;
+    } else {
+        OutChunk* chunk = take_pooled(&shared_chunk_pool, METRIC_OUT_CHUNKS);
+        if (chunk == NULL) {
+            release_broadcast(broadcast);
+            conn->out_overflow = true;
+        } else {
+            chunk->next = NULL;
+            chunk->start = 0;
+            chunk->end = broadcast->length;
+            chunk->shared = broadcast;
+            chunk->sending = false;
+            if (tail != NULL) {
+                tail->next = chunk;
+            } else {
+                conn->out_head = chunk;
+            }
+            conn->out_tail = chunk;
+            conn->out_bytes += broadcast->length;
+        }
+    }
+    mark_dirty(client_socket);
+}
+
+void mark_dirty(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    if (!conn->out_dirty) {
+        conn->out_dirty = true;
+        fd_list_push(&shard->dirty, client_socket);
+    }
+}
+
+bool append_output(Connection* conn, const void* data, size_t length) {
+    const char* bytes = data;
+    while (length > 0) {
+        OutChunk* chunk = conn->out_tail;
+        if (chunk == NULL || chunk->shared != NULL || chunk->sending || chunk->end == OUT_CHUNK_SIZE) {
+            chunk = take_pooled(&out_chunk_pool, METRIC_OUT_CHUNKS);
+            if (chunk == NULL) {
+                return false;
+            }
+            chunk->next = NULL;
+            chunk->start = 0;
+            chunk->end = 0;
+            chunk->shared = NULL;
+            chunk->sending = false;
+            if (conn->out_tail != NULL) {
+                conn->out_tail->next = chunk;
+            } else {
+                conn->out_head = chunk;
+            }
+            conn->out_tail = chunk;
+        }
+        
+        size_t room_left = OUT_CHUNK_SIZE - chunk->end;
+        size_t part = length < room_left ? length : room_left;
+        memcpy(chunk->data + chunk->end, bytes, part);
+        chunk->end += part;
+        conn->out_bytes += part;
+        bytes += part;
+        length -= part;
+    }
+    return true;
+}
+
+int flush_output(int client_socket) {
+    // Returns -1 if the connection failed, 0 otherwise (including when the
+    // socket is full and the rest has to wait for EPOLLOUT)
+    Connection* conn = &connections[client_socket];
+    if (conn->shm != NULL) {
+        return flush_shm_output(client_socket);
+    }
+    while (conn->out_head != NULL) {
+        struct iovec iov[MAX_WRITE_IOVECS];
+        int iov_count = 0;
+        for (OutChunk* chunk = conn->out_head;
+             chunk != NULL && iov_count < MAX_WRITE_IOVECS; chunk = chunk->next) {
+            iov[iov_count].iov_base = chunk_bytes(chunk) + chunk->start;
+            iov[iov_count].iov_len = chunk->end - chunk->start;
+            iov_count++;
+        }
+        
+        ssize_t written = writev(client_socket, iov, iov_count);
+        metrics_add(METRIC_SYSCALLS, 1);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            TRACE(TRACE_EVENTS, TRACE_SEND_ERROR, conn->room, client_socket, errno, 0);
+            metrics_add(METRIC_SEND_ERRORS, 1);
+            return -1;
+        }
+        
+        // Release the chunks that went out completely
+        conn->out_bytes -= written;
+        metrics_add(METRIC_BYTES_OUT, written);
+        while (written > 0) {
+            OutChunk* chunk = conn->out_head;
+            size_t pending = chunk->end - chunk->start;
+            if ((size_t)written < pending) {
+                chunk->start += written;
+                break;
+            }
+            written -= pending;
+            conn->out_head = chunk->next;
+            free_chunk(chunk);
+        }
+        if (conn->out_head == NULL) {
+            conn->out_tail = NULL;
+        }
+    }
+    return 0;
+}
+
+// Copies the output queue into a shared-memory client's ring. What does not
+// fit waits until the client has made room and wakes the shard.
+int flush_shm_output(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    ShmRing* ring = &conn->shm->to_client;
+    uint32_t total = 0;
+    while (conn->out_head != NULL) {
+        OutChunk* chunk = conn->out_head;
+        uint32_t written = shm_write(ring, chunk_bytes(chunk) + chunk->start, chunk->end - chunk->start);
+        if (written == 0) {
+            if (shm_wait_for_room(ring)) {
+                continue;
+            }
+            break;
+        }
+        chunk->start += written;
+        conn->out_bytes -= written;
+        total += written;
+        if (chunk->start == chunk->end) {
+            conn->out_head = chunk->next;
+            free_chunk(chunk);
+        }
+    }
+    if (conn->out_head == NULL) {
+        conn->out_tail = NULL;
+    }
+    
+    // A client busy reading needs no wakeup
+    metrics_add(METRIC_BYTES_OUT, total);
+    if (total > 0 && shm_wake_needed(&conn->shm->client_sleeping)) {
+        eventfd_write(conn->shm_notify_fd, 1);
+        metrics_add(METRIC_SYSCALLS, 1);
+    }
+    return 0;
+}
+
+void flush_dirty_connections() {
+    // Disconnecting a client may queue messages for others, which appends
+    // to the list being walked, so iterate by index
+    for (int i = 0; i < shard->dirty.count; i++) {
+        int client_socket = shard->dirty.fds[i];
+        Connection* conn = &connections[client_socket];
+        conn->out_dirty = false;
+        if (!conn->in_use) {
+            continue;
+        }
+        if (conn->out_overflow) {
+            handle_client_disconnect(client_socket);
+        } else if (use_uring) {
+            // A chain still in flight queues the rest when it completes
+            if (conn->sends == 0) {
+                submit_output(client_socket);
+            }
+        } else if (flush_output(client_socket) < 0) {
+            handle_client_disconnect(client_socket);
+        }
+    }
+    shard->dirty.count = 0;
+}
+
+void free_output(Connection* conn) {
+    while (conn->out_head != NULL) {
+        OutChunk* chunk = conn->out_head;
+        conn->out_head = chunk->next;
+        free_chunk(chunk);
+    }
+    conn->out_tail = NULL;
+    conn->out_bytes = 0;
+}
+
+// Takes an object from one of the calling thread's pools, counting it in
+// the metric and any new slab in the memory the pools hold
+void* take_pooled(Pool* pool, int metric) {
+    uint64_t slabs = pool->slab_count;
+    void* object = pool_alloc(pool);
+    if (object != NULL) {
+        metrics_add(metric, 1);
+    }
+    if (pool->slab_count != slabs) {
+        metrics_add(METRIC_POOL_BYTES, pool->slab_objects * pool->object_size);
+    }
+    return object;
+}
+
+void give_back_pooled(Pool* pool, void* object, int metric) {
+    pool_free(pool, object);
+    metrics_add(metric, -1);
+}
+
+char* chunk_bytes(OutChunk* chunk) {
+    return chunk->shared != NULL ? chunk->shared->data : chunk->data;
+}
+
+void free_chunk(OutChunk* chunk) {
+    if (chunk->shared != NULL) {
+        release_broadcast(chunk->shared);
+        give_back_pooled(&shared_chunk_pool, chunk, METRIC_OUT_CHUNKS);
+    } else {
+        give_back_pooled(&out_chunk_pool, chunk, METRIC_OUT_CHUNKS);
+    }
+}
+
+// Returns an empty broadcast holding one reference, or NULL
+Broadcast* alloc_broadcast() {
+    Broadcast* broadcast = take_pooled(&broadcast_pool, METRIC_BROADCASTS_LIVE);
+    if (broadcast != NULL) {
+        atomic_init(&broadcast->refs, 1);
+        broadcast->length = 0;
+        broadcast->keep = false;
+    }
+    return broadcast;
+}
+
+void release_broadcast(Broadcast* broadcast) {
+    if (atomic_fetch_sub_explicit(&broadcast->refs, 1, memory_order_acq_rel) == 1) {
+        give_back_pooled(&broadcast_pool, broadcast, METRIC_BROADCASTS_LIVE);
+    }
+}
+
+bool fd_list_push(FdList* list, int fd) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        int* grown = realloc(list->fds, capacity * sizeof(int));
+        if (grown == NULL) {
+            return false;
+        }
+        list->fds = grown;
+        list->capacity = capacity;
+    }
+    list->fds[list->count++] = fd;
+    return true;
+}
+
+void handle_client_disconnect(int client_socket) {
+    // Find the client's room and seat
+    if (client_socket < 0 || client_socket >= MAX_FDS || !connections[client_socket].in_use) {
+        return;
+    }
+    
+    TRACE(TRACE_EVENTS, TRACE_DISCONNECT, connections[client_socket].room, client_socket, 0, 0);
+    close_connection(client_socket);
+    if (connections[client_socket].spectating) {
+        remove_spectator(client_socket);
+    } else {
+        hold_seat(client_socket);
+    }
+}
+
+void close_connection(int client_socket) {
+    connections[client_socket].in_use = false;
+    metrics_add(METRIC_CONNECTIONS_OPEN, -1);
+    timer_cancel(&shard->timers, &connections[client_socket].idle_timer);
+    if (!use_uring) {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, client_socket, NULL);
+        metrics_add(METRIC_SYSCALLS, 1);
+    }
+    
+    if (!fd_list_push(&shard->pending_close, client_socket)) {
+        // Out of memory: closing right away is still correct, just less careful
+        if (use_uring) {
+            detach_connection(client_socket, DETACH_CLOSE);
+        } else {
+            discard_connection(client_socket);
+        }
+    }
+}
+
+void flush_pending_closes() {
+    for (int i = 0; i < shard->pending_close.count; i++) {
+        if (use_uring) {
+            detach_connection(shard->pending_close.fds[i], DETACH_CLOSE);
+        } else {
+            finish_close(shard->pending_close.fds[i]);
+        }
+    }
+    shard->pending_close.count = 0;
+}
+
+void finish_close(int client_socket) {
+    // Last chance for goodbye messages; whatever does not fit is dropped
+    flush_output(client_socket);
+    discard_connection(client_socket);
+    metrics_add(METRIC_SYSCALLS, 1);
+}
+
+// Frees a connection's output and closes it, along with its shared memory
+void discard_connection(int client_socket) {
+    Connection* conn = &connections[client_socket];
+    free_output(conn);
+    if (conn->shm != NULL) {
+        // The client holds the eventfd too, so closing ours would not take
+        // it out of the epoll set
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, conn->shm_wake_fd, NULL);
+        shm_unmap(conn->shm);
+        close(conn->shm_wake_fd);
+        close(conn->shm_notify_fd);
+        conn->shm = NULL;
+        metrics_add(METRIC_SYSCALLS, 4);
+    }
+    close(client_socket);
+}
+
+void arm_room_timer(Room* room) {
+    // Only running games time out; a player waiting alone has the idle timer
+    if (room->game_active) {
+        timer_arm(&shard->timers, &room_deadlines(room)->game, shard->now + TIMEOUT_SECONDS);
+    }
+}
+
+void handle_timer(Timer* timer) {
+    if (timer->kind == TIMER_IDLE) {
+        int client_socket = timer->id;
+        TRACE(TRACE_EVENTS, TRACE_IDLE_TIMEOUT, connections[client_socket].room, client_socket, 0, 0);
+        metrics_add(METRIC_IDLE_TIMEOUTS, 1);
+        send_event(client_socket, EVENT_TIMEOUT, 0, "Disconnected due to inactivity.\n");
+        handle_client_disconnect(client_socket);
+        return;
+    }
+    
+    int room_id = timer->id;
+    Room* room = &rooms[room_id];
+    if (!room->in_use || !room->game_active) {
+        return;
+    }
+    
+    // A player who dropped did not come back in time
+    if (timer->kind == TIMER_GRACE) {
+        TRACE(TRACE_EVENTS, TRACE_GRACE_EXPIRED, room_id, -1, 0, 0);
+        abandon_game(room_id, "Your opponent did not come back in time.\n");
+        return;
+    }
+    
+    TRACE(TRACE_EVENTS, TRACE_ROOM_TIMEOUT, room_id, -1, 0, 0);
+    metrics_add(METRIC_GAME_TIMEOUTS, 1);
+    int ply = moves_made(room);
+    broadcast_event(room, EVENT_TIMEOUT, "Game timed out due to inactivity.\n");
+    
+    // Close both players and free the room
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (room->client_sockets[i] >= 0) {
+            close_connection(room->client_sockets[i]);
+        }
+    }
+    room->connected_clients = 0;
+    release_room(room_id);
+    record_game_event(room, JOURNAL_ABANDON, ply, ABANDON_TIMEOUT);
+}
+
+void record_game_start(Room* room) {
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = JOURNAL_START;
+    record.room = (uint32_t)(room - rooms);
+    record.rows = room->big != NULL ? room->big->rows : 3;
+    record.cols = room->big != NULL ? room->big->cols : 3;
+    record.k = room->big != NULL ? room->big->k : 3;
+    record.bot_level = room->bot_level;
+    record.tokens[0] = room->tokens[0];
+    record.tokens[1] = room->tokens[1];
+    if (!journal_append(&record)) {
+        metrics_add(METRIC_JOURNAL_DROPPED, 1);
+    }
+}
+
+void record_game_event(Room* room, int type, int ply, int value) {
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.room = (uint32_t)(room - rooms);
+    record.ply = ply;
+    record.value = value;
+    if (!journal_append(&record)) {
+        metrics_add(METRIC_JOURNAL_DROPPED, 1);
+    }
+}
+
+int moves_made(Room* room) {
+    if (room->big != NULL) {
+        return room->big->moves;
+    }
+    Board* board = room_board(room);
+    return __builtin_popcount(board->marks[0] | board->marks[1]);
+}
+
+// Snapshot source. Runs in the forked child, which sees every room as it was
+// at the fork, possibly halfway through a change.
+bool save_game(uint32_t room_id, SavedGame* game) {
+    Room* room = &rooms[room_id];
+    if (!room->in_use || !room->game_active) {
+        return false;
+    }
+    
+    BigBoard* big = room->big;
+    game->rows = big != NULL ? big->rows : 3;
+    game->cols = big != NULL ? big->cols : 3;
+    game->k = big != NULL ? big->k : 3;
+    if (game->rows > MAX_BOARD_SIZE || game->cols > MAX_BOARD_SIZE) {
+        return false;
+    }
+    game->bot_level = room->bot_level;
+    game->tokens[0] = room->tokens[0];
+    game->tokens[1] = room->tokens[1];
+    for (int player = 0; player < 2; player++) {
+        for (int row = 0; row < game->rows; row++) {
+            game->row_bits[player][row] = big != NULL ? big->row_bits[player][row]
+                                                      : (boards[room_id].marks[player] >> (row * 3)) & 7;
+        }
+    }
+    return true;
+}
+
+void recover_games(const char* snapshot_path, const char* journal_path) {
+    RecoveryStats stats;
+    uint64_t start = metrics_now_ns();
+    recovered_games = snapshot_recover(snapshot_path, journal_path, MAX_ROOMS, &recovered_count, &stats);
+    if (recovered_games == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Recovered %u running games (%u in the snapshot, %llu journal records after it) in %.1f ms\n",
+           stats.games, stats.snapshot_games, (unsigned long long)stats.journal_records,
+           (metrics_now_ns() - start) / 1e6);
+}
+
+void restore_games() {
+    // Take over the recovered games that fall in this shard's rooms. They
+    // wait for their players to come back with their tokens.
+    for (uint32_t i = 0; i < recovered_count; i++) {
+        int room_id = (int)recovered_games[i].room;
+        if (room_id >= shard->first_room && room_id < shard->first_room + shard->room_count) {
+            restore_game(&recovered_games[i]);
+        }
+    }
+    compact_free_rooms();
+}
+
+void compact_free_rooms() {
+    // Rooms in use again are no longer free
+    int kept = 0;
+    for (int i = 0; i < shard->free_room_count; i++) {
+        if (!rooms[shard->free_rooms[i]].in_use) {
+            shard->free_rooms[kept++] = shard->free_rooms[i];
+        }
+    }
+    shard->free_room_count = kept;
+}
+
+void restore_game(SavedGame* game) {
+    Room* room = &rooms[game->room];
+    if (!set_board(room, game->rows, game->cols, game->k, game->row_bits)) {
+        return;
+    }
+    room_board(room)->current_player = game->moves & 1;  // X always moves first
+    
+    room->in_use = true;
+    room->game_active = true;
+    room->waiting = false;
+    room->connected_clients = 0;
+    room->bot_level = game->bot_level;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        room->client_sockets[i] = -1;
+        room->tokens[i] = game->tokens[i];
+    }
+    arm_room_timer(room);
+    shard->active_rooms++;
+    metrics_add(METRIC_ROOMS_ACTIVE, 1);
+}
+
+// Puts the given cells on the room's board, rebuilding the line masks of a
+// big board. Returns false if the board could not be allocated.
+bool set_board(Room* room, int rows, int cols, int k, uint32_t row_bits[2][MAX_BOARD_SIZE]) {
+    if (rows != 3 || cols != 3 || k != 3) {
+        room->big = take_pooled(&big_board_pool, METRIC_BIG_BOARDS);
+        if (room->big == NULL) {
+            return false;
+        }
+        room->big->rows = rows;
+        room->big->cols = cols;
+        room->big->k = k;
+        clear_big_board(room->big);
+    }
+    
+    Board* board = room_board(room);
+    board->marks[0] = 0;
+    board->marks[1] = 0;
+    for (int player = 0; player < 2; player++) {
+        for (int row = 0; row < rows; row++) {
+            uint32_t bits = row_bits[player][row];
+            if (room->big == NULL) {
+                board->marks[player] |= bits << (row * 3);
+            }
+            while (room->big != NULL && bits != 0) {
+                make_big_move(room->big, row, __builtin_ctz(bits), player);
+                bits &= bits - 1;
+            }
+        }
+    }
+    render_board(room);
+    return true;
+}
 
-GameState game;
+// Upgrade thread: waits for a new binary to connect and hands the server
+// over to it
+void* run_upgrades(void* arg) {
+    (void)arg;
+    while (1) {
+        int sock = upgrade_accept(upgrade_fd);
+        if (sock < 0) {
+            return NULL;
+        }
+        
+        // Only returns if the new server went away before taking over
+        if (!hand_over(sock)) {
+            fprintf(stderr, "Upgrade abandoned, still serving\n");
+        }
+        close(sock);
+    }
+}
 
-// Function prototypes
-void initialize_game();
-void handle_client_message(int client_socket, char* message);
-bool make_move(int row, int col, int player);
-bool check_win();
-bool check_draw();
-void send_to_all_clients(char* message);
-void send_game_state();
-void send_to_client(int client_socket, char* message);
-void handle_client_disconnect(int client_socket);
-void check_timeout();
-void cleanup_and_exit(int sig);
-void print_board();
+void park_shard() {
+    pthread_mutex_lock(&park_lock);
+    parked_shards++;
+    pthread_cond_broadcast(&park_changed);
+    while (atomic_load(&upgrading)) {
+        pthread_cond_wait(&park_changed, &park_lock);
+    }
+    parked_shards--;
+    pthread_mutex_unlock(&park_lock);
+}
 
-int main() {
-    // Set up signal handling for clean exit
-    signal(SIGINT, cleanup_and_exit);
-    
-    // Initialize the game
-    initialize_game();
+bool hand_over(int sock) {
+    static UpgradeMessage message;
     
-    // Create server socket (raw socket)
-    int server_fd = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
-    if (server_fd < 0) {
-        perror("Raw socket creation failed");
-        exit(EXIT_FAILURE);
+    // The listen sockets go first, while still serving, so that the new
+    // server can set up its shards before anything stops
+    UpgradeHello hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, UPGRADE_MAGIC, sizeof(hello.magic));
+    hello.version = UPGRADE_VERSION;
+    hello.shard_count = shard_count;
+    hello.local_count = shards[0].local_fd >= 0;
+    upgrade_begin(&message, UPGRADE_HELLO);
+    bool ok = upgrade_put(sock, &message, &hello, sizeof(hello), shards[0].listen_fd);
+    for (int i = 1; ok && i < shard_count; i++) {
+        ok = upgrade_put(sock, &message, NULL, 0, shards[i].listen_fd);
     }
-    
-    // Note: For raw sockets, we need root privileges
-    if (getuid() != 0) {
-        fprintf(stderr, "Raw sockets require root privileges. Please run as root.\n");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+    if (ok && hello.local_count > 0) {
+        ok = upgrade_put(sock, &message, NULL, 0, shards[0].local_fd);
     }
-    
-    // Create a standard TCP socket for accepting connections
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        perror("Listen socket creation failed");
-        close(server_fd);
-        exit(EXIT_FAILURE);
+    if (!ok || !upgrade_flush(sock, &message) || !upgrade_receive(sock, &message) ||
+        message.type != UPGRADE_READY) {
+        return false;
     }
     
-    // Set socket options to reuse address
-    int opt = 1;
-    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("Setsockopt failed");
-        close(server_fd);
-        close(listen_fd);
-        exit(EXIT_FAILURE);
+    // Stop every shard at the end of its batch; waking them through the
+    // inbox gets the idle ones there too
+    uint64_t paused = metrics_now_ns();
+    pthread_mutex_lock(&park_lock);
+    if (atomic_load(&stopping)) {
+        // Shards may be gone already and would never park
+        pthread_mutex_unlock(&park_lock);
+        return false;
     }
-    
-    // Prepare the sockaddr_in structure
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
-    
-    // Bind the socket
-    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_fd);
-        close(listen_fd);
-        exit(EXIT_FAILURE);
+    atomic_store(&upgrading, true);
+    for (int i = 0; i < shard_count; i++) {
+        eventfd_write(shards[i].wake_fd, 1);
     }
+    while (parked_shards < shard_count) {
+        pthread_cond_wait(&park_changed, &park_lock);
+    }
+    pthread_mutex_unlock(&park_lock);
     
-    // Listen for connections
-    if (listen(listen_fd, 2) < 0) {
-        perror("Listen failed");
-        close(server_fd);
-        close(listen_fd);
-        exit(EXIT_FAILURE);
+    // Connections still in an inbox belong to no shard. Take them out, to
+    // be put back should the handover fail.
+    int inbox_counts[MAX_SHARDS];
+    int in_flight_count = 0;
+    uint64_t* in_flight = malloc((size_t)shard_count * INBOX_SIZE * sizeof(uint64_t));
+    ok = in_flight != NULL;
+    for (int i = 0; ok && i < shard_count; i++) {
+        inbox_counts[i] = 0;
+        while (inbox_counts[i] < INBOX_SIZE && queue_pop(&shards[i].inbox, &in_flight[in_flight_count])) {
+            inbox_counts[i]++;
+            in_flight_count++;
+        }
     }
     
-    printf("Tic-Tac-Toe server started on port %d\n", SERVER_PORT);
-    printf("Waiting for players to connect...\n");
+    upgrade_begin(&message, UPGRADE_CONNECTIONS);
+    int next = 0;
+    for (int i = 0; ok && i < shard_count; i++) {
+        for (int j = 0; ok && j < inbox_counts[i]; j++) {
+            uint64_t value = in_flight[next++];
+            int state = (value & INBOX_RESUME) ? UPGRADE_RESUMING
+                      : (value & INBOX_SPECTATE) ? UPGRADE_SPECTATING : UPGRADE_MATCHING;
+            ok = hand_over_connection(sock, &message, (int)(uint32_t)value, state, i);
+        }
+    }
     
-    // Main server loop
-    while (1) {
-        // Check for timeout
-        check_timeout();
-        
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(listen_fd, &read_fds);
-        FD_SET(server_fd, &read_fds);
-        
-        int max_fd = listen_fd > server_fd ? listen_fd : server_fd;
-        
-        // Add client sockets to fd_set
-        for (int i = 0; i < game.connected_clients; i++) {
-            int client_fd = game.client_sockets[i];
-            if (client_fd > 0) {
-                FD_SET(client_fd, &read_fds);
-                if (client_fd > max_fd) {
-                    max_fd = client_fd;
-                }
+    // Every other connection sits in a room or watches one. Walking the
+    // rooms touches far less memory than walking the connection table.
+    int connection_count = in_flight_count;
+    for (int room_id = 0; ok && room_id < MAX_ROOMS; room_id++) {
+        for (int i = 0; ok && rooms[room_id].in_use && i < MAX_CLIENTS; i++) {
+            int fd = rooms[room_id].client_sockets[i];
+            if (fd >= 0) {
+                ok = hand_over_connection(sock, &message, fd, UPGRADE_SEATED, 0);
+                connection_count += connections[fd].shm == NULL;
             }
         }
-        
-        // Set timeout for select
-        struct timeval tv;
-        tv.tv_sec = 1;  // 1 second timeout for select
-        tv.tv_usec = 0;
-        
-        // Wait for activity on any socket
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
-        
-        if (activity < 0) {
-            if (errno == EINTR) {
-                continue; // Interrupted by signal, continue the loop
-            }
-            perror("Select error");
+        FdList* spectators = &audiences[room_id].spectators;
+        for (int i = 0; ok && i < spectators->count; i++) {
+            ok = hand_over_connection(sock, &message, spectators->fds[i], UPGRADE_SPECTATING, 0);
+            connection_count += connections[spectators->fds[i]].shm == NULL;
+        }
+    }
+    ok = ok && upgrade_flush(sock, &message);
+    
+    upgrade_begin(&message, UPGRADE_ROOMS);
+    int room_count = 0;
+    for (int room_id = 0; ok && room_id < MAX_ROOMS; room_id++) {
+        Room* room = &rooms[room_id];
+        if (!room->in_use) {
             continue;
         }
-        
-        // Handle raw socket packets
-        if (FD_ISSET(server_fd, &read_fds)) {
-            unsigned char buffer[BUFFER_SIZE];
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            
-            int bytes_read = recvfrom(server_fd, buffer, BUFFER_SIZE, 0, 
-                                     (struct sockaddr*)&client_addr, &client_len);
-            
-            if (bytes_read > 0) {
-                struct iphdr* ip_header = (struct iphdr*)buffer;
-                int ip_header_length = ip_header->ihl * 4;
-                
-                // Get the TCP header
-                struct tcphdr* tcp_header = (struct tcphdr*)(buffer + ip_header_length);
-                
-                // Check if this packet is destined for our server port
-                if (ntohs(tcp_header->dest) == SERVER_PORT) {
-                    // Extract payload (if any)
-                    int tcp_header_length = tcp_header->doff * 4;
-                    char* payload = (char*)(buffer + ip_header_length + tcp_header_length);
-                    int payload_length = bytes_read - ip_header_length - tcp_header_length;
-                    
-                    if (payload_length > 0) {
-                        char client_ip[INET_ADDRSTRLEN];
-                        inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-                        
-                        printf("Received raw packet from %s:%d\n", 
-                               client_ip, ntohs(tcp_header->source));
-                        
-                        // Find client socket by address/port if needed
-                        // (Not directly used for processing in this example)
-                    }
-                }
-            }
+        UpgradeRoom handed;
+        memset(&handed, 0, sizeof(handed));
+        handed.room = room_id;
+        handed.game_active = room->game_active;
+        handed.bot_level = room->bot_level;
+        handed.state_seq = room->state_seq;
+        handed.rows = room->big != NULL ? room->big->rows : 3;
+        handed.cols = room->big != NULL ? room->big->cols : 3;
+        handed.k = room->big != NULL ? room->big->k : 3;
+        handed.current_player = room_board(room)->current_player;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            handed.seats[i] = room->client_sockets[i];
+            handed.tokens[i] = room->tokens[i];
         }
         
-        // Handle new connection on listen socket
-        if (FD_ISSET(listen_fd, &read_fds)) {
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int new_socket = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
-            
-            if (new_socket < 0) {
-                perror("Accept failed");
-                continue;
+        uint8_t record[sizeof(handed) + sizeof(uint32_t) * 2 * MAX_BOARD_SIZE];
+        uint8_t* at = record + sizeof(handed);
+        memcpy(record, &handed, sizeof(handed));
+        for (int player = 0; player < 2; player++) {
+            for (int row = 0; row < handed.rows; row++) {
+                uint32_t bits = room->big != NULL ? room->big->row_bits[player][row]
+                                                  : (boards[room_id].marks[player] >> (row * 3)) & 7;
+                memcpy(at, &bits, sizeof(bits));
+                at += sizeof(bits);
             }
-            
-            // Check if game is full
-            if (game.connected_clients >= MAX_CLIENTS) {
-                char* message = "Game is full. Try again later.\n";
-                send(new_socket, message, strlen(message), 0);
-                close(new_socket);
-                continue;
-            }
-            
-            // Add new client
-            game.client_sockets[game.connected_clients] = new_socket;
-            game.connected_clients++;
-            game.last_activity = time(NULL);
-            
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-            printf("New connection from %s:%d, assigned as Player %d\n", 
-                   client_ip, ntohs(client_addr.sin_port), game.connected_clients);
-            
-            // Send welcome message
-            char welcome_msg[BUFFER_SIZE];
-            sprintf(welcome_msg, "Welcome! You are Player %d (%c)\n", 
-                    game.connected_clients, (game.connected_clients == 1) ? 'X' : 'O');
-            send_to_client(new_socket, welcome_msg);
-            
-            // If game is ready to start
-            if (game.connected_clients == MAX_CLIENTS && !game.game_active) {
-                game.game_active = true;
-                send_to_all_clients("Game is starting!\n");
-                send_game_state();
-            } else if (game.connected_clients < MAX_CLIENTS) {
-                send_to_client(new_socket, "Waiting for another player to join...\n");
+        }
+        ok = upgrade_put(sock, &message, record, at - record, -1);
+        room_count++;
+    }
+    ok = ok && upgrade_flush(sock, &message);
+    
+    // Output the sockets would not take yet goes along too
+    for (int i = 0; ok && i < in_flight_count; i++) {
+        int fd = (int)(uint32_t)in_flight[i];
+        if (connections[fd].out_bytes > 0) {
+            ok = hand_over_output(sock, &message, fd);
+        }
+    }
+    for (int room_id = 0; ok && room_id < MAX_ROOMS; room_id++) {
+        for (int i = 0; ok && rooms[room_id].in_use && i < MAX_CLIENTS; i++) {
+            int fd = rooms[room_id].client_sockets[i];
+            if (fd >= 0 && connections[fd].out_bytes > 0) {
+                ok = hand_over_output(sock, &message, fd);
             }
         }
-        
-        // Handle client messages
-        for (int i = 0; i < game.connected_clients; i++) {
-            int client_fd = game.client_sockets[i];
-            
-            if (FD_ISSET(client_fd, &read_fds)) {
-                char buffer[BUFFER_SIZE] = {0};
-                int valread = read(client_fd, buffer, BUFFER_SIZE);
-                
-                if (valread <= 0) {
-                    // Client disconnected
-                    handle_client_disconnect(client_fd);
-                } else {
-                    // Process message
-                    buffer[valread] = '\0';  // Ensure null termination
-                    handle_client_message(client_fd, buffer);
-                }
+        FdList* spectators = &audiences[room_id].spectators;
+        for (int i = 0; ok && i < spectators->count; i++) {
+            if (connections[spectators->fds[i]].out_bytes > 0) {
+                ok = hand_over_output(sock, &message, spectators->fds[i]);
             }
         }
     }
     
-    // Clean up
-    close(server_fd);
-    close(listen_fd);
-    return 0;
-}
-
-void initialize_game() {
-    // Initialize the board
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-            game.board[i][j] = ' ';
+    // Nothing is given up until the new server confirms it has everything
+    if (ok) {
+        upgrade_begin(&message, UPGRADE_END);
+        ok = upgrade_put(sock, &message, &paused, sizeof(paused), -1) &&
+             upgrade_flush(sock, &message) && upgrade_receive(sock, &message) &&
+             message.type == UPGRADE_RECEIVED;
+    }
+    if (!ok) {
+        // Nothing has changed hands: put the inboxes back and carry on
+        next = 0;
+        for (int i = 0; in_flight != NULL && i < shard_count; i++) {
+            for (int j = 0; j < inbox_counts[i]; j++) {
+                queue_push(&shards[i].inbox, in_flight[next++]);
+            }
+        }
+        free(in_flight);
+        pthread_mutex_lock(&park_lock);
+        atomic_store(&upgrading, false);
+        pthread_cond_broadcast(&park_changed);
+        pthread_mutex_unlock(&park_lock);
+        for (int i = 0; i < shard_count; i++) {
+            eventfd_write(shards[i].wake_fd, 1);
         }
+        return false;
     }
     
-    game.current_player = 0;  // X goes first
-    game.connected_clients = 0;
-    game.game_active = false;
-    game.last_activity = time(NULL);
-    
-    memset(game.client_sockets, 0, sizeof(game.client_sockets));
+    // Make way for the new server's journal, trace and sockets, then leave
+    // without closing anything it now holds
+    journal_close();
+    trace_close();
+    metrics_close();
+    close(upgrade_fd);
+    unlink(upgrade_path);
+    upgrade_begin(&message, UPGRADE_DONE);
+    upgrade_flush(sock, &message);
+    printf("Handed %d connections and %d rooms over to the new server in %.2f ms\n",
+           connection_count, room_count, (metrics_now_ns() - paused) / 1e6);
+    exit(0);
 }
 
-void handle_client_message(int client_socket, char* message) {
-    printf("Received message: %s", message);
-    game.last_activity = time(NULL);
-    
-    // Find which player this is
-    int player_index = -1;
-    for (int i = 0; i < game.connected_clients; i++) {
-        if (game.client_sockets[i] == client_socket) {
-            player_index = i;
-            break;
-        }
-    }
+bool hand_over_connection(int sock, UpgradeMessage* message, int fd, int state, int shard_id) {
+    Connection* conn = &connections[fd];
     
-    if (player_index == -1) {
-        printf("Error: Client not found\n");
-        return;
+    // Shared memory does not carry over. The client loses the connection
+    // when this server exits and comes back with its resume token.
+    if (state != UPGRADE_ACCEPTED && conn->shm != NULL) {
+        return true;
     }
+    UpgradeConnection handed;
+    memset(&handed, 0, sizeof(handed));
+    handed.fd = fd;
+    handed.room = state == UPGRADE_SEATED || state == UPGRADE_SPECTATING ? conn->room : -1;
+    handed.state = state;
+    handed.shard = shard_id;
     
-    // Parse the message: expect format "move row col" (e.g., "move 0 1")
-    int row, col;
-    if (sscanf(message, "move %d %d", &row, &col) == 2) {
-        // Check if it's this player's turn
-        if (player_index != game.current_player) {
-            send_to_client(client_socket, "Not your turn! Please wait.\n");
-            return;
-        }
-        
-        // Make the move
-        if (make_move(row, col, player_index)) {
-            char move_msg[BUFFER_SIZE];
-            sprintf(move_msg, "Player %d (%c) placed at position (%d,%d)\n", 
-                    player_index + 1, (player_index == 0) ? 'X' : 'O', row, col);
-            send_to_all_clients(move_msg);
-            
-            // Send updated game state to all clients
-            send_game_state();
-            
-            // Check for win or draw
-            if (check_win()) {
-                char win_msg[BUFFER_SIZE];
-                sprintf(win_msg, "Player %d (%c) wins!\n", 
-                        player_index + 1, (player_index == 0) ? 'X' : 'O');
-                send_to_all_clients(win_msg);
-                
-                // Reset the game
-                send_to_all_clients("Starting a new game...\n");
-                initialize_game();
-                game.connected_clients = 2;  // Keep players connected
-                game.game_active = true;
-                send_game_state();
-            } else if (check_draw()) {
-                send_to_all_clients("Game ended in a draw!\n");
-                
-                // Reset the game
-                send_to_all_clients("Starting a new game...\n");
-                initialize_game();
-                game.connected_clients = 2;  // Keep players connected
-                game.game_active = true;
-                send_game_state();
-            } else {
-                // Switch to next player
-                game.current_player = 1 - game.current_player;
-                char turn_msg[BUFFER_SIZE];
-                sprintf(turn_msg, "It's Player %d's (%c) turn\n", 
-                        game.current_player + 1, (game.current_player == 0) ? 'X' : 'O');
-                send_to_all_clients(turn_msg);
-            }
-        } else {
-            // Invalid move
-            send_to_client(client_socket, "Invalid move! Try again.\n");
+    // A connection just accepted has nothing in its slot yet
+    uint8_t record[sizeof(handed) + RECV_BUFFER_SIZE];
+    if (state != UPGRADE_ACCEPTED) {
+        handed.seat = conn->seat;
+        handed.binary = conn->binary;
+        handed.deltas = conn->deltas;
+        handed.local = conn->local;
+        handed.recv_discard = conn->recv_discard;
+        handed.resume_token = conn->resume_token;
+        handed.out_length = conn->out_bytes;
+        handed.recv_length = conn->recv_tail - conn->recv_head;
+        for (uint32_t i = 0; i < handed.recv_length; i++) {
+            record[sizeof(handed) + i] = conn->recv_buffer[(conn->recv_head + i) & (RECV_BUFFER_SIZE - 1)];
         }
-    } else if (strncmp(message, "quit", 4) == 0) {
-        // Player wants to quit
-        char quit_msg[BUFFER_SIZE];
-        sprintf(quit_msg, "Player %d has quit the game.\n", player_index + 1);
-        send_to_all_clients(quit_msg);
-        handle_client_disconnect(client_socket);
-    } else if (strncmp(message, "help", 4) == 0) {
-        // Player asked for help
-        char help_msg[BUFFER_SIZE];
-        sprintf(help_msg, "Commands:\n"
-                          "  move <row> <col> - Make a move (rows and cols are 0-2)\n"
-                          "  quit - Exit the game\n"
-                          "  help - Show this help message\n");
-        send_to_client(client_socket, help_msg);
-    } else {
-        // Unknown command
-        send_to_client(client_socket, "Unknown command. Type 'help' for available commands.\n");
     }
+    memcpy(record, &handed, sizeof(handed));
+    return upgrade_put(sock, message, record, sizeof(handed) + handed.recv_length, fd);
 }
 
-bool make_move(int row, int col, int player) {
-    // Check if move is valid
-    if (row < 0 || row > 2 || col < 0 || col > 2) {
-        return false;
+bool hand_over_output(int sock, UpgradeMessage* message, int fd) {
+    if (connections[fd].shm != NULL) {
+        return true;
     }
     
-    // Check if the cell is empty
-    if (game.board[row][col] != ' ') {
-        return false;
+    // One message per chunk, each led by the socket it belongs to
+    int32_t old_fd = fd;
+    uint8_t record[sizeof(old_fd) + BROADCAST_SIZE];  // Fits a chunk's data or a broadcast
+    memcpy(record, &old_fd, sizeof(old_fd));
+    upgrade_begin(message, UPGRADE_OUTPUT);
+    for (OutChunk* chunk = connections[fd].out_head; chunk != NULL; chunk = chunk->next) {
+        size_t length = chunk->end - chunk->start;
+        memcpy(record + sizeof(old_fd), chunk_bytes(chunk) + chunk->start, length);
+        if (!upgrade_put(sock, message, record, sizeof(old_fd) + length, -1) ||
+            !upgrade_flush(sock, message)) {
+            return false;
+        }
     }
-    
-    // Make the move
-    game.board[row][col] = (player == 0) ? 'X' : 'O';
     return true;
 }
 
-bool check_win() {
-    char mark = (game.current_player == 0) ? 'X' : 'O';
+// Runs in the new binary: takes the listen sockets of the running server
+// and its shard count, and returns the connection to it
+int take_over_listeners(const char* path, int* listen_fds, int* local_fd) {
+    UpgradeMessage* message = malloc(sizeof(UpgradeMessage));
+    int sock = upgrade_connect(path);
+    if (message == NULL || sock < 0 || !upgrade_receive(sock, message)) {
+        exit(EXIT_FAILURE);
+    }
     
-    // Check rows
-    for (int i = 0; i < 3; i++) {
-        if (game.board[i][0] == mark && game.board[i][1] == mark && game.board[i][2] == mark) {
-            return true;
-        }
+    UpgradeHello hello;
+    memcpy(&hello, message->data, message->length < sizeof(hello) ? message->length : sizeof(hello));
+    if (message->type != UPGRADE_HELLO || message->length < sizeof(hello) ||
+        memcmp(hello.magic, UPGRADE_MAGIC, sizeof(hello.magic)) != 0 ||
+        hello.version != UPGRADE_VERSION || hello.shard_count < 1 ||
+        hello.shard_count > MAX_SHARDS || hello.local_count > 1 ||
+        message->fd_count != (int)(hello.shard_count + hello.local_count)) {
+        fprintf(stderr, "The running server does not speak this upgrade version\n");
+        exit(EXIT_FAILURE);
     }
     
-    // Check columns
-    for (int i = 0; i < 3; i++) {
-        if (game.board[0][i] == mark && game.board[1][i] == mark && game.board[2][i] == mark) {
-            return true;
-        }
+    // Rooms belong to shards by index, so the shard count carries over
+    shard_count = hello.shard_count;
+    memcpy(listen_fds, message->fds, sizeof(int) * shard_count);
+    if (hello.local_count > 0) {
+        *local_fd = message->fds[shard_count];
+    }
+    free(message);
+    return sock;
+}
+
+// Runs once the shards are set up but before they start: stops the running
+// server and takes its connections and rooms. The old server exits once
+// everything has been sent.
+void take_over_server(int sock) {
+    static UpgradeMessage message;
+    
+    // Output the old server had not sent yet is queued from this thread,
+    // with the pools main set up for shard 0
+    upgrade_begin(&message, UPGRADE_READY);
+    if (!upgrade_flush(sock, &message)) {
+        exit(EXIT_FAILURE);
     }
+    atomic_store(&shards_adopting, shard_count);
     
-    // Check diagonals
-    if (game.board[0][0] == mark && game.board[1][1] == mark && game.board[2][2] == mark) {
-        return true;
+    // Rooms refer to their players by socket number in the old server
+    int* fd_map = malloc(MAX_FDS * sizeof(int));
+    if (fd_map == NULL) {
+        perror("Failed to allocate upgrade table");
+        exit(EXIT_FAILURE);
     }
-    if (game.board[0][2] == mark && game.board[1][1] == mark && game.board[2][0] == mark) {
-        return true;
+    for (int i = 0; i < MAX_FDS; i++) {
+        fd_map[i] = -1;
     }
     
-    return false;
-}
-
-bool check_draw() {
-    // Check if all cells are filled
-    for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-            if (game.board[i][j] == ' ') {
-                return false;
+    while (1) {
+        if (!upgrade_receive(sock, &message)) {
+            exit(EXIT_FAILURE);
+        }
+        if (message.type == UPGRADE_CONNECTIONS) {
+            take_over_connections(&message, fd_map);
+        } else if (message.type == UPGRADE_ROOMS) {
+            take_over_rooms(&message, fd_map);
+        } else if (message.type == UPGRADE_OUTPUT && message.length > sizeof(int32_t)) {
+            int32_t old_fd;
+            memcpy(&old_fd, message.data, sizeof(old_fd));
+            if (old_fd >= 0 && old_fd < MAX_FDS && fd_map[old_fd] >= 0) {
+                append_output(&connections[fd_map[old_fd]], message.data + sizeof(old_fd),
+                              message.length - sizeof(old_fd));
             }
+        } else if (message.type == UPGRADE_END && message.length == sizeof(handover_paused_ns)) {
+            memcpy(&handover_paused_ns, message.data, sizeof(handover_paused_ns));
+            break;
         }
     }
-    return true;  // All cells are filled and no winner
+    free(fd_map);
+    
+    // Confirm, then wait for the old server to let go of the journal, trace
+    // and sockets
+    upgrade_begin(&message, UPGRADE_RECEIVED);
+    if (!upgrade_flush(sock, &message) || !upgrade_receive(sock, &message) ||
+        message.type != UPGRADE_DONE) {
+        exit(EXIT_FAILURE);
+    }
+    close(sock);
 }
 
-void send_to_all_clients(char* message) {
-    for (int i = 0; i < game.connected_clients; i++) {
-        send_to_client(game.client_sockets[i], message);
+void take_over_connections(UpgradeMessage* message, int* fd_map) {
+    int per_shard = MAX_ROOMS / shard_count;
+    size_t at = 0;
+    for (int i = 0; i < message->fd_count; i++) {
+        int fd = message->fds[i];
+        UpgradeConnection handed;
+        if (at + sizeof(handed) > message->length) {
+            fprintf(stderr, "Malformed connection in the upgrade\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(&handed, message->data + at, sizeof(handed));
+        const uint8_t* input = message->data + at + sizeof(handed);
+        at += sizeof(handed) + handed.recv_length;
+        if (at > message->length || handed.recv_length > RECV_BUFFER_SIZE ||
+            handed.fd < 0 || handed.fd >= MAX_FDS ||
+            ((handed.state == UPGRADE_SEATED || handed.state == UPGRADE_SPECTATING) &&
+             (handed.room < 0 || handed.room >= MAX_ROOMS))) {
+            fprintf(stderr, "Malformed connection in the upgrade\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Each connection goes to the shard running its room
+        int owner = handed.shard;
+        if (handed.state == UPGRADE_SEATED || handed.state == UPGRADE_SPECTATING) {
+            owner = handed.room / per_shard;
+        } else if (handed.state == UPGRADE_RESUMING) {
+            owner = (uint32_t)handed.resume_token / per_shard;
+        }
+        if (fd >= MAX_FDS || owner >= shard_count) {
+            close(fd);
+            continue;
+        }
+        
+        Connection* conn = &connections[fd];
+        conn->in_use = false;
+        conn->room = handed.room;
+        conn->seat = handed.seat;
+        conn->binary = handed.binary;
+        conn->deltas = handed.deltas;
+        conn->local = handed.local;
+        conn->shm = NULL;
+        conn->resume_token = handed.resume_token;
+        memcpy(conn->recv_buffer, input, handed.recv_length);
+        conn->recv_head = 0;
+        conn->recv_scan = 0;
+        conn->recv_tail = handed.recv_length;
+        conn->recv_discard = handed.recv_discard;
+        conn->out_head = NULL;
+        conn->out_tail = NULL;
+        conn->out_bytes = 0;
+        conn->out_dirty = false;
+        conn->out_overflow = false;
+        conn->spectating = false;
+        fd_map[handed.fd] = fd;
+        
+        if (handed_connection_count % 1024 == 0) {
+            HandedConnection* grown = realloc(handed_connections,
+                                              (handed_connection_count + 1024) * sizeof(HandedConnection));
+            if (grown == NULL) {
+                perror("Failed to allocate upgrade table");
+                exit(EXIT_FAILURE);
+            }
+            handed_connections = grown;
+        }
+        HandedConnection* entry = &handed_connections[handed_connection_count++];
+        entry->fd = fd;
+        entry->state = handed.state;
+        entry->shard = owner;
     }
 }
 
-void print_board_to_string(char* buffer) {
-    sprintf(buffer,
-            "\n  0 1 2\n"
-            "0 %c|%c|%c\n"
-            "  -+-+-\n"
-            "1 %c|%c|%c\n"
-            "  -+-+-\n"
-            "2 %c|%c|%c\n\n",
-            game.board[0][0], game.board[0][1], game.board[0][2],
-            game.board[1][0], game.board[1][1], game.board[1][2],
-            game.board[2][0], game.board[2][1], game.board[2][2]);
+void take_over_rooms(UpgradeMessage* message, int* fd_map) {
+    size_t at = 0;
+    while (at < message->length) {
+        HandedRoom handed;
+        memset(&handed, 0, sizeof(handed));
+        UpgradeRoom* room = &handed.room;
+        if (at + sizeof(UpgradeRoom) > message->length) {
+            fprintf(stderr, "Malformed room in the upgrade\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(room, message->data + at, sizeof(UpgradeRoom));
+        at += sizeof(UpgradeRoom);
+        size_t cells = room->rows * sizeof(uint32_t);
+        if (room->room >= MAX_ROOMS || room->rows > MAX_BOARD_SIZE || room->cols > MAX_BOARD_SIZE ||
+            at + 2 * cells > message->length) {
+            fprintf(stderr, "Malformed room in the upgrade\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(handed.row_bits[0], message->data + at, cells);
+        memcpy(handed.row_bits[1], message->data + at + cells, cells);
+        at += 2 * cells;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            int old_fd = room->seats[i];
+            room->seats[i] = old_fd >= 0 && old_fd < MAX_FDS ? fd_map[old_fd] : -1;
+        }
+        
+        if (handed_room_count % 1024 == 0) {
+            HandedRoom* grown = realloc(handed_rooms, (handed_room_count + 1024) * sizeof(HandedRoom));
+            if (grown == NULL) {
+                perror("Failed to allocate upgrade table");
+                exit(EXIT_FAILURE);
+            }
+            handed_rooms = grown;
+        }
+        handed_rooms[handed_room_count++] = handed;
+    }
 }
 
-void send_game_state() {
-    char board_str[BUFFER_SIZE];
-    print_board_to_string(board_str);
-    send_to_all_clients(board_str);
+void adopt_handover() {
+    if (handover_paused_ns == 0) {
+        return;
+    }
+    
+    // Rooms first, so that their players find them
+    for (uint32_t i = 0; i < handed_room_count; i++) {
+        int room_id = (int)handed_rooms[i].room.room;
+        if (room_id >= shard->first_room && room_id < shard->first_room + shard->room_count) {
+            adopt_room(&handed_rooms[i]);
+        }
+    }
+    compact_free_rooms();
+    for (uint32_t i = 0; i < handed_connection_count; i++) {
+        if (handed_connections[i].shard == shard->id) {
+            adopt_connection(&handed_connections[i]);
+        }
+    }
     
-    char turn_msg[BUFFER_SIZE];
-    sprintf(turn_msg, "It's Player %d's (%c) turn\n", 
-            game.current_player + 1, (game.current_player == 0) ? 'X' : 'O');
-    send_to_all_clients(turn_msg);
+    // The last shard to be ready ends the pause
+    if (atomic_fetch_sub(&shards_adopting, 1) == 1) {
+        printf("Took over %u connections and %u rooms, play was paused for %.2f ms\n",
+               handed_connection_count, handed_room_count,
+               (metrics_now_ns() - handover_paused_ns) / 1e6);
+    }
 }
 
-void send_to_client(int client_socket, char* message) {
-    if (send(client_socket, message, strlen(message), 0) < 0) {
-        printf("Error sending message to client\n");
+void adopt_room(HandedRoom* handed) {
+    UpgradeRoom* saved = &handed->room;
+    Room* room = &rooms[saved->room];
+    int seated = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        seated += saved->seats[i] >= 0;
+    }
+    
+    // A room whose only player could not be kept has nobody left to wait
+    if ((!saved->game_active && seated == 0) ||
+        !set_board(room, saved->rows, saved->cols, saved->k, handed->row_bits)) {
+        return;
+    }
+    room_board(room)->current_player = saved->current_player;
+    
+    room->in_use = true;
+    room->game_active = saved->game_active;
+    room->waiting = false;
+    room->connected_clients = seated;
+    room->bot_level = saved->bot_level;
+    room->state_seq = saved->state_seq;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        room->client_sockets[i] = saved->seats[i];
+        room->tokens[i] = saved->tokens[i];
+    }
+    shard->active_rooms++;
+    metrics_add(METRIC_ROOMS_ACTIVE, 1);
+    if (room->game_active) {
+        // How long a held seat had left is not handed over, so it starts afresh
+        arm_room_timer(room);
+        if (has_held_seat(room) && grace_seconds > 0) {
+            timer_arm(&shard->timers, &room_deadlines(room)->grace, shard->now + grace_seconds);
+        }
+    } else {
+        push_waiting_room(saved->room);
     }
 }
 
-void handle_client_disconnect(int client_socket) {
-    printf("Client disconnected\n");
-    
-    // Find the client in the array
-    int index = -1;
-    for (int i = 0; i < game.connected_clients; i++) {
-        if (game.client_sockets[i] == client_socket) {
-            index = i;
-            break;
+void adopt_connection(HandedConnection* handed) {
+    int fd = handed->fd;
+    if (handed->state == UPGRADE_ACCEPTED) {
+        seat_connection(fd, connections[fd].local);
+        return;
+    }
+    if (handed->state == UPGRADE_RESUMING) {
+        resume_connection(fd);
+        return;
+    }
+    if (handed->state == UPGRADE_MATCHING) {
+        // The pairing is not handed over, but the rooms waiting for it are
+        // listed again, so the connection is simply placed afresh
+        if (place_connection(fd)) {
+            process_input_lines(fd);
+            process_input_frames(fd);
         }
+        return;
     }
     
-    if (index == -1) {
+    Connection* conn = &connections[fd];
+    if (handed->state == UPGRADE_SPECTATING) {
+        // Watching starts over, from the current state of the room
+        if (watch_connection(fd) < 0) {
+            discard_connection(fd);
+            return;
+        }
+        add_spectator(fd);
+        if (conn->out_bytes > 0 && flush_output(fd) < 0) {
+            handle_client_disconnect(fd);
+        }
         return;
     }
-    
-    // Close the socket
-    close(client_socket);
-    
-    // Remove client from array by shifting remaining clients
-    for (int i = index; i < game.connected_clients - 1; i++) {
-        game.client_sockets[i] = game.client_sockets[i + 1];
+    Room* room = &rooms[conn->room];
+    if (!room->in_use || room->client_sockets[conn->seat] != fd) {
+        discard_connection(fd);
+        return;
+    }
+    if (watch_connection(fd) < 0) {
+        discard_connection(fd);
+        leave_room(fd);
+        return;
     }
     
-    game.connected_clients--;
-    
-    // Notify remaining clients
-    send_to_all_clients("A player has disconnected.\n");
-    
-    // Reset game if it was active
-    if (game.game_active) {
-        game.game_active = false;
-        initialize_game();
-        if (game.connected_clients > 0) {
-            send_to_all_clients("Waiting for another player to join...\n");
+    // Output the old server could not send yet goes out first
+    if (conn->out_bytes > 0 && flush_output(fd) < 0) {
+        handle_client_disconnect(fd);
+    }
+}
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Runs in signal context, so it only raises the flag and writes to the
+// shards' inbox eventfds, both of which are safe there
+void request_shutdown(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    atomic_store(&stopping, true);
+    uint64_t one = 1;
+    for (int i = 0; i < shard_count; i++) {
+        if (write(shards[i].wake_fd, &one, sizeof(one)) < 0) {
+            // Only fails if the counter is about to overflow, which still wakes it
         }
     }
+    errno = saved_errno;
 }
 
-void check_timeout() {
-    time_t current_time = time(NULL);
-    
-    // Check if game has been inactive for too long
-    if (game.game_active && (current_time - game.last_activity) > TIMEOUT_SECONDS) {
-        printf("Game timed out due to inactivity\n");
-        send_to_all_clients("Game timed out due to inactivity.\n");
-        initialize_game();
-        game.connected_clients = 0;  // Reset client count
+// A handover that has begun has to park every shard first. The upgrade
+// thread starts one under the same lock, and none once stopping is set.
+bool may_stop() {
+    pthread_mutex_lock(&park_lock);
+    bool may = !atomic_load(&upgrading);
+    pthread_mutex_unlock(&park_lock);
+    return may;
+}
+
+// Closes the connections of this shard's rooms. With snapshots on, the
+// games come back with the server.
+void stop_shard() {
+    if (use_uring) {
+        drain_ring();
+    }
+    char* goodbye = snapshots_on ? "Server is restarting. Resume your game with your token.\n"
+                                 : "Server is shutting down. Goodbye!\n";
+    for (int room_id = shard->first_room; room_id < shard->first_room + shard->room_count; room_id++) {
+        Room* room = &rooms[room_id];
+        if (!room->in_use) {
+            continue;
+        }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (room->client_sockets[i] > 0) {
+                send_event(room->client_sockets[i], EVENT_SHUTDOWN, 0, goodbye);
+                flush_output(room->client_sockets[i]);
+                close(room->client_sockets[i]);
+            }
+        }
+        for (int i = 0; i < audiences[room_id].spectators.count; i++) {
+            int client_socket = audiences[room_id].spectators.fds[i];
+            send_event(client_socket, EVENT_SHUTDOWN, 0, goodbye);
+            flush_output(client_socket);
+            close(client_socket);
+        }
     }
 }
 
-void cleanup_and_exit(int sig) {
+// Runs on the main thread once every shard has stopped
+void cleanup_and_exit() {
     printf("\nShutting down server...\n");
-    
-    // Close all client connections
-    for (int i = 0; i < game.connected_clients; i++) {
-        if (game.client_sockets[i] > 0) {
-            send_to_client(game.client_sockets[i], "Server is shutting down. Goodbye!\n");
-            close(game.client_sockets[i]);
-        }
+    trace_close();
+    metrics_close();
+    journal_close();
+    if (upgrade_fd >= 0) {
+        unlink(upgrade_path);
     }
+    unlink(local_path);
     
+    CaptureStats stats;
+    capture_stats(&stats);
+    printf("Capture: %llu packets matched, %llu dropped, %llu read in %llu batches\n",
+           (unsigned long long)stats.matched, (unsigned long long)stats.dropped,
+           (unsigned long long)stats.delivered, (unsigned long long)stats.blocks);
+    capture_close();
     exit(0);
 }
 
-void print_board() {
+void print_board(Room* room) {
+    Board* board = room_board(room);
     printf("\n  0 1 2\n");
     for (int i = 0; i < 3; i++) {
         printf("%d ", i);
         for (int j = 0; j < 3; j++) {
-            printf("%c", game.board[i][j]);
+            printf("%c", cell_mark(board, i * 3 + j));
             if (j < 2) printf("|");
         }
         printf("\n");
         if (i < 2) printf("  -+-+-\n");
     }
     printf("\n");
-}
\ No newline at end of file
+}
@@ -0,0 +1,138 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Shared-memory channel between the server and a client on the same host.
+//
+// Two single-producer/single-consumer byte rings in one memfd mapping, one
+// each way, carry exactly what the socket would. Each side has an eventfd
+// the other writes to when it has to wake it: for new bytes in the ring it
+// reads, or for room in the ring it writes once it found that full. A side
+// sets its sleeping flag before it blocks and looks at the rings once more;
+// the other side only writes to the eventfd if it sees the flag, so a busy
+// channel makes no system calls at all. The indices and flags are
+// sequentially consistent, so one of the two always sees the other's store
+// (a store followed by a load of the other's, as in Dekker's algorithm).
+
+#define SHM_RING_SIZE (64 * 1024)  // Bytes each way, a power of two
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t head;  // Next byte to read, written by the consumer
+    _Alignas(64) _Atomic uint32_t tail;  // Next byte to write, written by the producer
+    _Atomic uint32_t full;               // The producer waits to be told of room
+    _Alignas(64) char data[SHM_RING_SIZE];
+} ShmRing;
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t server_sleeping;
+    _Alignas(64) _Atomic uint32_t client_sleeping;
+    ShmRing to_server;
+    ShmRing to_client;
+} ShmChannel;
+
+// Returns a new memfd sized for a channel, or -1 after perror
+static inline int shm_create() {
+    int memfd = memfd_create("ttt_shm", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, sizeof(ShmChannel)) < 0) {
+        perror("Shared memory creation failed");
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        return -1;
+    }
+    return memfd;
+}
+
+// Maps the channel in memfd, or returns NULL after perror
+static inline ShmChannel* shm_map(int memfd) {
+    struct stat st;
+    if (fstat(memfd, &st) < 0 || st.st_size != sizeof(ShmChannel)) {
+        fprintf(stderr, "Shared memory channel has the wrong size\n");
+        return NULL;
+    }
+    ShmChannel* channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (channel == MAP_FAILED) {
+        perror("Shared memory mapping failed");
+        return NULL;
+    }
+    return channel;
+}
+
+static inline void shm_unmap(ShmChannel* channel) {
+    munmap(channel, sizeof(ShmChannel));
+}
+
+static inline uint32_t shm_readable(ShmRing* ring) {
+    return atomic_load(&ring->tail) - atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+// Copies in as much of data as fits, and returns how much that was
+static inline uint32_t shm_write(ShmRing* ring, const void* data, uint32_t length) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t space = SHM_RING_SIZE - (tail - atomic_load(&ring->head));
+    if (length > space) {
+        length = space;
+    }
+    
+    uint32_t at = tail & (SHM_RING_SIZE - 1);
+    uint32_t first = length < SHM_RING_SIZE - at ? length : SHM_RING_SIZE - at;
+    memcpy(ring->data + at, data, first);
+    memcpy(ring->data, (const char*)data + first, length - first);
+    atomic_store(&ring->tail, tail + length);
+    return length;
+}
+
+// The unread bytes up to the end of the ring; the rest, if they wrap, come
+// with the next call after shm_consume
+static inline const char* shm_peek(ShmRing* ring, uint32_t* length) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t at = head & (SHM_RING_SIZE - 1);
+    uint32_t readable = atomic_load(&ring->tail) - head;
+    *length = readable < SHM_RING_SIZE - at ? readable : SHM_RING_SIZE - at;
+    return ring->data + at;
+}
+
+// Returns true if the producer found the ring full and has to be woken
+static inline bool shm_consume(ShmRing* ring, uint32_t length) {
+    atomic_store(&ring->head, atomic_load_explicit(&ring->head, memory_order_relaxed) + length);
+    return atomic_load(&ring->full) && atomic_exchange(&ring->full, 0);
+}
+
+// Called by a producer that found the ring full. Returns true if there is
+// room after all; otherwise the consumer wakes it once there is.
+static inline bool shm_wait_for_room(ShmRing* ring) {
+    atomic_store(&ring->full, 1);
+    uint32_t used = atomic_load_explicit(&ring->tail, memory_order_relaxed) - atomic_load(&ring->head);
+    if (used < SHM_RING_SIZE) {
+        atomic_store(&ring->full, 0);
+        return true;
+    }
+    return false;
+}
+
+// Called by a producer after writing. Returns true if the consumer has to
+// be woken through its eventfd.
+static inline bool shm_wake_needed(_Atomic uint32_t* sleeping) {
+    return atomic_load(sleeping) && atomic_exchange(sleeping, 0);
+}
+
+// Called by a consumer about to block. Returns true if it may, false if
+// the ring got bytes meanwhile.
+static inline bool shm_sleep(ShmRing* ring, _Atomic uint32_t* sleeping) {
+    atomic_store(sleeping, 1);
+    if (shm_readable(ring) > 0) {
+        atomic_store(sleeping, 0);
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "snapshot.h"
+#include "journal.h"
+#include "metrics.h"
+
+#define SNAPSHOT_HEADER_SIZE 16
+#define SNAPSHOT_MAX_RECORD 160        // Longest encoded game
+#define SNAPSHOT_BUFFER_SIZE (1 << 16)
+
+static char snapshot_path[PATH_MAX];
+static char temp_path[PATH_MAX];       // Written first, then renamed over snapshot_path
+static struct timespec interval;
+static uint32_t snapshot_rooms;
+static SnapshotSource snapshot_source;
+static pthread_t snapshot_thread;
+static uint8_t buffer[SNAPSHOT_BUFFER_SIZE];  // Only used by the forked child
+
+static void* run_snapshots(void* arg);
+static void take_snapshot();
+static int write_snapshot(uint64_t journal_offset);
+static int write_games(int fd, uint64_t journal_offset);
+static int write_all(int fd, const uint8_t* data, size_t length);
+static size_t encode_game(const SavedGame* game, uint8_t* out);
+static size_t decode_game(const uint8_t* in, const uint8_t* end, SavedGame* game);
+static bool load_snapshot(const uint8_t* data, size_t size, SavedGame* games, uint32_t room_count,
+                          RecoveryStats* stats);
+static void apply_record(SavedGame* games, uint32_t room_count, const JournalRecord* record);
+static int map_file(const char* path, const uint8_t** data, size_t* size);
+static void put_u64(uint8_t* out, uint64_t value);
+static uint64_t get_u64(const uint8_t* in);
+
+int snapshot_start(const char* path, int interval_s, uint32_t room_count, SnapshotSource source) {
+    if (strlen(path) + 5 > sizeof(temp_path)) {
+        fprintf(stderr, "Snapshot path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(snapshot_path, path);
+    sprintf(temp_path, "%s.tmp", path);
+    interval.tv_sec = interval_s > 0 ? interval_s : 1;
+    interval.tv_nsec = 0;
+    snapshot_rooms = room_count;
+    snapshot_source = source;
+    
+    // Nor does the snapshot thread, or the children it forks
+    sigset_t interrupt, previous;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, &previous);
+    int started = pthread_create(&snapshot_thread, NULL, run_snapshots, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (started != 0) {
+        perror("Failed to start snapshot thread");
+        return -1;
+    }
+    pthread_detach(snapshot_thread);
+    return 0;
+}
+
+static void* run_snapshots(void* arg) {
+    (void)arg;
+    metrics_register_thread();
+    while (1) {
+        nanosleep(&interval, NULL);
+        take_snapshot();
+    }
+    return NULL;
+}
+
+static void take_snapshot() {
+    // Everything synced by now was appended before the fork, so the tail
+    // replayed on recovery can only repeat what the image already holds
+    uint64_t journal_offset = journal_synced_size();
+    
+    uint64_t start = metrics_now_ns();
+    pid_t child = fork();
+    if (child < 0) {
+        perror("Snapshot fork failed");
+        return;
+    }
+    if (child == 0) {
+        // Ctrl-C goes to the whole process group; finish the file regardless
+        signal(SIGINT, SIG_IGN);
+        _exit(write_snapshot(journal_offset) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    metrics_observe(HISTOGRAM_FORK, metrics_now_ns() - start, 1);
+    
+    int status;
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("Snapshot wait failed");
+            return;
+        }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+        metrics_add(METRIC_SNAPSHOTS, 1);
+    } else {
+        fprintf(stderr, "Snapshot to %s failed\n", snapshot_path);
+    }
+}
+
+// Runs in the child: plain system calls only, since another thread may have
+// held the stdio or malloc locks at the moment of the fork
+static int write_snapshot(uint64_t journal_offset) {
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = write_games(fd, journal_offset);
+    if (result == 0) {
+        result = fsync(fd);
+    }
+    close(fd);
+    if (result == 0) {
+        result = rename(temp_path, snapshot_path);
+    }
+    return result;
+}
+
+static int write_games(int fd, uint64_t journal_offset) {
+    memcpy(buffer, SNAPSHOT_MAGIC, 7);
+    buffer[7] = SNAPSHOT_VERSION;
+    put_u64(buffer + 8, journal_offset);
+    size_t length = SNAPSHOT_HEADER_SIZE;
+    
+    SavedGame game;
+    for (uint32_t room = 0; room < snapshot_rooms; room++) {
+        if (!snapshot_source(room, &game)) {
+            continue;
+        }
+        game.room = room;
+        if (SNAPSHOT_BUFFER_SIZE - length < SNAPSHOT_MAX_RECORD) {
+            if (write_all(fd, buffer, length) < 0) {
+                return -1;
+            }
+            length = 0;
+        }
+        length += encode_game(&game, buffer + length);
+    }
+    buffer[length++] = 0;
+    return write_all(fd, buffer, length);
+}
+
+static int write_all(int fd, const uint8_t* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+SavedGame* snapshot_recover(const char* path, const char* journal_path, uint32_t room_count,
+                            uint32_t* count, RecoveryStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    SavedGame* games = calloc(room_count, sizeof(SavedGame));
+    if (games == NULL) {
+        perror("Failed to allocate recovery table");
+        return NULL;
+    }
+    
+    // The snapshot gives every game as of some point in the journal...
+    const uint8_t* data;
+    size_t size;
+    if (map_file(path, &data, &size) < 0) {
+        free(games);
+        return NULL;
+    }
+    if (data != NULL) {
+        if (!load_snapshot(data, size, games, room_count, stats)) {
+            // The journal alone still has everything, it just takes longer
+            fprintf(stderr, "Snapshot %s is damaged, replaying the whole journal\n", path);
+            memset(games, 0, room_count * sizeof(SavedGame));
+            stats->snapshot_games = 0;
+            stats->journal_offset = 0;
+        }
+        munmap((void*)data, size);
+    }
+    
+    // ...and the journal has what happened after it
+    if (map_file(journal_path, &data, &size) < 0) {
+        free(games);
+        return NULL;
+    }
+    if (data != NULL) {
+        const uint8_t* end = data + size;
+        const uint8_t* at = data + (stats->journal_offset < size ? stats->journal_offset : size);
+        JournalRecord record;
+        memset(&record, 0, sizeof(record));
+        size_t used;
+        while ((used = journal_decode(at, end, &record)) > 0) {
+            apply_record(games, room_count, &record);
+            stats->journal_records++;
+            at += used;
+        }
+        munmap((void*)data, size);
+    }
+    
+    // Keep the games that are still running, packed in room order
+    uint32_t live = 0;
+    for (uint32_t room = 0; room < room_count; room++) {
+        if (games[room].live) {
+            games[live++] = games[room];
+        }
+    }
+    *count = live;
+    stats->games = live;
+    return games;
+}
+
+static bool load_snapshot(const uint8_t* data, size_t size, SavedGame* games, uint32_t room_count,
+                          RecoveryStats* stats) {
+    if (size < SNAPSHOT_HEADER_SIZE || memcmp(data, SNAPSHOT_MAGIC, 7) != 0 ||
+        data[7] != SNAPSHOT_VERSION) {
+        return false;
+    }
+    stats->journal_offset = get_u64(data + 8);
+    
+    const uint8_t* at = data + SNAPSHOT_HEADER_SIZE;
+    const uint8_t* end = data + size;
+    while (at < end && *at != 0) {
+        SavedGame game;
+        size_t used = decode_game(at, end, &game);
+        if (used == 0 || game.room >= room_count) {
+            return false;
+        }
+        at += used;
+        
+        // A room caught halfway through a move is left for the journal to settle
+        uint32_t x_moves = 0, o_moves = 0;
+        bool valid = true;
+        for (int row = 0; row < game.rows; row++) {
+            valid &= (game.row_bits[0][row] & game.row_bits[1][row]) == 0;
+            x_moves += __builtin_popcount(game.row_bits[0][row]);
+            o_moves += __builtin_popcount(game.row_bits[1][row]);
+        }
+        if (!valid || (x_moves != o_moves && x_moves != o_moves + 1)) {
+            continue;
+        }
+        game.moves = (uint16_t)(x_moves + o_moves);
+        game.live = true;
+        games[game.room] = game;
+        stats->snapshot_games++;
+    }
+    // Only a complete file ends with the end marker
+    return at < end;
+}
+
+static void apply_record(SavedGame* games, uint32_t room_count, const JournalRecord* record) {
+    if (record->type == JOURNAL_SESSION || record->room >= room_count) {
+        return;
+    }
+    SavedGame* game = &games[record->room];
+    
+    if (record->type == JOURNAL_START) {
+        memset(game, 0, sizeof(*game));
+        if (record->rows < 3 || record->rows > SNAPSHOT_MAX_SIDE ||
+            record->cols < 3 || record->cols > SNAPSHOT_MAX_SIDE) {
+            return;
+        }
+        game->room = record->room;
+        game->live = true;
+        game->rows = record->rows;
+        game->cols = record->cols;
+        game->k = record->k;
+        game->bot_level = record->bot_level;
+        game->tokens[0] = record->tokens[0];
+        game->tokens[1] = record->tokens[1];
+        return;
+    }
+    if (!game->live) {
+        return;
+    }
+    
+    if (record->type == JOURNAL_MOVE) {
+        // Moves the snapshot already holds come around again; a gap means
+        // records were dropped, and the game can no longer be trusted
+        if (record->ply < game->moves) {
+            return;
+        }
+        uint32_t row = record->value / game->cols;
+        uint32_t col = record->value % game->cols;
+        if (record->ply > game->moves || row >= game->rows ||
+            ((game->row_bits[0][row] | game->row_bits[1][row]) >> col) & 1) {
+            game->live = false;
+            return;
+        }
+        game->row_bits[game->moves & 1][row] |= 1u << col;
+        game->moves++;
+        return;
+    }
+    
+    // A result or an abandonment ends the game
+    game->live = false;
+}
+
+static size_t encode_game(const SavedGame* game, uint8_t* out) {
+    size_t length = 0;
+    out[length++] = 1;
+    length += journal_put_varint(out + length, game->room);
+    out[length++] = game->rows;
+    out[length++] = game->cols;
+    out[length++] = game->k;
+    out[length++] = game->bot_level;
+    put_u64(out + length, game->tokens[0]);
+    put_u64(out + length + 8, game->tokens[1]);
+    length += 16;
+    for (int row = 0; row < game->rows; row++) {
+        length += journal_put_varint(out + length, game->row_bits[0][row]);
+        length += journal_put_varint(out + length, game->row_bits[1][row]);
+    }
+    return length;
+}
+
+// Returns the bytes used, or 0 if the game is cut off or malformed
+static size_t decode_game(const uint8_t* in, const uint8_t* end, SavedGame* game) {
+    const uint8_t* at = in + 1;
+    uint64_t value;
+    size_t used;
+    memset(game, 0, sizeof(*game));
+    
+    if ((used = journal_get_varint(at, end, &value)) == 0 || end - (at + used) < 20) {
+        return 0;
+    }
+    game->room = (uint32_t)value;
+    at += used;
+    game->rows = at[0];
+    game->cols = at[1];
+    game->k = at[2];
+    game->bot_level = at[3];
+    game->tokens[0] = get_u64(at + 4);
+    game->tokens[1] = get_u64(at + 12);
+    at += 20;
+    if (game->rows < 3 || game->rows > SNAPSHOT_MAX_SIDE ||
+        game->cols < 3 || game->cols > SNAPSHOT_MAX_SIDE) {
+        return 0;
+    }
+    
+    for (int row = 0; row < game->rows; row++) {
+        for (int player = 0; player < 2; player++) {
+            if ((used = journal_get_varint(at, end, &value)) == 0 || value >> game->cols != 0) {
+                return 0;
+            }
+            game->row_bits[player][row] = (uint32_t)value;
+            at += used;
+        }
+    }
+    return at - in;
+}
+
+// Maps a whole file read-only. A missing or empty file gives NULL data.
+// Returns -1 after printing the error.
+static int map_file(const char* path, const uint8_t** data, size_t* size) {
+    *data = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror(path);
+        return -1;
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (info.st_size > 0) {
+        void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        *data = mapped;
+        *size = info.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+static void put_u64(uint8_t* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_u64(const uint8_t* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
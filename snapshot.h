@@ -0,0 +1,68 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Periodic snapshots of every running game, and recovery after a crash or
+// restart.
+//
+// A snapshot thread forks the server every interval. The child gets a
+// copy-on-write image of the room table, so it can walk and write out every
+// game at its leisure while the workers carry on; the parent only pays for
+// the fork itself. The file is written next to its final name and renamed
+// once complete, so a crash mid-snapshot leaves the previous one in place.
+//
+// The fork catches rooms wherever their workers happen to be, so a
+// snapshot alone may be slightly out of step. It records how much of the
+// journal had been synced when it was taken; recovery loads the snapshot and
+// then replays the journal from that point. Moves are numbered, so the ones
+// the snapshot already holds are recognized and skipped.
+//
+//   header    "TTTSNAP", version (1), journal offset (8, little-endian)
+//   game      1, room (varint), rows (1), cols (1), k (1), bot level (1),
+//             resume token of X and of O (8 each, little-endian),
+//             then for every row the cells of X and of O (varints, bit col)
+//   end       0
+
+#define SNAPSHOT_MAGIC "TTTSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_SIDE 19  // MAX_BOARD_SIZE of the server
+
+// One running game, as stored in a snapshot
+typedef struct {
+    uint32_t room;
+    bool live;           // Used while recovering: the game is still running
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t k;
+    uint8_t bot_level;
+    uint16_t moves;
+    uint64_t tokens[2];  // Resume token of X and of O, 0 for the bot
+    uint32_t row_bits[2][SNAPSHOT_MAX_SIDE];  // Cells of X and O, bit col of row
+} SavedGame;
+
+// Fills game with the game running in room and returns true, or returns
+// false if there is none. Called in the forked child, so it must not lock,
+// allocate or do anything else that is unsafe after fork.
+typedef bool (*SnapshotSource)(uint32_t room, SavedGame* game);
+
+typedef struct {
+    uint32_t snapshot_games;   // Games in the snapshot
+    uint64_t journal_offset;   // Where the journal tail began
+    uint64_t journal_records;  // Records replayed from the tail
+    uint32_t games;            // Games still running at the end
+} RecoveryStats;
+
+// Rebuilds the games that were running when the server stopped from the
+// snapshot at path and the journal after it. Returns the running games in
+// a new array of *count entries, in room order, or NULL after printing the
+// error. A missing snapshot replays the whole journal.
+SavedGame* snapshot_recover(const char* path, const char* journal_path, uint32_t room_count,
+                            uint32_t* count, RecoveryStats* stats);
+
+// Starts snapshotting rooms 0 .. room_count - 1 to path every interval_s
+// seconds. Returns -1 after printing the error.
+int snapshot_start(const char* path, int interval_s, uint32_t room_count, SnapshotSource source);
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel. Level 0 has one slot per tick for the next
+// TIMER_SLOTS ticks; every level above covers TIMER_SLOTS times the span of
+// the one below. Arming and cancelling are O(1) list operations, and a
+// timer on an upper level is moved down ("cascaded") once when its slot
+// comes up, so expiring timers never requires scanning all of them.
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+#define TIMER_MAX_DELTA ((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+#define TIMER_NONE UINT64_MAX  // timer_next_expiry() when nothing is armed
+
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer* prev;
+    uint64_t expires;  // Tick at which the timer fires
+    int slot;          // level * TIMER_SLOTS + slot index, -1 when not armed
+    int kind;          // Free for the owner, e.g. what id refers to
+    int id;
+} Timer;
+
+typedef struct {
+    uint64_t current;                    // Next tick to be run
+    uint64_t occupied[TIMER_LEVELS];     // Bit i is set if slot i holds timers
+    Timer slots[TIMER_LEVELS * TIMER_SLOTS];  // List heads, circular
+} TimerWheel;
+
+static inline void timer_wheel_init(TimerWheel* wheel, uint64_t now) {
+    wheel->current = now;
+    for (int i = 0; i < TIMER_LEVELS; i++) {
+        wheel->occupied[i] = 0;
+    }
+    for (int i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+        wheel->slots[i].slot = -1;
+    }
+}
+
+static inline void timer_init(Timer* timer, int kind, int id) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->slot = -1;
+    timer->kind = kind;
+    timer->id = id;
+}
+
+static inline void timer_cancel(TimerWheel* wheel, Timer* timer) {
+    if (timer->slot < 0) {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    
+    Timer* head = &wheel->slots[timer->slot];
+    if (head->next == head) {
+        wheel->occupied[timer->slot / TIMER_SLOTS] &= ~(1ULL << (timer->slot % TIMER_SLOTS));
+    }
+    timer->slot = -1;
+}
+
+// Files the timer under the level whose span covers its distance from now
+static inline void timer_link(TimerWheel* wheel, Timer* timer) {
+    if (timer->expires < wheel->current) {
+        timer->expires = wheel->current;
+    }
+    uint64_t delta = timer->expires - wheel->current;
+    if (delta > TIMER_MAX_DELTA) {
+        delta = TIMER_MAX_DELTA;
+        timer->expires = wheel->current + delta;
+    }
+    
+    int level = 0;
+    while (delta >= (1ULL << (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+    int index = (int)((timer->expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1));
+    
+    Timer* head = &wheel->slots[level * TIMER_SLOTS + index];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->slot = level * TIMER_SLOTS + index;
+    wheel->occupied[level] |= 1ULL << index;
+}
+
+// Arms the timer for the given tick, moving it if it was already armed.
+// Re-arming for the same tick is free.
+static inline void timer_arm(TimerWheel* wheel, Timer* timer, uint64_t expires) {
+    if (timer->slot >= 0) {
+        if (timer->expires == expires) {
+            return;
+        }
+        timer_cancel(wheel, timer);
+    }
+    timer->expires = expires;
+    timer_link(wheel, timer);
+}
+
+// Moves a whole slot onto a list of its own, leaving the slot empty
+static inline void timer_take_slot(TimerWheel* wheel, int slot, Timer* list) {
+    Timer* head = &wheel->slots[slot];
+    if (head->next == head) {
+        list->next = list;
+        list->prev = list;
+    } else {
+        list->next = head->next;
+        list->prev = head->prev;
+        list->next->prev = list;
+        list->prev->next = list;
+        head->next = head;
+        head->prev = head;
+    }
+    wheel->occupied[slot / TIMER_SLOTS] &= ~(1ULL << (slot % TIMER_SLOTS));
+}
+
+// Earliest tick at which timer_run() has work to do: a level 0 timer
+// expiring, or an upper level slot due to be cascaded. TIMER_NONE if empty.
+static inline uint64_t timer_next_expiry(const TimerWheel* wheel) {
+    uint64_t next = TIMER_NONE;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0) {
+            continue;
+        }
+        
+        // First block of this level whose cascade (or expiry) is still ahead
+        int shift = TIMER_BITS * level;
+        uint64_t block = (wheel->current + (1ULL << shift) - 1) >> shift;
+        int index = (int)(block & (TIMER_SLOTS - 1));
+        uint64_t rotated = (bits >> index) | (index ? bits << (TIMER_SLOTS - index) : 0);
+        uint64_t tick = (block + __builtin_ctzll(rotated)) << shift;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+// Runs every tick up to and including now, calling expire() for each timer
+// that comes due. Ticks with nothing to do are skipped. expire() may arm or
+// cancel any timer, including the one it was called for.
+static inline void timer_run(TimerWheel* wheel, uint64_t now, void (*expire)(Timer*)) {
+    while (wheel->current <= now) {
+        uint64_t tick = timer_next_expiry(wheel);
+        if (tick > now) {
+            wheel->current = now + 1;
+            return;
+        }
+        if (tick < wheel->current) {
+            tick = wheel->current;
+        }
+        wheel->current = tick;
+        
+        // Bring down every upper level slot that starts at this tick
+        Timer list;
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            int shift = TIMER_BITS * level;
+            if (tick & ((1ULL << shift) - 1)) {
+                break;
+            }
+            int index = (int)((tick >> shift) & (TIMER_SLOTS - 1));
+            timer_take_slot(wheel, level * TIMER_SLOTS + index, &list);
+            while (list.next != &list) {
+                Timer* timer = list.next;
+                list.next = timer->next;
+                timer->next->prev = &list;
+                timer_link(wheel, timer);
+            }
+        }
+        
+        // Detach this tick's timers first so that timers armed by expire()
+        // land in a later slot instead of the list being walked
+        timer_take_slot(wheel, (int)(tick & (TIMER_SLOTS - 1)), &list);
+        wheel->current = tick + 1;
+        while (list.next != &list) {
+            Timer* timer = list.next;
+            list.next = timer->next;
+            timer->next->prev = &list;
+            timer->slot = -1;
+            expire(timer);
+        }
+    }
+}
+
+#endif
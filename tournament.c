@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "game.h"
+#include "deque.h"
+
+#define MAX_THREADS 64
+#define DEQUE_SIZE 1024      // Tasks one thread can have waiting, far more than splitting makes
+#define DEFAULT_GAMES 250000 // Per ordered pair of strategies
+#define DEFAULT_GRAIN 4096   // Games a task is split down to
+
+// How a game ended, as indices into the result matrices
+#define OUTCOME_X_WINS 0
+#define OUTCOME_DRAW 1
+#define OUTCOME_O_WINS 2
+
+// A bot strategy: the server's bot at one difficulty, or random moves
+typedef struct {
+    const char* name;
+    int level;   // BOT_NONE for random moves
+} Strategy;
+
+const Strategy strategies[] = {
+    { "random", BOT_NONE },
+    { "easy", BOT_EASY },
+    { "medium", BOT_MEDIUM },
+    { "hard", BOT_HARD },
+};
+#define STRATEGY_COUNT ((int)(sizeof(strategies) / sizeof(strategies[0])))
+
+// One thread with its own deque of tasks and its own result matrices, so
+// that counting a game touches nothing another thread writes. A task is
+// (pairing << 32 | games), pairing being x * STRATEGY_COUNT + o.
+typedef struct {
+    _Alignas(64) int id;
+    pthread_t thread;
+    Deque tasks;
+    uint64_t results[STRATEGY_COUNT][STRATEGY_COUNT][3];  // [x][o][outcome]
+    long games;
+    long tasks_run;
+    long steals;
+    uint64_t elapsed_ns;
+} Worker;
+
+// Settings
+long games_per_pairing = DEFAULT_GAMES;
+long grain = DEFAULT_GRAIN;
+int thread_count = 0;
+
+Worker workers[MAX_THREADS];
+pthread_barrier_t start_barrier;
+_Atomic long games_left;  // Counted down as tasks finish; the threads stop at 0
+
+// Function prototypes
+uint64_t now_ns();
+void* run_worker(void* arg);
+bool find_task(Worker* worker, uint64_t* task);
+void run_task(Worker* worker, uint64_t task);
+int play_game(int x, int o);
+int choose_cell(Board* board, int level);
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:g:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                games_per_pairing = atol(optarg);
+                break;
+            case 'g':
+                grain = atol(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n games_per_pairing] [-g grain] [-t threads]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (thread_count == 0) {
+        thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = thread_count < 1 ? 1 : thread_count > MAX_THREADS ? MAX_THREADS : thread_count;
+    }
+    if (thread_count < 1 || thread_count > MAX_THREADS || games_per_pairing < 1 ||
+        games_per_pairing > UINT32_MAX || grain < 1) {
+        fprintf(stderr, "Need 1 to %d threads, a grain of at least 1 and 1 to %u games per pairing\n",
+                MAX_THREADS, UINT32_MAX);
+        exit(EXIT_FAILURE);
+    }
+    game_init();
+    
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].id = i;
+        if (deque_init(&workers[i].tasks, DEQUE_SIZE) < 0) {
+            perror("Failed to allocate task deque");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Every pairing starts out as one task on the first thread; the others
+    // get their work by stealing, and each steal takes half of what is left
+    int pairings = STRATEGY_COUNT * STRATEGY_COUNT;
+    for (int pairing = 0; pairing < pairings; pairing++) {
+        deque_push(&workers[0].tasks, (uint64_t)pairing << 32 | (uint64_t)games_per_pairing);
+    }
+    atomic_init(&games_left, games_per_pairing * pairings);
+    
+    pthread_barrier_init(&start_barrier, NULL, thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // The matrices are only added up once every thread is done with its own
+    uint64_t results[STRATEGY_COUNT][STRATEGY_COUNT][3];
+    memset(results, 0, sizeof(results));
+    uint64_t slowest = 0;
+    long games = 0, tasks_run = 0, steals = 0;
+    long fewest = -1, most = 0;
+    for (int i = 0; i < thread_count; i++) {
+        Worker* worker = &workers[i];
+        pthread_join(worker->thread, NULL);
+        for (int x = 0; x < STRATEGY_COUNT; x++) {
+            for (int o = 0; o < STRATEGY_COUNT; o++) {
+                for (int outcome = 0; outcome < 3; outcome++) {
+                    results[x][o][outcome] += worker->results[x][o][outcome];
+                }
+            }
+        }
+        games += worker->games;
+        tasks_run += worker->tasks_run;
+        steals += worker->steals;
+        fewest = fewest < 0 || worker->games < fewest ? worker->games : fewest;
+        most = worker->games > most ? worker->games : most;
+        if (worker->elapsed_ns > slowest) {
+            slowest = worker->elapsed_ns;
+        }
+        deque_destroy(&worker->tasks);
+    }
+    
+    printf("Games:     %ld per pairing of %d strategies on %d threads\n",
+           games_per_pairing, STRATEGY_COUNT, thread_count);
+    printf("Played:    %ld in %.3f s, %.2f M games/s, %.0f games/s per core\n",
+           games, slowest / 1e9, games / (slowest / 1e3), games / (slowest / 1e9) / thread_count);
+    printf("Tasks:     %ld run, %ld stolen; %ld to %ld games per thread\n",
+           tasks_run, steals, fewest, most);
+    printf("\nX wins / draws / O wins in percent, X down the side, O across the top\n\n%-8s", "");
+    for (int o = 0; o < STRATEGY_COUNT; o++) {
+        printf("  %-16s", strategies[o].name);
+    }
+    printf("\n");
+    for (int x = 0; x < STRATEGY_COUNT; x++) {
+        printf("%-8s", strategies[x].name);
+        for (int o = 0; o < STRATEGY_COUNT; o++) {
+            uint64_t* counts = results[x][o];
+            double total = (double)(counts[0] + counts[1] + counts[2]) / 100;
+            printf("  %4.1f/%4.1f/%4.1f  ", counts[OUTCOME_X_WINS] / total,
+                   counts[OUTCOME_DRAW] / total, counts[OUTCOME_O_WINS] / total);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void* run_worker(void* arg) {
+    Worker* worker = arg;
+    random_state = now_ns() * 0x9E3779B97F4A7C15ULL + worker->id + 1;
+    
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    uint64_t task;
+    while (atomic_load_explicit(&games_left, memory_order_acquire) > 0) {
+        if (find_task(worker, &task)) {
+            run_task(worker, task);
+        } else {
+            sched_yield();
+        }
+    }
+    worker->elapsed_ns = now_ns() - start;
+    return NULL;
+}
+
+bool find_task(Worker* worker, uint64_t* task) {
+    if (deque_pop(&worker->tasks, task)) {
+        return true;
+    }
+    
+    // Out of work: try every other thread once, starting at a random one
+    int first = (int)random_below(thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        Worker* victim = &workers[(first + i) % thread_count];
+        if (victim == worker) {
+            continue;
+        }
+        int stolen;
+        while ((stolen = deque_steal(&victim->tasks, task)) < 0) {
+            // Lost a race for it; the deque may still hold more
+        }
+        if (stolen) {
+            worker->steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void run_task(Worker* worker, uint64_t task) {
+    int pairing = (int)(task >> 32);
+    long games = (long)(uint32_t)task;
+    
+    // Leave half of a big task where a thread out of work can steal it
+    while (games > grain) {
+        long half = games / 2;
+        if (!deque_push(&worker->tasks, (uint64_t)pairing << 32 | (uint64_t)half)) {
+            break;
+        }
+        games -= half;
+    }
+    
+    int x = pairing / STRATEGY_COUNT;
+    int o = pairing % STRATEGY_COUNT;
+    uint64_t* counts = worker->results[x][o];
+    for (long i = 0; i < games; i++) {
+        counts[play_game(x, o)]++;
+    }
+    worker->games += games;
+    worker->tasks_run++;
+    atomic_fetch_sub_explicit(&games_left, games, memory_order_release);
+}
+
+// Plays one game between strategy x (as X) and strategy o, through the
+// same rules as the server
+int play_game(int x, int o) {
+    Board board = { { 0, 0 }, 0 };
+    int levels[2] = { strategies[x].level, strategies[o].level };
+    while (1) {
+        int cell = choose_cell(&board, levels[board.current_player]);
+        make_move(&board, cell / 3, cell % 3, board.current_player);
+        if (check_win(&board)) {
+            return board.current_player == 0 ? OUTCOME_X_WINS : OUTCOME_O_WINS;
+        }
+        if (check_draw(&board)) {
+            return OUTCOME_DRAW;
+        }
+        board.current_player = 1 - board.current_player;
+    }
+}
+
+int choose_cell(Board* board, int level) {
+    if (level != BOT_NONE) {
+        return choose_bot_move(board, level);
+    }
+    
+    // Any free cell: skip a random number of them
+    uint32_t free_cells = ~(board->marks[0] | board->marks[1]) & 0x1FF;
+    for (uint32_t skip = random_below(__builtin_popcount(free_cells)); skip > 0; skip--) {
+        free_cells &= free_cells - 1;
+    }
+    return __builtin_ctz(free_cells);
+}
@@ -0,0 +1,210 @@
+#ifndef NO_TRACE
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_RING_SIZE 16384     // Records per thread, a power of two
+#define TRACE_MAX_THREADS 128
+#define TRACE_DRAIN_INTERVAL_MS 100
+
+// Written by one thread, read by the drain thread
+typedef struct {
+    _Alignas(64) _Atomic uint64_t head;  // Next record to write
+    _Alignas(64) _Atomic uint64_t tail;  // Next record to drain
+    _Atomic uint64_t dropped;            // Records lost to a full ring
+    uint64_t reported;                   // Part of dropped already noted in the file
+    uint16_t index;                      // Position in rings[]
+    TraceRecord records[TRACE_RING_SIZE];
+} TraceRing;
+
+_Atomic int trace_level = TRACE_OFF;
+
+static _Atomic(TraceRing*) rings[TRACE_MAX_THREADS];  // NULL until the ring is ready
+static _Atomic int ring_count = 0;
+static __thread TraceRing* ring;  // Calling thread's ring, created on its first record
+static __thread bool ring_failed;
+
+static FILE* trace_file = NULL;
+static pthread_t drain_thread;
+static _Atomic bool stopping = false;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_requested = PTHREAD_COND_INITIALIZER;
+
+static void* run_drain(void* arg);
+static void drain_rings();
+static TraceRing* create_ring();
+static uint64_t realtime_ns();
+
+int trace_open(const char* path, int level) {
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+    
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    fwrite(&header, sizeof(header), 1, trace_file);
+    
+    // SIGINT must never land on the drain thread, which the server's
+    // shutdown joins, so it starts with the signal blocked
+    sigset_t interrupt, previous;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, &previous);
+    int started = pthread_create(&drain_thread, NULL, run_drain, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (started != 0) {
+        perror("Failed to start trace thread");
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    atomic_store(&trace_level, level);
+    return 0;
+}
+
+void trace_close() {
+    if (trace_file == NULL) {
+        return;
+    }
+    atomic_store(&trace_level, TRACE_OFF);
+    pthread_mutex_lock(&stop_lock);
+    atomic_store(&stopping, true);
+    pthread_cond_signal(&stop_requested);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(drain_thread, NULL);
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+void trace_write(int type, int room, int fd, uint32_t a, uint64_t b) {
+    if (ring == NULL) {
+        if (ring_failed) {
+            return;
+        }
+        ring = create_ring();
+        if (ring == NULL) {
+            ring_failed = true;
+            return;
+        }
+    }
+    
+    // Only this thread moves head, so the drain thread is the only one racing us
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    
+    TraceRecord* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->time_ns = realtime_ns();
+    record->b = b;
+    record->room = room;
+    record->fd = fd;
+    record->a = a;
+    record->type = (uint16_t)type;
+    record->thread = ring->index;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static TraceRing* create_ring() {
+    int index = atomic_fetch_add(&ring_count, 1);
+    if (index >= TRACE_MAX_THREADS) {
+        atomic_fetch_sub(&ring_count, 1);
+        return NULL;
+    }
+    
+    TraceRing* created = calloc(1, sizeof(TraceRing));
+    if (created != NULL) {
+        created->index = (uint16_t)index;
+    }
+    atomic_store_explicit(&rings[index], created, memory_order_release);
+    return created;
+}
+
+static void* run_drain(void* arg) {
+    (void)arg;
+    
+    // trace_close cuts the wait short, so that closing is immediate
+    pthread_mutex_lock(&stop_lock);
+    while (!atomic_load(&stopping)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += TRACE_DRAIN_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_clockwait(&stop_requested, &stop_lock, CLOCK_MONOTONIC, &deadline);
+        pthread_mutex_unlock(&stop_lock);
+        drain_rings();
+        pthread_mutex_lock(&stop_lock);
+    }
+    pthread_mutex_unlock(&stop_lock);
+    drain_rings();
+    fflush(trace_file);
+    return NULL;
+}
+
+static void drain_rings() {
+    int count = atomic_load(&ring_count);
+    if (count > TRACE_MAX_THREADS) {
+        count = TRACE_MAX_THREADS;
+    }
+    for (int i = 0; i < count; i++) {
+        TraceRing* r = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (r == NULL) {
+            continue;
+        }
+        
+        // Everything before head is complete; write it in at most two pieces
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        while (tail != head) {
+            uint64_t start = tail & (TRACE_RING_SIZE - 1);
+            uint64_t length = head - tail;
+            if (start + length > TRACE_RING_SIZE) {
+                length = TRACE_RING_SIZE - start;
+            }
+            fwrite(&r->records[start], sizeof(TraceRecord), length, trace_file);
+            tail += length;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+        
+        uint64_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (dropped != r->reported) {
+            TraceRecord lost;
+            memset(&lost, 0, sizeof(lost));
+            lost.time_ns = realtime_ns();
+            lost.room = -1;
+            lost.fd = -1;
+            lost.a = (uint32_t)(dropped - r->reported);
+            lost.type = TRACE_LOST;
+            lost.thread = (uint16_t)i;
+            fwrite(&lost, sizeof(lost), 1, trace_file);
+            r->reported = dropped;
+        }
+    }
+    fflush(trace_file);
+}
+
+static uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
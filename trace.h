@@ -0,0 +1,120 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Binary event trace.
+//
+// Each thread writes fixed-size records into a ring of its own, so tracing
+// an event is a bounds check and a 32-byte store with no locks and no
+// system calls. A background thread drains every ring to the trace file
+// a few times per second; ttt_tracedump turns the file back into text.
+// When a ring is full, records are dropped and counted instead of making
+// the event loop wait, and the drain thread notes the loss in the file.
+//
+// Building with -DNO_TRACE (make TRACE=0) compiles every TRACE() away.
+
+#define TRACE_MAGIC "TTTTRACE"
+#define TRACE_VERSION 1
+
+// Verbosity: a record is kept when its level is at most trace_level
+#define TRACE_OFF 0
+#define TRACE_EVENTS 1    // Connections, seats, games, timeouts, errors
+#define TRACE_MESSAGES 2  // Plus every command, frame, move and raw packet
+
+// Event types, with what room, fd, a and b hold
+#define TRACE_CONNECT 1        // fd; a = IPv4 address, network order; b = port
+#define TRACE_SEATED 2         // room, fd; a = seat
+#define TRACE_MESSAGE 3        // room, fd; a = length; b = first 8 bytes of the line
+#define TRACE_FRAME 4          // room, fd; a = frame type; b = cell | seq << 16
+#define TRACE_MOVE 5           // room, fd; a = row << 8 | col; b = player
+#define TRACE_GAME_OVER 6      // room; a = result code from protocol.h
+#define TRACE_DISCONNECT 7     // room, fd
+#define TRACE_IDLE_TIMEOUT 8   // fd
+#define TRACE_ROOM_TIMEOUT 9   // room
+#define TRACE_OVERFLOW 10      // fd; a = output high-water mark
+#define TRACE_SEND_ERROR 11    // fd; a = errno
+#define TRACE_RAW_PACKET 12    // a = source IPv4 address, network order; b = source port
+#define TRACE_LOST 13          // Written by the drain thread; a = records dropped
+#define TRACE_RESUME 14        // room, fd; a = seat taken back with a resume token
+#define TRACE_HOLD 15          // room, fd; a = seat held for the player who dropped; b = seconds
+#define TRACE_GRACE_EXPIRED 16 // room; a held seat was not taken back in time
+#define TRACE_SPECTATE 17      // room, fd; the connection started watching the room
+#define TRACE_TYPE_COUNT 18
+
+typedef struct {
+    uint64_t time_ns;  // CLOCK_REALTIME
+    uint64_t b;
+    int32_t room;      // -1 if none
+    int32_t fd;        // -1 if none
+    uint32_t a;
+    uint16_t type;
+    uint16_t thread;   // Ring the record came from, one per tracing thread
+} TraceRecord;
+
+// Start of every trace file, followed by records until the end
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceHeader;
+
+// Packs the start of a text into a record's b field
+static inline uint64_t trace_text(const char* text, size_t length) {
+    uint64_t packed = 0;
+    memcpy(&packed, text, length < sizeof(packed) ? length : sizeof(packed));
+    return packed;
+}
+
+#ifndef NO_TRACE
+
+extern _Atomic int trace_level;
+
+#define TRACE(level, type, room, fd, a, b)                                        \
+    do {                                                                          \
+        if (atomic_load_explicit(&trace_level, memory_order_relaxed) >= (level)) { \
+            trace_write((type), (room), (fd), (a), (b));                          \
+        }                                                                         \
+    } while (0)
+
+// Creates the trace file and starts the drain thread. Returns -1 after
+// printing the error.
+int trace_open(const char* path, int level);
+
+// Writes out whatever is still buffered and closes the file
+void trace_close();
+
+void trace_write(int type, int room, int fd, uint32_t a, uint64_t b);
+
+// Whether records of the level are kept, for callers that must do work to
+// fill one in
+static inline int trace_on(int level) {
+    return atomic_load_explicit(&trace_level, memory_order_relaxed) >= level;
+}
+
+#else
+
+// Arguments are type-checked but never evaluated
+#define TRACE(level, type, room, fd, a, b) \
+    ((void)sizeof((level) + (type) + (room) + (fd) + (a) + (b)))
+
+static inline int trace_open(const char* path, int level) {
+    (void)path;
+    (void)level;
+    return 0;
+}
+
+static inline void trace_close() {
+}
+
+static inline int trace_on(int level) {
+    (void)level;
+    return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "trace.h"
+
+// Settings
+int room_filter = -1;
+int fd_filter = -1;
+bool summary_only = false;
+
+const char* type_names[TRACE_TYPE_COUNT] = {
+    "?", "connect", "seated", "message", "frame", "move", "game-over", "disconnect",
+    "idle-timeout", "room-timeout", "overflow", "send-error", "raw-packet", "lost",
+    "resume", "hold", "grace-expired", "spectate"
+};
+
+// Function prototypes
+TraceRecord* read_trace(const char* path, size_t* count);
+int compare_records(const void* left, const void* right);
+void print_record(TraceRecord* record);
+void print_details(TraceRecord* record);
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:f:s")) != -1) {
+        switch (opt) {
+            case 'r':
+                room_filter = atoi(optarg);
+                break;
+            case 'f':
+                fd_filter = atoi(optarg);
+                break;
+            case 's':
+                summary_only = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r room] [-f fd] [-s] <trace_file>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-r room] [-f fd] [-s] <trace_file>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    size_t count;
+    TraceRecord* records = read_trace(argv[optind], &count);
+    
+    // Each thread's records are in order, but the drain thread writes the
+    // rings one after another, so merge them by time
+    qsort(records, count, sizeof(TraceRecord), compare_records);
+    
+    uint64_t totals[TRACE_TYPE_COUNT] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        TraceRecord* record = &records[i];
+        if ((room_filter >= 0 && record->room != room_filter) ||
+            (fd_filter >= 0 && record->fd != fd_filter)) {
+            continue;
+        }
+        totals[record->type < TRACE_TYPE_COUNT ? record->type : 0]++;
+        if (!summary_only) {
+            print_record(record);
+        }
+    }
+    
+    if (summary_only) {
+        for (int type = 0; type < TRACE_TYPE_COUNT; type++) {
+            if (totals[type] > 0) {
+                printf("%-14s %llu\n", type_names[type], (unsigned long long)totals[type]);
+            }
+        }
+    }
+    free(records);
+    return 0;
+}
+
+TraceRecord* read_trace(const char* path, size_t* count) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("Failed to open trace file");
+        exit(EXIT_FAILURE);
+    }
+    
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Unsupported trace version %u\n", header.version);
+        exit(EXIT_FAILURE);
+    }
+    
+    size_t capacity = 4096;
+    size_t used = 0;
+    TraceRecord* records = malloc(capacity * sizeof(TraceRecord));
+    while (records != NULL) {
+        used += fread(records + used, sizeof(TraceRecord), capacity - used, file);
+        if (used < capacity) {
+            break;
+        }
+        capacity *= 2;
+        records = realloc(records, capacity * sizeof(TraceRecord));
+    }
+    if (records == NULL) {
+        perror("Failed to allocate records");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    *count = used;
+    return records;
+}
+
+int compare_records(const void* left, const void* right) {
+    const TraceRecord* a = left;
+    const TraceRecord* b = right;
+    if (a->time_ns != b->time_ns) {
+        return a->time_ns < b->time_ns ? -1 : 1;
+    }
+    return a < b ? -1 : a > b;
+}
+
+void print_record(TraceRecord* record) {
+    time_t seconds = record->time_ns / 1000000000ULL;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char clock[16];
+    strftime(clock, sizeof(clock), "%H:%M:%S", &local);
+    
+    printf("%s.%06llu t%-2u %-13s", clock,
+           (unsigned long long)(record->time_ns % 1000000000ULL / 1000), record->thread,
+           type_names[record->type < TRACE_TYPE_COUNT ? record->type : 0]);
+    if (record->room >= 0) {
+        printf(" room %d", record->room);
+    }
+    if (record->fd >= 0) {
+        printf(" fd %d", record->fd);
+    }
+    print_details(record);
+    printf("\n");
+}
+
+void print_details(TraceRecord* record) {
+    char address[INET_ADDRSTRLEN];
+    switch (record->type) {
+        case TRACE_CONNECT:
+        case TRACE_RAW_PACKET:
+            inet_ntop(AF_INET, &record->a, address, sizeof(address));
+            printf(" from %s:%llu", address, (unsigned long long)record->b);
+            break;
+        case TRACE_SEATED:
+        case TRACE_RESUME:
+            printf(" as Player %u", record->a + 1);
+            break;
+        case TRACE_HOLD:
+            printf(" Player %u for %llu s", record->a + 1, (unsigned long long)record->b);
+            break;
+        case TRACE_MESSAGE: {
+            // Only the first 8 bytes are kept
+            char text[9];
+            uint32_t length = record->a < 8 ? record->a : 8;
+            memcpy(text, &record->b, length);
+            for (uint32_t i = 0; i < length; i++) {
+                if (text[i] < 32 || text[i] > 126) {
+                    text[i] = '.';
+                }
+            }
+            text[length] = '\0';
+            printf(" \"%s%s\" (%u bytes)", text, record->a > 8 ? "..." : "", record->a);
+            break;
+        }
+        case TRACE_FRAME:
+            printf(" type %u cell %llu seq %llu", record->a,
+                   (unsigned long long)(record->b & 0xFFFF), (unsigned long long)(record->b >> 16));
+            break;
+        case TRACE_MOVE:
+            printf(" Player %llu at (%u,%u)", (unsigned long long)record->b + 1,
+                   record->a >> 8, record->a & 0xFF);
+            break;
+        case TRACE_GAME_OVER:
+            printf(" result %u", record->a);
+            break;
+        case TRACE_OVERFLOW:
+            printf(" queued output passed %u bytes", record->a);
+            break;
+        case TRACE_SEND_ERROR:
+            printf(" %s", strerror((int)record->a));
+            break;
+        case TRACE_LOST:
+            printf(" %u records dropped, ring full", record->a);
+            break;
+    }
+}
@@ -0,0 +1,139 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "tt.h"
+#include "game.h"
+
+#define TT_SIZE (1 << TT_BITS)
+#define TT_MAX_PROBE 32
+#define TT_FILLED (1ULL << 31)  // Set in every stored entry, so 0 means empty
+
+// Entries are key << 32 | TT_FILLED | values, with values in canonical orientation
+static _Atomic uint64_t table[TT_SIZE];
+static _Atomic int stored = 0;
+
+static uint32_t unmap[8][3][64];        // Canonical values of 3 cells back in board orientation
+
+static uint32_t solve(uint16_t x, uint16_t o);
+static uint32_t lookup(uint32_t key);
+
+void tt_init() {
+    // The symmetries are game.c's, so only the way back is built here
+    for (int s = 0; s < 8; s++) {
+        // Cell c of the board holds the value of canonical cell symmetry_cell_map[s][c]
+        for (int chunk = 0; chunk < 3; chunk++) {
+            for (int bits = 0; bits < 64; bits++) {
+                uint32_t values = 0;
+                for (int cell = 0; cell < 9; cell++) {
+                    int from = symmetry_cell_map[s][cell] - chunk * 3;
+                    if (from >= 0 && from < 3) {
+                        values |= ((bits >> (from * 2)) & 3) << (cell * 2);
+                    }
+                }
+                unmap[s][chunk][bits] = values;
+            }
+        }
+    }
+}
+
+uint32_t tt_canonical(uint16_t x, uint16_t o, int* symmetry) {
+    uint32_t key = UINT32_MAX;
+    int best = 0;
+    for (int s = 0; s < 8; s++) {
+        uint32_t candidate = symmetry_transform[s][x] | (uint32_t)symmetry_transform[s][o] << 9;
+        if (candidate < key) {
+            key = candidate;
+            best = s;
+        }
+    }
+    if (symmetry != NULL) {
+        *symmetry = best;
+    }
+    return key;
+}
+
+uint32_t tt_analyze(uint16_t x, uint16_t o) {
+    int symmetry;
+    uint32_t key = tt_canonical(x, o, &symmetry);
+    uint32_t canonical = lookup(key);
+    
+    // Turn the values back into the board's own orientation, 3 cells at a time
+    return unmap[symmetry][0][canonical & 63] |
+           unmap[symmetry][1][(canonical >> 6) & 63] |
+           unmap[symmetry][2][(canonical >> 12) & 63];
+}
+
+int tt_size() {
+    return atomic_load_explicit(&stored, memory_order_relaxed);
+}
+
+// Values of every cell of a canonical position, in its own orientation
+static uint32_t solve(uint16_t x, uint16_t o) {
+    bool x_to_move = __builtin_popcount(x) == __builtin_popcount(o);
+    uint32_t values = 0;
+    for (int cell = 0; cell < 9; cell++) {
+        uint16_t bit = 1 << cell;
+        if ((x | o) & bit) {
+            continue;
+        }
+        uint16_t nx = x_to_move ? x | bit : x;
+        uint16_t no = x_to_move ? o : o | bit;
+        
+        uint32_t value;
+        if (has_line(x_to_move ? nx : no)) {
+            value = TT_VALUE_WIN;
+        } else if ((nx | no) == 0x1FF) {
+            value = TT_VALUE_DRAW;
+        } else {
+            // The move is worth the opposite of the opponent's best reply
+            uint32_t replies = lookup(tt_canonical(nx, no, NULL));
+            uint32_t best = TT_VALUE_LOSS;
+            for (int i = 0; i < 9; i++) {
+                uint32_t reply = (replies >> (i * 2)) & 3;
+                if (reply > best) {
+                    best = reply;
+                }
+            }
+            value = TT_VALUE_WIN + TT_VALUE_LOSS - best;
+        }
+        values |= value << (cell * 2);
+    }
+    return values;
+}
+
+static uint32_t lookup(uint32_t key) {
+    uint32_t slot = (key * 0x9E3779B1u) >> (32 - TT_BITS);
+    uint32_t values = 0;
+    bool solved = false;
+    
+    for (int probe = 0; probe < TT_MAX_PROBE; probe++) {
+        uint64_t entry = atomic_load_explicit(&table[slot], memory_order_acquire);
+        if (entry != 0 && (uint32_t)(entry >> 32) == key) {
+            return (uint32_t)entry & ~(uint32_t)TT_FILLED;
+        }
+        
+        if (entry == 0) {
+            // Not stored yet: solve it, then claim this slot. Another thread
+            // may get there first, with the same key or a different one.
+            if (!solved) {
+                values = solve(key & 0x1FF, key >> 9);
+                solved = true;
+            }
+            uint64_t filled = (uint64_t)key << 32 | TT_FILLED | values;
+            if (atomic_compare_exchange_strong_explicit(&table[slot], &entry, filled,
+                                                        memory_order_release,
+                                                        memory_order_acquire)) {
+                atomic_fetch_add_explicit(&stored, 1, memory_order_relaxed);
+                return values;
+            }
+            if ((uint32_t)(entry >> 32) == key) {
+                return values;
+            }
+        }
+        slot = (slot + 1) & (TT_SIZE - 1);
+    }
+    
+    // Probe limit reached: still answer, just without remembering it
+    return solved ? values : solve(key & 0x1FF, key >> 9);
+}
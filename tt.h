@@ -0,0 +1,39 @@
+#ifndef TT_H
+#define TT_H
+
+#include <stdint.h>
+
+// Transposition table of solved positions, shared by every room and thread.
+//
+// Positions are keyed by their canonical form, the smallest encoding of
+// x | o << 9 over the 8 rotations and reflections of the board, so all
+// symmetric boards share one entry. Entries are filled lazily the first
+// time a position (or one of its successors) is analysed. Each entry is a
+// single 64-bit word written with one compare-and-swap, so lookups take no
+// locks and never see a half-written entry.
+
+// Value of a move for the player making it, 2 bits per cell
+#define TT_VALUE_TAKEN 0
+#define TT_VALUE_LOSS 1
+#define TT_VALUE_DRAW 2
+#define TT_VALUE_WIN 3
+
+#define TT_BITS 12  // Table slots as a power of two, well above the 627 live positions
+
+// Builds the tables that turn values back out of canonical orientation;
+// call once, after game_init(), before any other tt_ function
+void tt_init();
+
+// Values of every cell for the player to move on the board with X on the
+// cells in x and O on the cells in o, as seen in the board's own orientation.
+// Cell i is at bits 2i and 2i+1. The game must not be over yet.
+uint32_t tt_analyze(uint16_t x, uint16_t o);
+
+// Smallest encoding of the board over all symmetries. If symmetry is not
+// NULL it receives the symmetry that produces it.
+uint32_t tt_canonical(uint16_t x, uint16_t o, int* symmetry);
+
+// Positions stored so far
+int tt_size();
+
+#endif
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "tt.h"
+#include "game.h"
+
+#define MAX_THREADS 64
+#define MAX_POSITIONS 6000  // Reachable boards, finished or not, number 5478
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    uint64_t elapsed_ns;
+    uint32_t checksum;  // Keeps the lookups from being optimized away
+} Worker;
+
+// Settings
+long lookup_count = 10000000;
+int thread_count = 1;
+
+// Every position a game can reach that is not over yet
+uint16_t position_x[MAX_POSITIONS];
+uint16_t position_o[MAX_POSITIONS];
+int position_count = 0;
+bool seen[1 << 18];
+
+Worker workers[MAX_THREADS];
+pthread_barrier_t start_barrier;
+
+// Function prototypes
+uint64_t now_ns();
+void collect_positions(uint16_t x, uint16_t o, bool x_to_move);
+void* run_worker(void* arg);
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        switch (opt) {
+            case 'n':
+                lookup_count = atol(optarg);
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n lookups_per_thread] [-t threads]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (thread_count < 1 || thread_count > MAX_THREADS || lookup_count < 1) {
+        fprintf(stderr, "Need 1 to %d threads and at least one lookup\n", MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    
+    game_init();
+    tt_init();
+    collect_positions(0, 0, true);
+    
+    // First pass fills the table, solving each position once
+    uint32_t checksum = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < position_count; i++) {
+        checksum ^= tt_analyze(position_x[i], position_o[i]);
+    }
+    uint64_t cold_ns = now_ns() - start;
+    
+    // Then every thread looks up random positions in the shared table
+    pthread_barrier_init(&start_barrier, NULL, thread_count);
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Failed to start worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    uint64_t slowest = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        checksum ^= workers[i].checksum;
+        if (workers[i].elapsed_ns > slowest) {
+            slowest = workers[i].elapsed_ns;
+        }
+    }
+    
+    printf("Positions: %d boards, %d canonical entries stored\n", position_count, tt_size());
+    printf("Cold fill: %.1f us for all boards (%.1f ns per board)\n",
+           cold_ns / 1e3, (double)cold_ns / position_count);
+    printf("Lookups:   %ld per thread on %d threads, %.1f ns per lookup, %.1f M/s total\n",
+           lookup_count, thread_count, (double)slowest / lookup_count,
+           lookup_count * thread_count / (slowest / 1e3));
+    printf("Checksum:  %08x\n", checksum);
+    return 0;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void collect_positions(uint16_t x, uint16_t o, bool x_to_move) {
+    uint32_t index = x | (uint32_t)o << 9;
+    if (seen[index] || has_line(x) || has_line(o) || (x | o) == 0x1FF) {
+        return;
+    }
+    seen[index] = true;
+    position_x[position_count] = x;
+    position_o[position_count] = o;
+    position_count++;
+    
+    for (int cell = 0; cell < 9; cell++) {
+        uint16_t bit = 1 << cell;
+        if (!((x | o) & bit)) {
+            collect_positions(x_to_move ? x | bit : x, x_to_move ? o : o | bit, !x_to_move);
+        }
+    }
+}
+
+void* run_worker(void* arg) {
+    Worker* worker = arg;
+    uint32_t rng = 2463534242u + worker->id;
+    uint32_t checksum = 0;
+    
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (long i = 0; i < lookup_count; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        int index = (int)(((uint64_t)rng * position_count) >> 32);
+        checksum ^= tt_analyze(position_x[index], position_o[index]);
+    }
+    worker->elapsed_ns = now_ns() - start;
+    worker->checksum = checksum;
+    return NULL;
+}
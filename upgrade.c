@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "upgrade.h"
+
+static int fill_address(const char* path, struct sockaddr_un* addr);
+
+int upgrade_listen(const char* path) {
+    struct sockaddr_un addr;
+    if (fill_address(path, &addr) < 0) {
+        return -1;
+    }
+    
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Upgrade socket creation failed");
+        return -1;
+    }
+    
+    // A socket left behind by a previous run would make bind fail. Whoever
+    // connects gets every client, so only the owner may.
+    unlink(path);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 ||
+        listen(sock, 1) < 0) {
+        perror("Upgrade socket bind failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int upgrade_accept(int listen_sock) {
+    while (1) {
+        int sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Upgrade accept failed");
+            return -1;
+        }
+        
+        struct ucred peer;
+        socklen_t length = sizeof(peer);
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 &&
+            peer.uid == geteuid()) {
+            return sock;
+        }
+        fprintf(stderr, "Refused an upgrade from another user\n");
+        close(sock);
+    }
+}
+
+int upgrade_connect(const char* path) {
+    struct sockaddr_un addr;
+    if (fill_address(path, &addr) < 0) {
+        return -1;
+    }
+    
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("Upgrade socket creation failed");
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Failed to reach the running server");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void upgrade_begin(UpgradeMessage* message, int type) {
+    message->type = type;
+    message->length = 0;
+    message->fd_count = 0;
+}
+
+bool upgrade_put(int sock, UpgradeMessage* message, const void* record, size_t length, int fd) {
+    if (message->length + length > UPGRADE_MESSAGE_SIZE ||
+        (fd >= 0 && message->fd_count == UPGRADE_MAX_FDS)) {
+        if (!upgrade_flush(sock, message)) {
+            return false;
+        }
+    }
+    if (length > 0) {
+        memcpy(message->data + message->length, record, length);
+        message->length += length;
+    }
+    if (fd >= 0) {
+        message->fds[message->fd_count++] = fd;
+    }
+    return true;
+}
+
+bool upgrade_flush(int sock, UpgradeMessage* message) {
+    uint8_t type = message->type;
+    struct iovec iov[2] = {
+        { .iov_base = &type, .iov_len = 1 },
+        { .iov_base = message->data, .iov_len = message->length },
+    };
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = iov;
+    header.msg_iovlen = 2;
+    
+    // The sockets ride along as SCM_RIGHTS and arrive as new descriptors
+    if (message->fd_count > 0) {
+        header.msg_control = control.buffer;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * message->fd_count);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * message->fd_count);
+        memcpy(CMSG_DATA(cmsg), message->fds, sizeof(int) * message->fd_count);
+    }
+    
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &header, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        perror("Upgrade send failed");
+        return false;
+    }
+    message->length = 0;
+    message->fd_count = 0;
+    return true;
+}
+
+bool upgrade_receive(int sock, UpgradeMessage* message) {
+    uint8_t type;
+    struct iovec iov[2] = {
+        { .iov_base = &type, .iov_len = 1 },
+        { .iov_base = message->data, .iov_len = UPGRADE_MESSAGE_SIZE },
+    };
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = iov;
+    header.msg_iovlen = 2;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    
+    ssize_t received;
+    do {
+        received = recvmsg(sock, &header, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0) {
+        perror("Upgrade receive failed");
+        return false;
+    }
+    if (received == 0) {
+        fprintf(stderr, "The running server closed the upgrade socket\n");
+        return false;
+    }
+    
+    message->type = type;
+    message->length = received - 1;
+    message->fd_count = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&header, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(message->fds + message->fd_count, CMSG_DATA(cmsg), sizeof(int) * count);
+            message->fd_count += count;
+        }
+    }
+    
+    // Sockets that did not fit are closed by the kernel and lost with their clients
+    if (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        fprintf(stderr, "Upgrade message was truncated\n");
+        return false;
+    }
+    return true;
+}
+
+static int fill_address(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Upgrade socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
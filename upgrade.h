@@ -0,0 +1,132 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Handing a running server over to a new binary without dropping anyone.
+//
+// Every server listens on an upgrade socket. A new server started with -u
+// connects to it and gets the listen sockets first, so that it can set
+// itself up while the old one keeps serving. Once it is ready, the old
+// server stops its workers at the end of their current batch and sends
+// every client socket and the state of every room and connection, the file
+// descriptors riding along as SCM_RIGHTS. It then exits without closing
+// anything the new server now holds, so clients only notice a short pause.
+// The socket is SOCK_SEQPACKET, so every message arrives whole and with
+// its own sockets.
+//
+// Messages start with their type:
+//   HELLO        UpgradeHello, with the listen socket of every shard, then
+//                the Unix one for local clients
+//   READY        from the new server: set up and waiting for the rest
+//   CONNECTIONS  UpgradeConnection records, each followed by its unread
+//                input, with one socket per record
+//   ROOMS        UpgradeRoom records, each followed by the X and O cells of
+//                every row (4 bytes each, bit col)
+//   OUTPUT       socket number in the old server (4 bytes), then output it
+//                had not sent yet
+//   END          CLOCK_MONOTONIC time in ns at which the old server stopped
+//                serving (8 bytes); everything has been sent
+//   RECEIVED     from the new server: it has everything. Until now the old
+//                server can still go back to serving if the new one fails.
+//   DONE         the old server has closed its journal, trace and sockets
+//                and is exiting
+// Records are copied as they are laid out in memory, so both servers must
+// be built for the same machine.
+
+#define UPGRADE_MAGIC "TTTUPGR"
+#define UPGRADE_VERSION 3
+#define UPGRADE_MAX_FDS 253              // SCM_MAX_FD, sockets per message
+#define UPGRADE_MESSAGE_SIZE (64 * 1024)
+
+// Message types
+#define UPGRADE_HELLO 1
+#define UPGRADE_READY 2
+#define UPGRADE_CONNECTIONS 3
+#define UPGRADE_ROOMS 4
+#define UPGRADE_OUTPUT 5
+#define UPGRADE_END 6
+#define UPGRADE_RECEIVED 7
+#define UPGRADE_DONE 8
+
+// What a connection was doing when the old server stopped
+#define UPGRADE_SEATED 0      // In a room
+#define UPGRADE_ACCEPTED 1    // Accepted and on its way to a shard's inbox
+#define UPGRADE_RESUMING 2    // On its way to the shard running the game it resumes
+#define UPGRADE_MATCHING 3    // On its way to the shard of the player it was paired with
+#define UPGRADE_SPECTATING 4  // Watching a room, or on its way to watch one
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t shard_count;   // Listen sockets that come with this message
+    uint32_t local_count;   // 1 if the Unix listen socket follows them
+} UpgradeHello;
+
+typedef struct {
+    int32_t fd;             // Socket number in the old server, which rooms refer to
+    int32_t room;           // -1 if not seated or watching
+    uint64_t resume_token;  // Seat being claimed (UPGRADE_RESUMING)
+    uint32_t out_length;    // Unsent output, in OUTPUT messages
+    uint16_t recv_length;   // Unread input following the record
+    uint16_t shard;         // Shard that was to take it (UPGRADE_ACCEPTED)
+    uint8_t state;
+    uint8_t seat;
+    uint8_t binary;
+    uint8_t recv_discard;
+    uint8_t deltas;
+    uint8_t local;          // Came in through the Unix listen socket
+} UpgradeConnection;
+
+typedef struct {
+    uint32_t room;
+    int32_t seats[2];       // Socket numbers in the old server, -1 for an empty seat
+    uint64_t tokens[2];
+    uint16_t state_seq;
+    uint8_t game_active;
+    uint8_t bot_level;
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t k;
+    uint8_t current_player;
+} UpgradeRoom;
+
+// One message being filled or just received
+typedef struct {
+    int type;
+    size_t length;
+    int fd_count;
+    int fds[UPGRADE_MAX_FDS];
+    uint8_t data[UPGRADE_MESSAGE_SIZE];
+} UpgradeMessage;
+
+// Listens for a new server on the Unix socket at path. Returns the socket,
+// or -1 after printing the error.
+int upgrade_listen(const char* path);
+
+// Waits for a new server and returns its connection, or -1 after printing
+// the error. Connections from other users are refused.
+int upgrade_accept(int listen_sock);
+
+// Connects to the running server's upgrade socket. Returns the socket, or
+// -1 after printing the error.
+int upgrade_connect(const char* path);
+
+// Starts an empty message of the given type
+void upgrade_begin(UpgradeMessage* message, int type);
+
+// Appends a record and the socket that goes with it (-1 for none), first
+// sending what the message holds if the record would not fit. Records must
+// be shorter than UPGRADE_MESSAGE_SIZE. Returns false if sending failed.
+bool upgrade_put(int sock, UpgradeMessage* message, const void* record, size_t length, int fd);
+
+// Sends the message and empties it
+bool upgrade_flush(int sock, UpgradeMessage* message);
+
+// Receives the next message. Returns false after printing the error, or
+// if the other side has gone away.
+bool upgrade_receive(int sock, UpgradeMessage* message);
+
+#endif
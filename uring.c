@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/time_types.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int uring_init(Uring* ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    
+    // Completions are only run when the shard enters the ring to wait, and
+    // only the shard's own thread ever submits. Older kernels without
+    // these modes get a plain ring.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4;
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring->fd = sys_io_uring_setup(entries, &params);
+    }
+    if (ring->fd < 0) {
+        perror("io_uring setup failed");
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "io_uring is too old on this kernel, need 6.0 or later\n");
+        close(ring->fd);
+        return -1;
+    }
+    
+    // Both rings share one mapping where the kernel allows it
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+        ring->cq_map_size = 0;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        perror("io_uring mmap failed");
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_map = ring->sq_map;
+    if (ring->cq_map_size > 0) {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            perror("io_uring mmap failed");
+            munmap(ring->sq_map, ring->sq_map_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("io_uring mmap failed");
+        uring_close(ring);
+        return -1;
+    }
+    
+    char* sq = ring->sq_map;
+    char* cq = ring->cq_map;
+    ring->sq_head = (_Atomic unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_pending = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    ring->cq_head = (_Atomic unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    
+    // Submission slot i always holds entry i
+    unsigned* array = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+int uring_add_buffers(Uring* ring, uint16_t group, unsigned count, unsigned size) {
+    if (count == 0 || count > 32768 || (count & (count - 1)) != 0) {
+        fprintf(stderr, "Provided buffer count must be a power of two up to 32768\n");
+        return -1;
+    }
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc((size_t)count * size);
+    if (ring->buffer_ring == MAP_FAILED || ring->buffers == NULL) {
+        perror("Failed to allocate receive buffers");
+        return -1;
+    }
+    ring->buffer_count = count;
+    ring->buffer_size = size;
+    ring->buffer_group = group;
+    ring->buffer_tail = 0;
+    
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buffer_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("Failed to register receive buffers");
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        uring_recycle(ring, (uint16_t)i);
+    }
+    return 0;
+}
+
+int uring_enter(Uring* ring, bool wait, int timeout_ms) {
+    unsigned submitted = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    unsigned to_submit = ring->sq_pending - submitted;
+    atomic_store_explicit(ring->sq_tail, ring->sq_pending, memory_order_release);
+    if (to_submit == 0 && !wait) {
+        return 0;
+    }
+    
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = 0;
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    
+    ring->enters++;
+    int result = sys_io_uring_enter(ring->fd, to_submit, wait ? 1 : 0, flags,
+                                    wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    return result < 0 ? -errno : 0;
+}
+
+void uring_close(Uring* ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    if (ring->sq_map != NULL) {
+        munmap(ring->sq_map, ring->sq_map_size);
+    }
+    if (ring->buffer_ring != NULL && ring->buffer_ring != MAP_FAILED) {
+        munmap(ring->buffer_ring, ring->buffer_count * sizeof(struct io_uring_buf));
+    }
+    free(ring->buffers);
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
@@ -0,0 +1,177 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper over the raw system calls.
+//
+// Requests are written into the mapped submission queue and handed to the
+// kernel in bulk by the next io_uring_enter, which also waits for
+// completions: one system call both sends a whole batch of output and
+// sleeps until the next event. Multishot requests (accept, recv, poll)
+// stay armed and post a completion per event until they end, which
+// io_uring reports by leaving IORING_CQE_F_MORE clear.
+//
+// Multishot recv takes its memory from a ring of provided buffers: the
+// kernel picks a free buffer when data arrives and names it in the
+// completion, and the buffer goes back on the ring once the data has been
+// copied out.
+
+typedef struct {
+    int fd;
+    
+    // Submission queue. Entries up to sq_pending are written but not yet
+    // published to the kernel.
+    _Atomic unsigned* sq_head;
+    _Atomic unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;
+    struct io_uring_sqe* sqes;
+    
+    // Completion queue
+    _Atomic unsigned* cq_head;
+    _Atomic unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    
+    // Provided buffers, all of buffer_size bytes
+    struct io_uring_buf_ring* buffer_ring;
+    char* buffers;
+    unsigned buffer_count;
+    unsigned buffer_size;
+    uint16_t buffer_tail;
+    uint16_t buffer_group;
+    
+    // Mappings, for uring_close
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    
+    uint64_t enters;  // io_uring_enter calls made, for the caller to count
+} Uring;
+
+// Sets up a ring with room for entries submissions and four times as many
+// completions. Returns -1 after printing the error.
+int uring_init(Uring* ring, unsigned entries);
+
+// Registers count provided buffers of size bytes as group. Returns -1
+// after printing the error.
+int uring_add_buffers(Uring* ring, uint16_t group, unsigned count, unsigned size);
+
+// Hands the pending submissions to the kernel and, with wait set, sleeps
+// until a completion arrives or timeout_ms passes (-1 for no limit).
+// Returns 0, or -errno; -ETIME and -EINTR only mean nothing arrived.
+int uring_enter(Uring* ring, bool wait, int timeout_ms);
+
+void uring_close(Uring* ring);
+
+// Submission slots left before the queue must be entered
+static inline unsigned uring_space(Uring* ring) {
+    unsigned head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    return ring->sq_entries - (ring->sq_pending - head);
+}
+
+// Makes sure count entries can be written before the queue must be
+// entered, so that a linked chain is never split between two calls into
+// the kernel
+static inline void uring_reserve(Uring* ring, unsigned count) {
+    if (uring_space(ring) < count) {
+        uring_enter(ring, false, 0);
+    }
+}
+
+// Returns a zeroed submission entry, entering the pending ones first if
+// the queue is full
+static inline struct io_uring_sqe* uring_sqe(Uring* ring) {
+    uring_reserve(ring, 1);
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sq_pending & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_pending++;
+    return sqe;
+}
+
+// Next completion, or NULL if there is none yet
+static inline struct io_uring_cqe* uring_peek(Uring* ring) {
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Frees the slot of the completion uring_peek returned
+static inline void uring_advance(Uring* ring) {
+    unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+static inline char* uring_buffer(Uring* ring, uint16_t id) {
+    return ring->buffers + (size_t)id * ring->buffer_size;
+}
+
+// Puts a buffer the kernel filled back on the ring
+static inline void uring_recycle(Uring* ring, uint16_t id) {
+    struct io_uring_buf* buf = &ring->buffer_ring->bufs[ring->buffer_tail & (ring->buffer_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, id);
+    buf->len = ring->buffer_size;
+    buf->bid = id;
+    ring->buffer_tail++;
+    atomic_store_explicit((_Atomic uint16_t*)&ring->buffer_ring->tail, ring->buffer_tail,
+                          memory_order_release);
+}
+
+static inline void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, int flags,
+                                               uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_recv_multishot(struct io_uring_sqe* sqe, int fd, uint16_t group,
+                                             uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, uint32_t events,
+                                             uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* data,
+                                   uint32_t length, int flags, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = length;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+}
+
+// Cancels every request on fd, or with fd < 0 every request in the ring
+static inline void uring_prep_cancel(struct io_uring_sqe* sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = fd >= 0 ? IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL
+                                : IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = user_data;
+}
+
+#endif
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+
+// Checks the chains of linked sends the io_uring backend writes output
+// with. The socket buffer is shrunk far below the size of a chain, so the
+// kernel can only take part of a chunk at a time, as with a slow client.
+
+#define CHUNK_COUNT 8           // As MAX_WRITE_IOVECS in the server
+#define CHUNK_WORDS 16384       // 64 KiB of 32-bit words per chunk
+#define READ_DELAY_US 100000    // How long the reader lets the sends pile up
+#define WAIT_TIMEOUT_MS 5000
+
+typedef struct {
+    int fd;
+    size_t read_limit;  // Bytes read before the reader hangs up
+    size_t received;
+    uint32_t* data;
+} Reader;
+
+// The stream is the words 0, 1, 2... split over the chunks, so any byte
+// that goes out twice or out of order shows up
+uint32_t chunks[CHUNK_COUNT][CHUNK_WORDS];
+
+// Function prototypes
+void* run_reader(void* arg);
+bool run_chain(const char* name, size_t read_limit);
+
+int main() {
+    for (int i = 0; i < CHUNK_COUNT; i++) {
+        for (int j = 0; j < CHUNK_WORDS; j++) {
+            chunks[i][j] = i * CHUNK_WORDS + j;
+        }
+    }
+    
+    // A slow reader: every send comes up short at least once but must still
+    // complete whole, in order
+    bool passed = run_chain("Partial sends", sizeof(chunks));
+    
+    // A reader that hangs up: the send cut short fails the link, and the
+    // sends after it are cancelled without sending anything
+    passed &= run_chain("Peer hangs up", sizeof(chunks[0]) + sizeof(chunks[0]) / 2);
+    
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void* run_reader(void* arg) {
+    Reader* reader = arg;
+    usleep(READ_DELAY_US);
+    char* bytes = (char*)reader->data;
+    while (reader->received < reader->read_limit) {
+        size_t want = reader->read_limit - reader->received;
+        ssize_t got = read(reader->fd, bytes + reader->received, want < 4096 ? want : 4096);
+        if (got <= 0) {
+            break;
+        }
+        reader->received += got;
+    }
+    close(reader->fd);
+    return NULL;
+}
+
+// Sends the chunks as one chain, the way the server's submit_output does,
+// and checks the completions and the bytes that arrived
+bool run_chain(const char* name, size_t read_limit) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        perror("Socket pair failed");
+        exit(EXIT_FAILURE);
+    }
+    int small = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    fcntl(fds[1], F_SETFL, 0);
+    
+    Uring ring;
+    if (uring_init(&ring, CHUNK_COUNT) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    
+    Reader reader = { fds[1], read_limit, 0, calloc(1, sizeof(chunks)) };
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_reader, &reader);
+    
+    for (int i = 0; i < CHUNK_COUNT; i++) {
+        struct io_uring_sqe* sqe = uring_sqe(&ring);
+        uring_prep_send(sqe, fds[0], chunks[i], sizeof(chunks[i]), MSG_NOSIGNAL | MSG_WAITALL, i);
+        if (i < CHUNK_COUNT - 1) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+    
+    int results[CHUNK_COUNT];
+    int completed = 0;
+    bool in_order = true;
+    while (completed < CHUNK_COUNT) {
+        int error = uring_enter(&ring, true, WAIT_TIMEOUT_MS);
+        if (error < 0 && error != -ETIME && error != -EINTR) {
+            errno = -error;
+            perror("Ring enter failed");
+            exit(EXIT_FAILURE);
+        }
+        struct io_uring_cqe* cqe = uring_peek(&ring);
+        if (cqe == NULL && error == -ETIME) {
+            fprintf(stderr, "%s: timed out with %d of %d sends complete\n", name, completed, CHUNK_COUNT);
+            exit(EXIT_FAILURE);
+        }
+        for (; cqe != NULL; cqe = uring_peek(&ring)) {
+            in_order &= cqe->user_data == (uint64_t)completed;
+            results[completed++] = cqe->res;
+            uring_advance(&ring);
+        }
+    }
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    uring_close(&ring);
+    
+    bool passed = in_order;
+    if (!in_order) {
+        printf("%s: sends completed out of order\n", name);
+    }
+    
+    // Every send is whole up to the first short one, which fails the link
+    size_t sent = 0;
+    int short_send = CHUNK_COUNT;
+    for (int i = 0; i < CHUNK_COUNT; i++) {
+        if (i > short_send) {
+            if (results[i] != -ECANCELED) {
+                printf("%s: send %d after the short one returned %d, not -ECANCELED\n",
+                       name, i, results[i]);
+                passed = false;
+            }
+        } else if (results[i] != (int)sizeof(chunks[i])) {
+            short_send = i;
+            sent += results[i] > 0 ? results[i] : 0;
+        } else {
+            sent += results[i];
+        }
+    }
+    bool expect_short = read_limit < sizeof(chunks);
+    if ((short_send < CHUNK_COUNT) != expect_short) {
+        printf("%s: %s\n", name, expect_short ? "every send completed despite the hang-up"
+                                               : "a send came up short");
+        passed = false;
+    }
+    
+    // The reader got the stream intact, and no more than the sends reported
+    if (!expect_short && reader.received != sizeof(chunks)) {
+        printf("%s: only %zu of %zu bytes arrived\n", name, reader.received, sizeof(chunks));
+        passed = false;
+    } else if (reader.received > sent) {
+        printf("%s: %zu bytes arrived but the sends reported %zu\n", name, reader.received, sent);
+        passed = false;
+    }
+    if (memcmp(reader.data, chunks, reader.received) != 0) {
+        printf("%s: the bytes arrived scrambled\n", name);
+        passed = false;
+    }
+    free(reader.data);
+    
+    printf("%s: %s (%zu bytes sent, %zu read)\n", name, passed ? "ok" : "FAILED", sent, reader.received);
+    return passed;
+}